@@ -0,0 +1,555 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+    Replays raw Rhythm USB blocks through the same decode path as
+    DeviceThread::updateBuffer(), without a board or the GUI.
+
+    Usage:
+        rhythm-decode-benchmark [--isa scalar|sse2|avx2] [--seconds s]
+            synthesizes frames for 1-8 streams (USB2) and 1-16 streams (USB3)
+
+        rhythm-decode-benchmark --capture file [--streams n] [--usb3] [--isa ...] [--seconds s]
+            replays a recorded stream of raw USB blocks; --streams and --usb3
+            are read from the header of files written by Rhd2000RawWriter
+
+        rhythm-decode-benchmark --simulate [--usb3] [--record file [--direct-io]] [--isa ...] [--seconds s]
+            acquires from a simulated board (8 streams over USB2, 16 over USB3)
+            in real time, through Rhd2000EvalBoard, optionally recording the
+            raw USB data to a capture file
+
+    For each configuration, prints decoded samples per second, nanoseconds
+    per frame and heap allocations per block, and whether the decoded output
+    matches the generic loop with scalar conversion (checksum over all blocks). Simulated acquisitions also
+    print the time spent in pipe reads, the FIFO high-water mark and the
+    number of samples lost to FIFO overflow, and recordings print the time
+    spent handing each block to the writer.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AllocationCounter.h"
+#include "BlockDecoder.h"
+#include "rhythm-api/rhd2000datablock.h"
+#include "rhythm-api/rhd2000evalboard.h"
+#include "rhythm-api/rhd2000rawwriter.h"
+#include "rhythm-api/rhd2000simulator.h"
+
+using namespace RhythmNode;
+
+#define MAX_BENCHMARK_STREAMS 16
+
+struct Configuration
+{
+    int numStreams;
+    bool usb3;
+};
+
+struct Result
+{
+    double samplesPerSecond;
+    double nanosecondsPerFrame;
+    double allocationsPerBlock;
+    int64_t numBlocks;
+    bool checksumMatches;
+};
+
+/** Builds numBlocks blocks of valid frames with consecutive timestamps */
+static std::vector<unsigned char> synthesizeBlocks(int numStreams, int samplesPerBlock, int numBlocks)
+{
+    const int frameSize = BlockDecoder::getFrameSizeInBytes(numStreams);
+    const uint64_t magic = RHD2000_HEADER_MAGIC_NUMBER;
+
+    std::vector<unsigned char> data((size_t) frameSize * samplesPerBlock * numBlocks);
+
+    uint32_t seed = 12345;
+
+    for (int frame = 0; frame < samplesPerBlock * numBlocks; frame++)
+    {
+        unsigned char* ptr = data.data() + (size_t) frame * frameSize;
+
+        for (int i = 0; i < frameSize; i += 2)
+        {
+            seed = seed * 1664525 + 1013904223;
+            uint16_t word = uint16_t(seed >> 16);
+            memcpy(ptr + i, &word, sizeof(word));
+        }
+
+        uint32_t timestamp = (uint32_t) frame;
+
+        memcpy(ptr, &magic, sizeof(magic));
+        memcpy(ptr + 8, &timestamp, sizeof(timestamp));
+    }
+
+    return data;
+}
+
+static void setFullLayout(BlockDecoder& decoder, int numStreams)
+{
+    // all channels, aux inputs and ADCs enabled, as in a full acquisition
+    int channelsPerStream[MAX_BENCHMARK_STREAMS];
+    bool halfChannels[MAX_BENCHMARK_STREAMS];
+    bool auxChannels[MAX_BENCHMARK_STREAMS];
+
+    for (int i = 0; i < numStreams; i++)
+    {
+        channelsPerStream[i] = 32;
+        halfChannels[i] = false;
+        auxChannels[i] = true;
+    }
+
+    decoder.setLayout(numStreams, channelsPerStream, halfChannels, auxChannels, true);
+
+    for (int adc = 0; adc < 8; adc++)
+        decoder.setAdcConversion(adc, 0.00015258789, -5, -0.4096);
+
+    decoder.resetStreamState();
+}
+
+/** Decodes every block in data once and returns an FNV-1a hash of the samples, sample numbers and event codes */
+static uint64_t checksumBlocks(BlockDecoder& decoder, const std::vector<unsigned char>& data, int numStreams, int samplesPerBlock)
+{
+    const size_t blockBytes = (size_t) BlockDecoder::getFrameSizeInBytes(numStreams) * samplesPerBlock;
+    const int stride = decoder.getNumChannels();
+
+    std::vector<float> sampleBlock((size_t) samplesPerBlock * stride);
+    std::vector<long long> sampleNumbers(samplesPerBlock);
+    std::vector<unsigned long long> eventCodes(samplesPerBlock);
+
+    uint64_t hash = 14695981039346656037ULL;
+
+    auto mix = [&hash](const void* bytes, size_t size)
+    {
+        const unsigned char* ptr = (const unsigned char*) bytes;
+
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ ptr[i]) * 1099511628211ULL;
+    };
+
+    for (size_t offset = 0; offset + blockBytes <= data.size(); offset += blockBytes)
+    {
+        int numFrames = decoder.decodeBlock(data.data() + offset,
+                                            samplesPerBlock,
+                                            sampleBlock.data(),
+                                            stride,
+                                            sampleNumbers.data(),
+                                            eventCodes.data());
+
+        mix(&numFrames, sizeof(numFrames));
+        mix(sampleBlock.data(), (size_t) numFrames * stride * sizeof(float));
+        mix(sampleNumbers.data(), numFrames * sizeof(long long));
+        mix(eventCodes.data(), numFrames * sizeof(unsigned long long));
+    }
+
+    return hash;
+}
+
+static Result runBenchmark(const std::vector<unsigned char>& data,
+                           int numStreams,
+                           int samplesPerBlock,
+                           DecoderInstructionSet instructionSet,
+                           double seconds)
+{
+    BlockDecoder decoder;
+
+    setFullLayout(decoder, numStreams);
+    decoder.setInstructionSet(instructionSet);
+
+    Result result;
+    result.numBlocks = 0;
+
+    // the decoder under test must match the generic loop with scalar conversion bit for bit
+    BlockDecoder reference;
+
+    setFullLayout(reference, numStreams);
+    reference.setSpecializedKernelsEnabled(false);
+    reference.setInstructionSet(DECODER_SCALAR);
+
+    result.checksumMatches = checksumBlocks(decoder, data, numStreams, samplesPerBlock)
+        == checksumBlocks(reference, data, numStreams, samplesPerBlock);
+
+    decoder.resetStreamState();
+
+    const size_t blockBytes = (size_t) BlockDecoder::getFrameSizeInBytes(numStreams) * samplesPerBlock;
+    const int numBlocksInData = int(data.size() / blockBytes);
+
+    // staging buffers, sized once as in DeviceThread::startAcquisition()
+    const int stride = decoder.getNumChannels();
+
+    std::vector<float> sampleBlock((size_t) samplesPerBlock * stride);
+    std::vector<long long> sampleNumbers(samplesPerBlock);
+    std::vector<unsigned long long> eventCodes(samplesPerBlock);
+
+    int64_t numFrames = 0;
+
+    uint64_t allocationsBefore = getNumAllocations();
+
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::duration<double>(seconds);
+
+    while (std::chrono::steady_clock::now() < end)
+    {
+        // check the clock every 64 blocks, so timing doesn't dominate small configurations
+        for (int i = 0; i < 64; i++)
+        {
+            const unsigned char* block = data.data() + (result.numBlocks % numBlocksInData) * blockBytes;
+
+            numFrames += decoder.decodeBlock(block,
+                                             samplesPerBlock,
+                                             sampleBlock.data(),
+                                             stride,
+                                             sampleNumbers.data(),
+                                             eventCodes.data());
+
+            result.numBlocks++;
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t allocations = getNumAllocations() - allocationsBefore;
+
+    result.samplesPerSecond = double(numFrames) / elapsed;
+    result.nanosecondsPerFrame = elapsed * 1e9 / double(numFrames);
+    result.allocationsPerBlock = double(allocations) / double(result.numBlocks);
+
+    if (decoder.getNumResyncs() > 0)
+        fprintf(stderr, "warning: %lld resyncs while decoding\n", (long long) decoder.getNumResyncs());
+
+    return result;
+}
+
+static void printResult(const char* source, int numStreams, bool usb3, DecoderInstructionSet isa, const Result& r)
+{
+    printf("%-10s %7d %5s %7s %14.0f %10.1f %12.2f %9s\n",
+           source,
+           numStreams,
+           usb3 ? "USB3" : "USB2",
+           BlockDecoder::getInstructionSetName(isa),
+           r.samplesPerSecond,
+           r.nanosecondsPerFrame,
+           r.allocationsPerBlock,
+           r.checksumMatches ? "ok" : "MISMATCH");
+}
+
+/** Acquires from a simulated board in real time, reading whole blocks as soon as the FIFO holds them */
+static int runSimulation(bool usb3,
+                         DecoderInstructionSet instructionSet,
+                         double seconds,
+                         const std::string& recordFile,
+                         bool directIo)
+{
+    Rhd2000Simulator* simulator = new Rhd2000Simulator(usb3);
+    Rhd2000EvalBoard board(simulator);
+
+    if (board.open(nullptr) != 1 || !board.uploadFpgaBitfile("simulated"))
+        return 1;
+
+    board.initialize();
+
+    const int numStreams = usb3 ? MAX_NUM_DATA_STREAMS_USB3 : MAX_NUM_DATA_STREAMS_USB2;
+
+    // Ports A-D, then the DDR sources of the RHD2164s on the same ports
+    for (int stream = 0; stream < numStreams; stream++)
+    {
+        board.setDataSource(stream, Rhd2000EvalBoard::BoardDataSource(stream));
+        board.enableDataStream(stream, true);
+    }
+
+    for (int port = Rhd2000EvalBoard::PortA; port <= Rhd2000EvalBoard::PortD; port++)
+        board.setCableDelay(Rhd2000EvalBoard::BoardPort(port), 2);
+
+    BlockDecoder decoder;
+
+    setFullLayout(decoder, numStreams);
+    decoder.setInstructionSet(instructionSet);
+
+    const int samplesPerBlock = SAMPLES_PER_DATA_BLOCK(usb3);
+    const unsigned int blockWords = Rhd2000DataBlock::calculateDataBlockSizeInWords(numStreams, usb3);
+    const int stride = decoder.getNumChannels();
+
+    std::vector<unsigned char> buffer(2 * (size_t) blockWords);
+    std::vector<float> sampleBlock((size_t) samplesPerBlock * stride);
+    std::vector<long long> sampleNumbers(samplesPerBlock);
+    std::vector<unsigned long long> eventCodes(samplesPerBlock);
+
+    Rhd2000RawWriter writer;
+
+    if (!recordFile.empty() && !writer.open(recordFile, numStreams, usb3, board.getSampleRate(), directIo))
+        return 1;
+
+    board.setContinuousRunMode(true);
+    board.setMaxTimeStep(4294967295);
+    board.run();
+
+    int64_t numBlocks = 0;
+    int64_t numFrames = 0;
+    double pipeSeconds = 0;
+    double decodeSeconds = 0;
+    double recordSeconds = 0;
+    unsigned int fifoHighWater = 0;
+    int64_t numReadErrors = 0;
+    uint64_t allocations = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::duration<double>(seconds);
+
+    while (std::chrono::steady_clock::now() < end)
+    {
+        Rhd2000EvalBoard::FifoMetrics metrics;
+        board.readFifoMetrics(metrics);
+
+        fifoHighWater = metrics.numWordsInFifo > fifoHighWater ? metrics.numWordsInFifo : fifoHighWater;
+
+        if (metrics.numWordsInFifo < blockWords)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        auto readStart = std::chrono::steady_clock::now();
+
+        if (!board.readRawDataBlockInto(buffer.data()))
+        {
+            numReadErrors++;
+            continue;
+        }
+
+        auto recordStart = std::chrono::steady_clock::now();
+
+        if (writer.isOpen())
+            writer.append(buffer.data(), buffer.size());
+
+        auto decodeStart = std::chrono::steady_clock::now();
+
+        // only count the decoder's allocations, not the simulator's
+        uint64_t allocationsBefore = getNumAllocations();
+
+        numFrames += decoder.decodeBlock(buffer.data(),
+                                         samplesPerBlock,
+                                         sampleBlock.data(),
+                                         stride,
+                                         sampleNumbers.data(),
+                                         eventCodes.data());
+
+        allocations += getNumAllocations() - allocationsBefore;
+
+        auto decodeEnd = std::chrono::steady_clock::now();
+
+        pipeSeconds += std::chrono::duration<double>(recordStart - readStart).count();
+        recordSeconds += std::chrono::duration<double>(decodeStart - recordStart).count();
+        decodeSeconds += std::chrono::duration<double>(decodeEnd - decodeStart).count();
+        numBlocks++;
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    board.setContinuousRunMode(false);
+    board.setMaxTimeStep(0);
+    board.flush();
+
+    writer.close();
+
+    if (numBlocks == 0)
+    {
+        fprintf(stderr, "no blocks were read\n");
+        return 1;
+    }
+
+    printf("%-10s %7s %5s %7s %14s %10s %12s %12s %14s %10s\n",
+           "source", "streams", "usb", "isa", "samples/s", "ns/frame", "allocs/block",
+           "pipe ms/blk", "fifo max words", "dropped");
+
+    printf("%-10s %7d %5s %7s %14.0f %10.1f %12.2f %12.3f %14u %10llu\n",
+           "simulated",
+           numStreams,
+           usb3 ? "USB3" : "USB2",
+           BlockDecoder::getInstructionSetName(instructionSet),
+           double(numFrames) / elapsed,
+           decodeSeconds * 1e9 / double(numFrames),
+           double(allocations) / double(numBlocks),
+           pipeSeconds * 1e3 / double(numBlocks),
+           fifoHighWater,
+           (unsigned long long) simulator->getNumDroppedSamples());
+
+    if (!recordFile.empty())
+        printf("recorded %llu bytes to %s%s, %.1f us/blk to append, %llu bytes dropped\n",
+               (unsigned long long) writer.getNumBytesAppended(),
+               recordFile.c_str(),
+               writer.isDirectIo() ? " (direct I/O)" : "",
+               recordSeconds * 1e6 / double(numBlocks),
+               (unsigned long long) writer.getNumBytesDropped());
+
+    if (numReadErrors > 0)
+        fprintf(stderr, "warning: %lld failed pipe reads\n", (long long) numReadErrors);
+
+    if (decoder.getNumGaps() > 0)
+        fprintf(stderr, "warning: %lld timestamp gaps while decoding\n", (long long) decoder.getNumGaps());
+
+    return 0;
+}
+
+static void printUsage()
+{
+    fprintf(stderr,
+            "usage: rhythm-decode-benchmark [--capture file [--streams n] [--usb3] | "
+            "--simulate [--usb3] [--record file [--direct-io]]] "
+            "[--isa scalar|sse2|avx2] [--seconds s]\n");
+}
+
+int main(int argc, char** argv)
+{
+    std::string captureFile;
+    int captureStreams = 0;
+    bool captureUsb3 = false;
+    bool simulate = false;
+    std::string recordFile;
+    bool directIo = false;
+    double seconds = 0.5;
+
+    DecoderInstructionSet isa = BlockDecoder::detectInstructionSet();
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--capture" && i + 1 < argc)
+            captureFile = argv[++i];
+        else if (arg == "--streams" && i + 1 < argc)
+            captureStreams = atoi(argv[++i]);
+        else if (arg == "--usb3")
+            captureUsb3 = true;
+        else if (arg == "--simulate")
+            simulate = true;
+        else if (arg == "--record" && i + 1 < argc)
+            recordFile = argv[++i];
+        else if (arg == "--direct-io")
+            directIo = true;
+        else if (arg == "--seconds" && i + 1 < argc)
+            seconds = atof(argv[++i]);
+        else if (arg == "--isa" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+
+            if (name == "scalar")
+                isa = DECODER_SCALAR;
+            else if (name == "sse2")
+                isa = DECODER_SSE2;
+            else if (name == "avx2")
+                isa = DECODER_AVX2;
+            else
+            {
+                printUsage();
+                return 1;
+            }
+        }
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
+
+    if (isa > BlockDecoder::detectInstructionSet())
+    {
+        fprintf(stderr, "%s is not supported on this CPU\n", BlockDecoder::getInstructionSetName(isa));
+        return 1;
+    }
+
+    if (simulate)
+        return runSimulation(captureUsb3, isa, seconds, recordFile, directIo);
+
+    printf("%-10s %7s %5s %7s %14s %10s %12s %9s\n",
+           "source", "streams", "usb", "isa", "samples/s", "ns/frame", "allocs/block", "checksum");
+
+    if (!captureFile.empty())
+    {
+        std::ifstream in(captureFile, std::ios::binary);
+
+        if (!in)
+        {
+            fprintf(stderr, "could not open %s\n", captureFile.c_str());
+            return 1;
+        }
+
+        // raw capture files describe their own layout; headerless recordings need --streams
+        double captureSampleRate;
+
+        if (!Rhd2000RawWriter::readHeader(in, captureStreams, captureUsb3, captureSampleRate))
+        {
+            in.clear();
+            in.seekg(0);
+        }
+
+        if (captureStreams < 1 || captureStreams > MAX_BENCHMARK_STREAMS)
+        {
+            fprintf(stderr, "--streams must be between 1 and %d\n", MAX_BENCHMARK_STREAMS);
+            return 1;
+        }
+
+        std::vector<unsigned char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        int samplesPerBlock = SAMPLES_PER_DATA_BLOCK(captureUsb3);
+        size_t blockBytes = (size_t) BlockDecoder::getFrameSizeInBytes(captureStreams) * samplesPerBlock;
+
+        if (data.size() < blockBytes)
+        {
+            fprintf(stderr, "%s holds less than one block\n", captureFile.c_str());
+            return 1;
+        }
+
+        Result r = runBenchmark(data, captureStreams, samplesPerBlock, isa, seconds);
+        printResult("capture", captureStreams, captureUsb3, isa, r);
+
+        return r.checksumMatches ? 0 : 1;
+    }
+
+    const Configuration modes[] = { { 8, false }, { 16, true } };
+
+    bool checksumsMatch = true;
+
+    for (const Configuration& mode : modes)
+    {
+        int samplesPerBlock = SAMPLES_PER_DATA_BLOCK(mode.usb3);
+
+        for (int numStreams = 1; numStreams <= mode.numStreams; numStreams++)
+        {
+            std::vector<unsigned char> data = synthesizeBlocks(numStreams, samplesPerBlock, 16);
+
+            Result r = runBenchmark(data, numStreams, samplesPerBlock, isa, seconds);
+            printResult("synthetic", numStreams, mode.usb3, isa, r);
+
+            checksumsMatch = checksumsMatch && r.checksumMatches;
+        }
+    }
+
+    return checksumsMatch ? 0 : 1;
+}
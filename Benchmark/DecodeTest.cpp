@@ -0,0 +1,394 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+    Checks that BlockDecoder's specialized kernels decode exactly like the
+    generic loop, without a board or the GUI.
+
+    Usage:
+        rhythm-decode-test
+
+    For 1-16 streams, with aux channels on no, some or all streams and with
+    and without ADCs, decodes the same synthetic frames (including a dropped
+    frame) with the specialized aux/ADC kernels and the widest supported
+    instruction set, and with the generic loop and the scalar amplifier
+    conversion. Samples, sample numbers and event codes must match bit for
+    bit.
+
+    Then feeds corrupted streams through decodeBlock() block by block: garbage
+    between frames, streams shifted by an odd number of words, headers split
+    across two blocks, a stale partial header and an overwritten frame. The
+    frames that survive must decode exactly like the same frames decoded in
+    one clean call, with the expected resync and skipped byte counts and the
+    gap event bit on the frame after a lost one.
+
+    Prints each failing configuration or case and returns 1 if there is any.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "BlockDecoder.h"
+#include "rhythm-api/rhd2000datablock.h"
+
+using namespace RhythmNode;
+
+#define TEST_SAMPLES_PER_BLOCK 128
+#define TEST_NUM_BLOCKS 4
+#define TEST_NUM_TTL_LINES 16
+#define TEST_GARBAGE_BYTE 0xee
+
+enum AuxLayout
+{
+    AUX_NONE = 0,
+    AUX_SOME = 1, // every other stream, as with RHD2164 MISO B streams
+    AUX_ALL = 2
+};
+
+static const char* auxLayoutNames[] = { "none", "some", "all" };
+
+/** Builds numBlocks blocks of valid frames of random words; one frame is dropped from the timestamps */
+static std::vector<unsigned char> synthesizeBlocks(int numStreams, int samplesPerBlock, int numBlocks)
+{
+    const int frameSize = BlockDecoder::getFrameSizeInBytes(numStreams);
+    const uint64_t magic = RHD2000_HEADER_MAGIC_NUMBER;
+
+    std::vector<unsigned char> data((size_t) frameSize * samplesPerBlock * numBlocks);
+
+    uint32_t seed = 12345 + numStreams;
+
+    for (int frame = 0; frame < samplesPerBlock * numBlocks; frame++)
+    {
+        unsigned char* ptr = data.data() + (size_t) frame * frameSize;
+
+        for (int i = 0; i < frameSize; i += 2)
+        {
+            seed = seed * 1664525 + 1013904223;
+            uint16_t word = uint16_t(seed >> 16);
+            memcpy(ptr + i, &word, sizeof(word));
+        }
+
+        // skip one timestamp, so the aux phase has to follow the gap
+        uint32_t timestamp = (uint32_t) (frame < samplesPerBlock + 5 ? frame : frame + 1);
+
+        memcpy(ptr, &magic, sizeof(magic));
+        memcpy(ptr + 8, &timestamp, sizeof(timestamp));
+    }
+
+    return data;
+}
+
+static void setTestLayout(BlockDecoder& decoder, int numStreams, AuxLayout auxLayout, bool acquireAdc)
+{
+    int channelsPerStream[BlockDecoder::MAX_SPECIALIZED_STREAMS];
+    bool halfChannels[BlockDecoder::MAX_SPECIALIZED_STREAMS];
+    bool auxChannels[BlockDecoder::MAX_SPECIALIZED_STREAMS];
+
+    for (int i = 0; i < numStreams; i++)
+    {
+        halfChannels[i] = (i % 3 == 2);
+        channelsPerStream[i] = halfChannels[i] ? 16 : 32;
+        auxChannels[i] = auxLayout == AUX_ALL || (auxLayout == AUX_SOME && i % 2 == 0);
+    }
+
+    decoder.setLayout(numStreams, channelsPerStream, halfChannels, auxChannels, acquireAdc);
+
+    for (int adc = 0; adc < 8; adc++)
+    {
+        if (adc % 2 == 0)
+            decoder.setAdcConversion(adc, 0.00015258789, -5, -0.4096);
+        else
+            decoder.setAdcConversion(adc, 0.000050354, 0);
+    }
+
+    decoder.setNumTtlLines(TEST_NUM_TTL_LINES);
+    decoder.resetStreamState();
+}
+
+struct DecodedData
+{
+    std::vector<float> samples;
+    std::vector<long long> sampleNumbers;
+    std::vector<unsigned long long> eventCodes;
+    int numFrames;
+};
+
+/** Decodes data in blocks of samplesPerBlock frames; its size must be a multiple of the block size */
+static DecodedData decodeAll(BlockDecoder& decoder, const std::vector<unsigned char>& data, int numStreams, int samplesPerBlock)
+{
+    const int stride = decoder.getNumChannels();
+    const size_t blockBytes = (size_t) BlockDecoder::getFrameSizeInBytes(numStreams) * samplesPerBlock;
+    const int numFrames = int(data.size() / BlockDecoder::getFrameSizeInBytes(numStreams));
+    const int numBlocks = int(data.size() / blockBytes);
+
+    DecodedData result;
+    result.samples.assign((size_t) numFrames * stride, 0.0f);
+    result.sampleNumbers.assign(numFrames, 0);
+    result.eventCodes.assign(numFrames, 0);
+    result.numFrames = 0;
+
+    // block by block, so held aux values carry over between calls as during acquisition
+    for (int block = 0; block < numBlocks; block++)
+    {
+        int frame = result.numFrames;
+
+        result.numFrames += decoder.decodeBlock(data.data() + block * blockBytes,
+                                                samplesPerBlock,
+                                                result.samples.data() + (size_t) frame * stride,
+                                                stride,
+                                                result.sampleNumbers.data() + frame,
+                                                result.eventCodes.data() + frame);
+    }
+
+    return result;
+}
+
+/** Copies the given frames of data, in order */
+static std::vector<unsigned char> selectFrames(const std::vector<unsigned char>& data, int frameSize, const std::vector<int>& frames)
+{
+    std::vector<unsigned char> result;
+
+    for (int frame : frames)
+        result.insert(result.end(), data.begin() + (size_t) frame * frameSize, data.begin() + (size_t) (frame + 1) * frameSize);
+
+    return result;
+}
+
+/** Returns the frame numbers [0, numFrames) without the given one (-1 for none) */
+static std::vector<int> framesWithout(int numFrames, int missingFrame)
+{
+    std::vector<int> frames;
+
+    for (int frame = 0; frame < numFrames; frame++)
+    {
+        if (frame != missingFrame)
+            frames.push_back(frame);
+    }
+
+    return frames;
+}
+
+/** Decodes a corrupted stream block by block and checks it against keptFrames of the clean
+    data decoded in one call. gapIndex is the output frame that must carry the gap bit (-1 for none). */
+static const char* checkResyncCase(int numStreams,
+                                   const std::vector<unsigned char>& clean,
+                                   const std::vector<unsigned char>& stream,
+                                   const std::vector<int>& keptFrames,
+                                   int64_t expectedResyncs,
+                                   int64_t expectedSkippedBytes,
+                                   int gapIndex)
+{
+    const int frameSize = BlockDecoder::getFrameSizeInBytes(numStreams);
+    const int numKept = (int) keptFrames.size();
+
+    BlockDecoder decoder;
+    BlockDecoder reference;
+
+    setTestLayout(decoder, numStreams, AUX_ALL, true);
+    setTestLayout(reference, numStreams, AUX_ALL, true);
+
+    DecodedData actual = decodeAll(decoder, stream, numStreams, TEST_SAMPLES_PER_BLOCK);
+    DecodedData expected = decodeAll(reference, selectFrames(clean, frameSize, keptFrames), numStreams, numKept);
+
+    const size_t numSamples = (size_t) numKept * decoder.getNumChannels();
+
+    if (actual.numFrames != numKept || expected.numFrames != numKept)
+        return "frame count";
+    if (memcmp(actual.samples.data(), expected.samples.data(), numSamples * sizeof(float)) != 0)
+        return "samples";
+    if (!std::equal(expected.sampleNumbers.begin(), expected.sampleNumbers.end(), actual.sampleNumbers.begin()))
+        return "sample numbers";
+    if (!std::equal(expected.eventCodes.begin(), expected.eventCodes.end(), actual.eventCodes.begin()))
+        return "event codes";
+    if (decoder.getNumResyncs() != expectedResyncs)
+        return "resync count";
+    if (decoder.getNumSkippedBytes() != expectedSkippedBytes)
+        return "skipped byte count";
+    if (gapIndex >= 0 && (actual.eventCodes[gapIndex] & (1ULL << TEST_NUM_TTL_LINES)) == 0)
+        return "gap event bit";
+
+    return nullptr;
+}
+
+/** Runs the corrupted stream cases for one stream count; returns the number of failures */
+static int runResyncCases(int numStreams, int& numCases)
+{
+    const int frameSize = BlockDecoder::getFrameSizeInBytes(numStreams);
+    const int numFrames = TEST_SAMPLES_PER_BLOCK * TEST_NUM_BLOCKS;
+    const uint64_t magic = RHD2000_HEADER_MAGIC_NUMBER;
+    const unsigned char* magicBytes = (const unsigned char*) &magic;
+
+    const std::vector<unsigned char> clean = synthesizeBlocks(numStreams, TEST_SAMPLES_PER_BLOCK, TEST_NUM_BLOCKS);
+
+    // every case but the overwritten frame shifts the stream, so the last frame is cut off and never completed
+    const std::vector<int> allButLast = framesWithout(numFrames - 1, -1);
+
+    int numFailures = 0;
+
+    auto check = [&] (const char* name, int param, const std::vector<unsigned char>& stream, const std::vector<int>& keptFrames,
+                      int64_t resyncs, int64_t skippedBytes, int gapIndex)
+    {
+        numCases++;
+
+        const char* error = checkResyncCase(numStreams, clean, stream, keptFrames, resyncs, skippedBytes, gapIndex);
+
+        if (error != nullptr)
+        {
+            std::printf("FAIL  %2d streams, %s (%d): %s\n", numStreams, name, param, error);
+            numFailures++;
+        }
+    };
+
+    // garbage between two frames in the middle of a block, starting like a header
+    {
+        const int garbageBytes = 10;
+        const size_t at = (size_t) 200 * frameSize;
+
+        std::vector<unsigned char> stream(clean.begin(), clean.begin() + at);
+        stream.insert(stream.end(), magicBytes, magicBytes + 4);
+        stream.insert(stream.end(), garbageBytes - 4, TEST_GARBAGE_BYTE);
+        stream.insert(stream.end(), clean.begin() + at, clean.end() - garbageBytes);
+
+        check("garbage mid-block", garbageBytes, stream, allButLast, 1, garbageBytes, -1);
+    }
+
+    // shifted by an odd number of words, so every block ends inside a frame
+    for (int words = 1; words <= 3; words += 2)
+    {
+        std::vector<unsigned char> stream(2 * words, TEST_GARBAGE_BYTE);
+        stream.insert(stream.end(), clean.begin(), clean.end() - 2 * words);
+
+        check("odd word shift", words, stream, allButLast, 1, 2 * words, -1);
+    }
+
+    // garbage at the end of the first block, so the resync finds a header with only 2, 4 or 6 of
+    // its bytes left; every later block then ends inside a header too
+    for (int headerBytes = 2; headerBytes < 8; headerBytes += 2)
+    {
+        const int garbageBytes = frameSize - headerBytes;
+        const size_t at = (size_t) (TEST_SAMPLES_PER_BLOCK - 1) * frameSize;
+
+        std::vector<unsigned char> stream(clean.begin(), clean.begin() + at);
+        stream.insert(stream.end(), garbageBytes, TEST_GARBAGE_BYTE);
+        stream.insert(stream.end(), clean.begin() + at, clean.end() - garbageBytes);
+
+        check("header split across blocks", headerBytes, stream, allButLast, 1, garbageBytes, -1);
+    }
+
+    // a block that ends with the start of a header that the next block doesn't continue
+    {
+        const size_t at = (size_t) (TEST_SAMPLES_PER_BLOCK - 1) * frameSize;
+
+        std::vector<unsigned char> stream(clean.begin(), clean.begin() + at);
+        stream.insert(stream.end(), frameSize - 4, TEST_GARBAGE_BYTE);
+        stream.insert(stream.end(), magicBytes, magicBytes + 4);
+        stream.insert(stream.end(), clean.begin() + at, clean.end() - frameSize);
+
+        // once in the first block and once when the carried bytes don't complete a header
+        check("stale partial header", 4, stream, allButLast, 2, frameSize, -1);
+    }
+
+    // an overwritten header loses its frame, so the one after it carries the gap bit
+    {
+        const int lostFrame = 300;
+
+        std::vector<unsigned char> stream(clean);
+        memset(stream.data() + (size_t) lostFrame * frameSize, TEST_GARBAGE_BYTE, 8);
+
+        check("overwritten frame", lostFrame, stream, framesWithout(numFrames, lostFrame), 1, frameSize, lostFrame);
+    }
+
+    return numFailures;
+}
+
+int main()
+{
+    int numConfigurations = 0;
+    int numFailures = 0;
+
+    BlockDecoder specialized;
+    BlockDecoder generic;
+
+    generic.setSpecializedKernelsEnabled(false);
+    generic.setInstructionSet(DECODER_SCALAR);
+
+    std::printf("Specialized kernels (%s) vs. generic loop (scalar)\n",
+                BlockDecoder::getInstructionSetName(specialized.getInstructionSet()));
+
+    for (int numStreams = 1; numStreams <= BlockDecoder::MAX_SPECIALIZED_STREAMS; numStreams++)
+    {
+        std::vector<unsigned char> data = synthesizeBlocks(numStreams, TEST_SAMPLES_PER_BLOCK, TEST_NUM_BLOCKS);
+
+        for (int auxLayout = AUX_NONE; auxLayout <= AUX_ALL; auxLayout++)
+        {
+            for (int acquireAdc = 0; acquireAdc < 2; acquireAdc++)
+            {
+                setTestLayout(specialized, numStreams, AuxLayout(auxLayout), acquireAdc != 0);
+                setTestLayout(generic, numStreams, AuxLayout(auxLayout), acquireAdc != 0);
+
+                DecodedData expected = decodeAll(generic, data, numStreams, TEST_SAMPLES_PER_BLOCK);
+                DecodedData actual = decodeAll(specialized, data, numStreams, TEST_SAMPLES_PER_BLOCK);
+
+                numConfigurations++;
+
+                const char* error = nullptr;
+
+                if (!specialized.isUsingSpecializedKernel() || generic.isUsingSpecializedKernel())
+                    error = "wrong kernel selected";
+                else if (actual.numFrames != TEST_SAMPLES_PER_BLOCK * TEST_NUM_BLOCKS
+                         || actual.numFrames != expected.numFrames)
+                    error = "frame count";
+                else if (memcmp(actual.samples.data(), expected.samples.data(), actual.samples.size() * sizeof(float)) != 0)
+                    error = "samples";
+                else if (actual.sampleNumbers != expected.sampleNumbers)
+                    error = "sample numbers";
+                else if (actual.eventCodes != expected.eventCodes)
+                    error = "event codes";
+
+                if (error != nullptr)
+                {
+                    std::printf("FAIL  %2d streams, aux %s, adc %s: %s\n",
+                                numStreams, auxLayoutNames[auxLayout], acquireAdc ? "on" : "off", error);
+                    numFailures++;
+                }
+            }
+        }
+    }
+
+    std::printf("%d of %d configurations match\n", numConfigurations - numFailures, numConfigurations);
+
+    int numCases = 0;
+    int numCaseFailures = 0;
+
+    for (int numStreams = 1; numStreams <= BlockDecoder::MAX_SPECIALIZED_STREAMS; numStreams++)
+        numCaseFailures += runResyncCases(numStreams, numCases);
+
+    std::printf("%d of %d corrupted stream cases pass\n", numCases - numCaseFailures, numCases);
+
+    numFailures += numCaseFailures;
+
+    return numFailures > 0 ? 1 : 0;
+}
@@ -0,0 +1,170 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "AcquisitionProfiler.h"
+
+using namespace RhythmNode;
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::reset()
+{
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        buckets[i].store(0, std::memory_order_relaxed);
+
+    count.store(0, std::memory_order_relaxed);
+    total.store(0, std::memory_order_relaxed);
+    maximum.store(0, std::memory_order_relaxed);
+}
+
+int LatencyHistogram::getBucket(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return int(value);
+
+    int exponent = 63;
+
+    while ((value >> exponent) == 0)
+        exponent--;
+
+    // exponent >= 4; keep the 4 bits below the leading one
+    int subBucket = int((value >> (exponent - 4)) & (SUB_BUCKETS - 1));
+
+    return (exponent - 3) * SUB_BUCKETS + subBucket;
+}
+
+uint64_t LatencyHistogram::getBucketUpperBound(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return uint64_t(bucket);
+
+    int exponent = bucket / SUB_BUCKETS + 3;
+    uint64_t subBucket = uint64_t(bucket % SUB_BUCKETS);
+
+    return ((SUB_BUCKETS + subBucket + 1) << (exponent - 4)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds)
+{
+    buckets[getBucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(nanoseconds, std::memory_order_relaxed);
+
+    uint64_t previous = maximum.load(std::memory_order_relaxed);
+
+    while (nanoseconds > previous
+           && !maximum.compare_exchange_weak(previous, nanoseconds, std::memory_order_relaxed))
+    {
+    }
+}
+
+double LatencyHistogram::getMean() const
+{
+    uint64_t n = getCount();
+
+    return n > 0 ? double(total.load(std::memory_order_relaxed)) / double(n) : 0.0;
+}
+
+uint64_t LatencyHistogram::getPercentile(double percentile) const
+{
+    uint64_t n = getCount();
+
+    if (n == 0)
+        return 0;
+
+    uint64_t target = uint64_t(percentile / 100.0 * double(n) + 0.5);
+
+    if (target < 1)
+        target = 1;
+
+    uint64_t seen = 0;
+
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+
+        if (seen >= target)
+        {
+            uint64_t bound = getBucketUpperBound(i);
+            return bound < getMax() ? bound : getMax();
+        }
+    }
+
+    return getMax();
+}
+
+AcquisitionProfiler::AcquisitionProfiler() :
+    enabled(true)
+{
+}
+
+void AcquisitionProfiler::setEnabled(bool shouldBeEnabled)
+{
+    enabled.store(shouldBeEnabled, std::memory_order_relaxed);
+}
+
+void AcquisitionProfiler::reset()
+{
+    for (int stage = 0; stage < NUM_STAGES; stage++)
+        histograms[stage].reset();
+}
+
+const char* AcquisitionProfiler::getStageName(Stage stage)
+{
+    switch (stage)
+    {
+    case PIPE_READ:
+        return "pipe read";
+    case HEADER_VALIDATION:
+        return "header validation";
+    case DECODE:
+        return "decode";
+    case ADD_TO_BUFFER:
+        return "addToBuffer";
+    case SETTINGS_UPDATE:
+        return "settings/TTL update";
+    default:
+        return "unknown";
+    }
+}
+
+void AcquisitionProfiler::writeCsv(std::ostream& out) const
+{
+    out << "stage,count,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n";
+
+    for (int i = 0; i < NUM_STAGES; i++)
+    {
+        const LatencyHistogram& h = histograms[i];
+
+        out << getStageName(Stage(i)) << ","
+            << h.getCount() << ","
+            << h.getMean() << ","
+            << h.getPercentile(50.0) << ","
+            << h.getPercentile(99.0) << ","
+            << h.getPercentile(99.9) << ","
+            << h.getMax() << "\n";
+    }
+}
@@ -0,0 +1,159 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __ACQUISITIONPROFILER_H_3A71C5E9__
+#define __ACQUISITIONPROFILER_H_3A71C5E9__
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+
+namespace RhythmNode
+{
+
+	/**
+		Lock-free histogram of durations in nanoseconds.
+
+		Buckets are log-linear: values below 16 ns have their own bucket,
+		larger values are split into 16 linear sub-buckets per power of two,
+		so any percentile is accurate to within ~6%.
+
+		record() may be called from one thread while others read.
+
+	*/
+	class LatencyHistogram
+	{
+	public:
+
+		/** Constructor */
+		LatencyHistogram();
+
+		/** Adds one duration */
+		void record(uint64_t nanoseconds);
+
+		/** Removes all durations */
+		void reset();
+
+		/** Returns the number of recorded durations */
+		uint64_t getCount() const { return count.load(std::memory_order_relaxed); }
+
+		/** Returns the largest recorded duration */
+		uint64_t getMax() const { return maximum.load(std::memory_order_relaxed); }
+
+		/** Returns the mean duration */
+		double getMean() const;
+
+		/** Returns an upper bound for the given percentile (0-100) */
+		uint64_t getPercentile(double percentile) const;
+
+	private:
+
+		static const int SUB_BUCKETS = 16;
+		static const int NUM_BUCKETS = 61 * SUB_BUCKETS;
+
+		static int getBucket(uint64_t value);
+		static uint64_t getBucketUpperBound(int bucket);
+
+		std::atomic<uint64_t> buckets[NUM_BUCKETS];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> total;
+		std::atomic<uint64_t> maximum;
+	};
+
+	/**
+		Per-stage timing of the acquisition loop.
+
+		Each stage of a block's journey (pipe read, header validation,
+		decode, DataBuffer push, settings/TTL updates) is timed and added
+		to its own LatencyHistogram. When profiling is disabled, startTimer()
+		returns 0 and stopTimer() returns immediately, so the cost is one
+		branch per stage.
+
+		This class has no dependencies on the GUI.
+
+	*/
+	class AcquisitionProfiler
+	{
+	public:
+
+		enum Stage
+		{
+			PIPE_READ = 0,
+			HEADER_VALIDATION,
+			DECODE,
+			ADD_TO_BUFFER,
+			SETTINGS_UPDATE,
+			NUM_STAGES
+		};
+
+		/** Constructor */
+		AcquisitionProfiler();
+
+		/** Enables or disables timing */
+		void setEnabled(bool enabled);
+
+		/** Returns true if timing is enabled */
+		bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+		/** Returns a start time for stopTimer(), or 0 if profiling is disabled */
+		uint64_t startTimer() const { return isEnabled() ? now() : 0; }
+
+		/** Records the time since startTime for a stage (ignored if startTime is 0) */
+		void stopTimer(Stage stage, uint64_t startTime)
+		{
+			if (startTime != 0)
+				histograms[stage].record(now() - startTime);
+		}
+
+		/** Records a duration measured elsewhere */
+		void record(Stage stage, uint64_t nanoseconds) { histograms[stage].record(nanoseconds); }
+
+		/** Returns the histogram for one stage */
+		const LatencyHistogram& getHistogram(Stage stage) const { return histograms[stage]; }
+
+		/** Clears all histograms */
+		void reset();
+
+		/** Writes one CSV row per stage (count, mean, p50, p99, p99.9, max, in nanoseconds) */
+		void writeCsv(std::ostream& out) const;
+
+		/** Returns a printable name for a stage */
+		static const char* getStageName(Stage stage);
+
+		/** Returns a monotonic time in nanoseconds */
+		static uint64_t now()
+		{
+			return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+	private:
+
+		std::atomic<bool> enabled;
+
+		LatencyHistogram histograms[NUM_STAGES];
+	};
+
+}
+#endif  // __ACQUISITIONPROFILER_H_3A71C5E9__
@@ -0,0 +1,733 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "BlockDecoder.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include "rhythm-api/rhd2000datablock.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RHYTHM_DECODER_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define RHYTHM_TARGET_SSE2
+#define RHYTHM_TARGET_AVX2
+#else
+#define RHYTHM_TARGET_SSE2 __attribute__((target("sse2")))
+#define RHYTHM_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace RhythmNode;
+
+BlockDecoder::BlockDecoder() :
+    auxiliaryKernel(nullptr),
+    specializedKernelsEnabled(true),
+    carryBytes(0),
+    hasTimestamp(false),
+    lastTimestamp(0),
+    hasTimestampOrigin(false),
+    timestampOrigin(0),
+    ttlMask(0xFFFF),
+    gapEventCode(1 << 16),
+    numResyncs(0),
+    numSkippedBytes(0),
+    numGaps(0),
+    numDroppedFrames(0),
+    profiler(nullptr),
+    instructionSet(detectInstructionSet())
+{
+}
+
+void BlockDecoder::setLayout(int numStreams,
+                             const int* channelsPerStream,
+                             const bool* halfChannels,
+                             const bool* auxChannels,
+                             bool acquireAdc)
+{
+    plan.numStreams = numStreams;
+    plan.frameSize = getFrameSizeInBytes(numStreams);
+
+    plan.amplifierOffsets.clear();
+    plan.auxOffsets.clear();
+    plan.adcChannels.clear();
+
+    for (int stream = 0; stream < numStreams; stream++)
+    {
+        int offset = getAmplifierOffset(numStreams) + 2 * stream;
+
+        if (halfChannels[stream]) // RHD2132 16ch. headstage
+            offset += 2 * RHD2132_16CH_OFFSET * numStreams;
+
+        for (int chan = 0; chan < channelsPerStream[stream]; chan++)
+        {
+            plan.amplifierOffsets.push_back(offset);
+            offset += 2 * numStreams; // single chan width (2 bytes)
+        }
+    }
+
+    int channel = (int) plan.amplifierOffsets.size();
+
+    plan.firstAuxChannel = channel;
+
+    for (int stream = 0; stream < numStreams; stream++)
+    {
+        if (auxChannels[stream])
+        {
+            // skip AuxCmd1 slots; aux inputs are sampled through AuxCmd2
+            plan.auxOffsets.push_back(getAuxOffset(numStreams) + 2 * numStreams + 2 * stream);
+            channel += 3;
+        }
+    }
+
+    if (acquireAdc)
+    {
+        for (int adcChan = 0; adcChan < 8; adcChan++)
+        {
+            LinearChannel adc;
+            adc.byteOffset = getAdcOffset(numStreams) + 2 * adcChan;
+            adc.channel = channel++;
+            adc.scale = 0.0;
+            adc.offset = 0.0;
+            adc.dcOffset = 0.0;
+
+            plan.adcChannels.push_back(adc);
+        }
+    }
+
+    plan.numChannels = channel;
+
+    auxSamples.resize(3 * plan.auxOffsets.size());
+    auxHeld.resize(3 * plan.auxOffsets.size());
+
+    if ((int) carry.size() != plan.frameSize)
+    {
+        carry.assign(plan.frameSize, 0);
+        carryBytes = 0;
+    }
+
+    selectAuxiliaryKernel();
+}
+
+void BlockDecoder::setSpecializedKernelsEnabled(bool enabled)
+{
+    specializedKernelsEnabled = enabled;
+
+    selectAuxiliaryKernel();
+}
+
+template <bool AcquireAux, bool AcquireAdc, int... N>
+std::array<BlockDecoder::AuxiliaryKernel, sizeof...(N)> BlockDecoder::makeKernelTable(std::integer_sequence<int, N...>)
+{
+    return {{ &BlockDecoder::decodeAuxiliaryKernel<N + 1, AcquireAux, AcquireAdc>... }};
+}
+
+void BlockDecoder::selectAuxiliaryKernel()
+{
+    typedef std::make_integer_sequence<int, MAX_SPECIALIZED_STREAMS> StreamCounts;
+
+    // [acquireAux][acquireAdc][numStreams - 1]
+    static const std::array<AuxiliaryKernel, MAX_SPECIALIZED_STREAMS> kernels[2][2] =
+    {
+        { makeKernelTable<false, false>(StreamCounts()), makeKernelTable<false, true>(StreamCounts()) },
+        { makeKernelTable<true, false>(StreamCounts()), makeKernelTable<true, true>(StreamCounts()) }
+    };
+
+    auxiliaryKernel = nullptr;
+
+    if (!specializedKernelsEnabled || plan.numStreams < 1 || plan.numStreams > MAX_SPECIALIZED_STREAMS)
+        return;
+
+    // the specialized kernels assume all 8 ADC channels directly follow the aux channels
+    if (!plan.adcChannels.empty() && plan.adcChannels.size() != 8)
+        return;
+
+    bool acquireAux = !plan.auxOffsets.empty();
+    bool acquireAdc = !plan.adcChannels.empty();
+
+    auxiliaryKernel = kernels[acquireAux][acquireAdc][plan.numStreams - 1];
+}
+
+void BlockDecoder::setAdcConversion(int adcChannel, double scale, double offset, double dcOffset)
+{
+    if (adcChannel < 0 || adcChannel >= (int) plan.adcChannels.size())
+        return;
+
+    plan.adcChannels[adcChannel].scale = scale;
+    plan.adcChannels[adcChannel].offset = offset;
+    plan.adcChannels[adcChannel].dcOffset = dcOffset;
+}
+
+void BlockDecoder::setNumTtlLines(int numLines)
+{
+    ttlMask = (1ULL << numLines) - 1;
+    gapEventCode = 1ULL << numLines;
+}
+
+void BlockDecoder::resetStreamState()
+{
+    std::fill(auxSamples.begin(), auxSamples.end(), 0.0f);
+    std::fill(auxHeld.begin(), auxHeld.end(), 0.0f);
+
+    carryBytes = 0;
+    hasTimestamp = false;
+    hasTimestampOrigin = false;
+
+    numResyncs = 0;
+    numSkippedBytes = 0;
+    numGaps = 0;
+    numDroppedFrames = 0;
+}
+
+const unsigned char* BlockDecoder::findHeader(const unsigned char* start, const unsigned char* end) const
+{
+    const uint64_t magic = RHD2000_HEADER_MAGIC_NUMBER;
+
+    // frames are made of 16-bit words, so a header always starts on an even byte
+    const unsigned char* pos = start;
+
+    for (; pos + sizeof(magic) <= end; pos += 2)
+    {
+        uint64_t header;
+        memcpy(&header, pos, sizeof(header));
+
+        if (header == magic)
+            return pos;
+    }
+
+    // a header cut off by the end of the block; the magic number has no
+    // repeating 2-byte aligned prefix, so at most one of these can match
+    for (; pos < end; pos += 2)
+    {
+        if (memcmp(pos, &magic, size_t(end - pos)) == 0)
+            return pos;
+    }
+
+    return end;
+}
+
+int BlockDecoder::countValidFrames(const unsigned char* buffer, int nSamples) const
+{
+    bool contiguous;
+    return Rhd2000DataBlock::checkUsbBlock(buffer, plan.numStreams, nSamples, nullptr, contiguous);
+}
+
+int BlockDecoder::decodeBlock(const unsigned char* buffer,
+                              int nSamples,
+                              float* out,
+                              int outStride,
+                              long long* sampleNumbers,
+                              unsigned long long* eventCodes)
+{
+    const int frameSize = plan.frameSize;
+    const unsigned char* end = buffer + nSamples * frameSize;
+    const unsigned char* pos = buffer;
+
+    int numFrames = 0;
+
+    // header validation is timed as whatever decodeFrames() doesn't account for
+    uint64_t startTime = profiler != nullptr ? profiler->startTimer() : 0;
+    uint64_t decodeTime = 0;
+
+    // complete a frame that was split across the end of the previous block
+    if (carryBytes > 0)
+    {
+        int needed = frameSize - carryBytes;
+
+        memcpy(carry.data() + carryBytes, buffer, needed);
+
+        if (countValidFrames(carry.data(), 1) == 1)
+        {
+            uint64_t decodeStart = startTime != 0 ? AcquisitionProfiler::now() : 0;
+            decodeFrames(carry.data(), 1, out, outStride, sampleNumbers, eventCodes);
+            decodeTime += startTime != 0 ? AcquisitionProfiler::now() - decodeStart : 0;
+            detectGaps(sampleNumbers, eventCodes, 1, true);
+            numFrames = 1;
+            pos += needed;
+        }
+        else
+        {
+            // the carry only held the start of the magic number: drop it and resync in this block
+            const unsigned char* next = findHeader(buffer, end);
+
+            numResyncs++;
+            numSkippedBytes += carryBytes + (next - buffer);
+            pos = next;
+        }
+
+        carryBytes = 0;
+    }
+
+    while (end - pos >= frameSize)
+    {
+        bool contiguous;
+        int run = Rhd2000DataBlock::checkUsbBlock(pos, plan.numStreams, int((end - pos) / frameSize), nullptr, contiguous);
+
+        if (run > 0)
+        {
+            uint64_t decodeStart = startTime != 0 ? AcquisitionProfiler::now() : 0;
+
+            decodeFrames(pos,
+                         run,
+                         out + numFrames * outStride,
+                         outStride,
+                         sampleNumbers + numFrames,
+                         eventCodes + numFrames);
+
+            decodeTime += startTime != 0 ? AcquisitionProfiler::now() - decodeStart : 0;
+
+            detectGaps(sampleNumbers + numFrames, eventCodes + numFrames, run, contiguous);
+
+            numFrames += run;
+            pos += run * frameSize;
+            continue;
+        }
+
+        // lost sync: skip forward to the next header
+        const unsigned char* next = findHeader(pos + 2, end);
+
+        numResyncs++;
+        numSkippedBytes += next - pos;
+        pos = next;
+    }
+
+    // keep a trailing partial frame, which is only left over once the stream is misaligned;
+    // the carry always starts at a (possibly cut off) header so the next block can complete it
+    if (pos < end)
+    {
+        const unsigned char* next = findHeader(pos, end);
+
+        if (next != pos)
+        {
+            numResyncs++;
+            numSkippedBytes += next - pos;
+            pos = next;
+        }
+    }
+
+    if (pos < end)
+    {
+        carryBytes = int(end - pos);
+        memcpy(carry.data(), pos, carryBytes);
+    }
+
+    if (startTime != 0)
+    {
+        uint64_t totalTime = AcquisitionProfiler::now() - startTime;
+
+        profiler->record(AcquisitionProfiler::DECODE, decodeTime);
+        profiler->record(AcquisitionProfiler::HEADER_VALIDATION, totalTime - decodeTime);
+    }
+
+    return numFrames;
+}
+
+void BlockDecoder::detectGaps(const long long* sampleNumbers,
+                              unsigned long long* eventCodes,
+                              int nSamples,
+                              bool contiguous)
+{
+    if (nSamples == 0)
+        return;
+
+    // the frame counter of a contiguous run can only jump at its first frame
+    int numToCheck = contiguous ? 1 : nSamples;
+
+    for (int samp = 0; samp < numToCheck; samp++)
+    {
+        uint32_t timestamp = uint32_t(sampleNumbers[samp]);
+
+        if (hasTimestamp && timestamp != lastTimestamp + 1)
+        {
+            uint32_t gap = timestamp - lastTimestamp - 1;
+
+            numGaps++;
+            numDroppedFrames += gap;
+            eventCodes[samp] |= gapEventCode;
+        }
+
+        lastTimestamp = timestamp;
+        hasTimestamp = true;
+    }
+
+    lastTimestamp = uint32_t(sampleNumbers[nSamples - 1]);
+}
+
+void BlockDecoder::decodeFrames(const unsigned char* buffer,
+                                int nSamples,
+                                float* out,
+                                int outStride,
+                                long long* sampleNumbers,
+                                unsigned long long* eventCodes)
+{
+    if (!hasTimestampOrigin && nSamples > 0)
+    {
+        memcpy(&timestampOrigin, buffer + 8, sizeof(timestampOrigin));
+        hasTimestampOrigin = true;
+    }
+
+    decodeAmplifierData(buffer, nSamples, out, outStride);
+
+    if (auxiliaryKernel != nullptr)
+        (this->*auxiliaryKernel)(buffer, nSamples, out, outStride, sampleNumbers, eventCodes);
+    else
+        decodeAuxiliaryData(buffer, nSamples, out, outStride, sampleNumbers, eventCodes);
+}
+
+void BlockDecoder::decodeAuxiliaryData(const unsigned char* buffer,
+                                       int nSamples,
+                                       float* out,
+                                       int outStride,
+                                       long long* sampleNumbers,
+                                       unsigned long long* eventCodes)
+{
+    const int numAuxStreams = (int) plan.auxOffsets.size();
+    const int numAdcChannels = (int) plan.adcChannels.size();
+    const int ttlOffset = getTtlOffset(plan.numStreams);
+
+    const int* auxOffsets = plan.auxOffsets.data();
+    const LinearChannel* adcChannels = plan.adcChannels.data();
+
+    float* samples = auxSamples.data();
+    float* held = auxHeld.data();
+
+    for (int samp = 0; samp < nSamples; samp++)
+    {
+        const unsigned char* frame = buffer + samp * plan.frameSize;
+        float* row = out + samp * outStride;
+
+        uint32_t timestamp;
+        memcpy(&timestamp, frame + 8, sizeof(timestamp));
+        sampleNumbers[samp] = timestamp;
+
+        uint16_t ttlIn;
+        memcpy(&ttlIn, frame + ttlOffset, sizeof(ttlIn));
+        eventCodes[samp] = ttlIn & ttlMask;
+
+        // AuxCmd2 results arrive in the order aux1, aux2, aux3, (unused);
+        // the phase follows the timestamp so it survives dropped frames
+        int auxNum = int((timestamp - timestampOrigin + 3) & 3);
+
+        if (auxNum < 3)
+        {
+            for (int aux = 0; aux < numAuxStreams; aux++)
+            {
+                uint16_t word;
+                memcpy(&word, frame + auxOffsets[aux], sizeof(word));
+                samples[3 * aux + auxNum] = float(word - 32768) * 0.0000374;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < 3 * numAuxStreams; i++)
+                held[i] = samples[i];
+        }
+
+        float* auxRow = row + plan.firstAuxChannel;
+
+        for (int i = 0; i < 3 * numAuxStreams; i++)
+            auxRow[i] = held[i];
+
+        for (int adc = 0; adc < numAdcChannels; adc++)
+        {
+            uint16_t word;
+            memcpy(&word, frame + adcChannels[adc].byteOffset, sizeof(word));
+            row[adcChannels[adc].channel] = float(adcChannels[adc].scale * double(word) + adcChannels[adc].offset
+                + adcChannels[adc].dcOffset);
+        }
+    }
+}
+
+template <int NumStreams, bool AcquireAux, bool AcquireAdc>
+void BlockDecoder::decodeAuxiliaryKernel(const unsigned char* buffer,
+                                         int nSamples,
+                                         float* out,
+                                         int outStride,
+                                         long long* sampleNumbers,
+                                         unsigned long long* eventCodes)
+{
+    constexpr int frameSize = getFrameSizeInBytes(NumStreams);
+    constexpr int adcOffset = getAdcOffset(NumStreams);
+    constexpr int ttlOffset = getTtlOffset(NumStreams);
+
+    const int numAuxStreams = (int) plan.auxOffsets.size();
+    const int firstAuxChannel = plan.firstAuxChannel;
+    const int firstAdcChannel = firstAuxChannel + 3 * numAuxStreams;
+
+    const int* auxOffsets = plan.auxOffsets.data();
+
+    double adcScale[8], adcOffsets[8], adcDcOffsets[8];
+
+    if (AcquireAdc)
+    {
+        for (int adc = 0; adc < 8; adc++)
+        {
+            adcScale[adc] = plan.adcChannels[adc].scale;
+            adcOffsets[adc] = plan.adcChannels[adc].offset;
+            adcDcOffsets[adc] = plan.adcChannels[adc].dcOffset;
+        }
+    }
+
+    float* samples = auxSamples.data();
+    float* held = auxHeld.data();
+
+    for (int samp = 0; samp < nSamples; samp++)
+    {
+        const unsigned char* frame = buffer + samp * frameSize;
+        float* row = out + samp * outStride;
+
+        uint32_t timestamp;
+        memcpy(&timestamp, frame + 8, sizeof(timestamp));
+        sampleNumbers[samp] = timestamp;
+
+        uint16_t ttlIn;
+        memcpy(&ttlIn, frame + ttlOffset, sizeof(ttlIn));
+        eventCodes[samp] = ttlIn & ttlMask;
+
+        if (AcquireAux)
+        {
+            int auxNum = int((timestamp - timestampOrigin + 3) & 3);
+
+            if (auxNum < 3)
+            {
+                for (int aux = 0; aux < numAuxStreams; aux++)
+                {
+                    uint16_t word;
+                    memcpy(&word, frame + auxOffsets[aux], sizeof(word));
+                    samples[3 * aux + auxNum] = float(word - 32768) * 0.0000374;
+                }
+            }
+            else
+            {
+                memcpy(held, samples, 3 * numAuxStreams * sizeof(float));
+            }
+
+            memcpy(row + firstAuxChannel, held, 3 * numAuxStreams * sizeof(float));
+        }
+
+        if (AcquireAdc)
+        {
+            float* adcRow = row + firstAdcChannel;
+
+            for (int adc = 0; adc < 8; adc++)
+            {
+                uint16_t word;
+                memcpy(&word, frame + adcOffset + 2 * adc, sizeof(word));
+                adcRow[adc] = float(adcScale[adc] * double(word) + adcOffsets[adc] + adcDcOffsets[adc]);
+            }
+        }
+    }
+}
+
+void BlockDecoder::decodeAmplifierData(const unsigned char* buffer, int nSamples, float* out, int outStride) const
+{
+    switch (instructionSet)
+    {
+    case DECODER_AVX2:
+        decodeAVX2(buffer, nSamples, out, outStride);
+        break;
+    case DECODER_SSE2:
+        decodeSSE2(buffer, nSamples, out, outStride);
+        break;
+    default:
+        decodeScalar(buffer, nSamples, out, outStride);
+    }
+}
+
+void BlockDecoder::decodeScalar(const unsigned char* buffer, int nSamples, float* out, int outStride) const
+{
+    const int* offsets = plan.amplifierOffsets.data();
+    const int numAmplifierChannels = (int) plan.amplifierOffsets.size();
+
+    for (int samp = 0; samp < nSamples; samp++)
+    {
+        const unsigned char* frame = buffer + samp * plan.frameSize;
+        float* row = out + samp * outStride;
+
+        for (int chan = 0; chan < numAmplifierChannels; chan++)
+        {
+            uint16_t word;
+            memcpy(&word, frame + offsets[chan], sizeof(word));
+            row[chan] = float(word - 32768) * 0.195f;
+        }
+    }
+}
+
+#ifdef RHYTHM_DECODER_X86
+
+RHYTHM_TARGET_SSE2 void BlockDecoder::decodeSSE2(const unsigned char* buffer, int nSamples, float* out, int outStride) const
+{
+    const int* offsets = plan.amplifierOffsets.data();
+    const int numAmplifierChannels = (int) plan.amplifierOffsets.size();
+    const int vectorChannels = numAmplifierChannels & ~7;
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128 scale = _mm_set1_ps(0.195f);
+
+    for (int samp = 0; samp < nSamples; samp++)
+    {
+        const unsigned char* frame = buffer + samp * plan.frameSize;
+        float* row = out + samp * outStride;
+
+        int chan = 0;
+
+        for (; chan < vectorChannels; chan += 8)
+        {
+            // gather 8 words, then widen to two groups of 4 x int32
+            __m128i words = zero;
+            words = _mm_insert_epi16(words, *(const uint16_t*)(frame + offsets[chan]), 0);
+            words = _mm_insert_epi16(words, *(const uint16_t*)(frame + offsets[chan + 1]), 1);
+            words = _mm_insert_epi16(words, *(const uint16_t*)(frame + offsets[chan + 2]), 2);
+            words = _mm_insert_epi16(words, *(const uint16_t*)(frame + offsets[chan + 3]), 3);
+            words = _mm_insert_epi16(words, *(const uint16_t*)(frame + offsets[chan + 4]), 4);
+            words = _mm_insert_epi16(words, *(const uint16_t*)(frame + offsets[chan + 5]), 5);
+            words = _mm_insert_epi16(words, *(const uint16_t*)(frame + offsets[chan + 6]), 6);
+            words = _mm_insert_epi16(words, *(const uint16_t*)(frame + offsets[chan + 7]), 7);
+
+            __m128i lo = _mm_sub_epi32(_mm_unpacklo_epi16(words, zero), bias);
+            __m128i hi = _mm_sub_epi32(_mm_unpackhi_epi16(words, zero), bias);
+
+            _mm_storeu_ps(row + chan, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+            _mm_storeu_ps(row + chan + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+        }
+
+        for (; chan < numAmplifierChannels; chan++)
+        {
+            uint16_t word;
+            memcpy(&word, frame + offsets[chan], sizeof(word));
+            row[chan] = float(word - 32768) * 0.195f;
+        }
+    }
+}
+
+RHYTHM_TARGET_AVX2 void BlockDecoder::decodeAVX2(const unsigned char* buffer, int nSamples, float* out, int outStride) const
+{
+    const int* offsets = plan.amplifierOffsets.data();
+    const int numAmplifierChannels = (int) plan.amplifierOffsets.size();
+    const int vectorChannels = numAmplifierChannels & ~7;
+
+    const __m256i mask = _mm256_set1_epi32(0xFFFF);
+    const __m256i bias = _mm256_set1_epi32(32768);
+    const __m256 scale = _mm256_set1_ps(0.195f);
+
+    for (int samp = 0; samp < nSamples; samp++)
+    {
+        const unsigned char* frame = buffer + samp * plan.frameSize;
+        float* row = out + samp * outStride;
+
+        int chan = 0;
+
+        for (; chan < vectorChannels; chan += 8)
+        {
+            // each gathered dword holds the amplifier word in its low half;
+            // the high half (next stream, or the filler word) is masked off
+            __m256i index = _mm256_loadu_si256((const __m256i*)(offsets + chan));
+            __m256i words = _mm256_i32gather_epi32((const int*) frame, index, 1);
+            words = _mm256_sub_epi32(_mm256_and_si256(words, mask), bias);
+
+            _mm256_storeu_ps(row + chan, _mm256_mul_ps(_mm256_cvtepi32_ps(words), scale));
+        }
+
+        for (; chan < numAmplifierChannels; chan++)
+        {
+            uint16_t word;
+            memcpy(&word, frame + offsets[chan], sizeof(word));
+            row[chan] = float(word - 32768) * 0.195f;
+        }
+    }
+}
+
+#else
+
+void BlockDecoder::decodeSSE2(const unsigned char* buffer, int nSamples, float* out, int outStride) const
+{
+    decodeScalar(buffer, nSamples, out, outStride);
+}
+
+void BlockDecoder::decodeAVX2(const unsigned char* buffer, int nSamples, float* out, int outStride) const
+{
+    decodeScalar(buffer, nSamples, out, outStride);
+}
+
+#endif
+
+DecoderInstructionSet BlockDecoder::detectInstructionSet()
+{
+#if defined(RHYTHM_DECODER_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    bool hasSse2 = (info[3] & (1 << 26)) != 0;
+    bool osSavesAvx = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+
+    if (maxLeaf >= 7 && osSavesAvx)
+    {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+            return DECODER_AVX2;
+    }
+
+    return hasSse2 ? DECODER_SSE2 : DECODER_SCALAR;
+#elif defined(RHYTHM_DECODER_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return DECODER_AVX2;
+
+    if (__builtin_cpu_supports("sse2"))
+        return DECODER_SSE2;
+
+    return DECODER_SCALAR;
+#else
+    return DECODER_SCALAR;
+#endif
+}
+
+void BlockDecoder::setInstructionSet(DecoderInstructionSet set)
+{
+    DecoderInstructionSet supported = detectInstructionSet();
+
+    instructionSet = set > supported ? supported : set;
+}
+
+const char* BlockDecoder::getInstructionSetName(DecoderInstructionSet set)
+{
+    switch (set)
+    {
+    case DECODER_AVX2:
+        return "AVX2";
+    case DECODER_SSE2:
+        return "SSE2";
+    default:
+        return "scalar";
+    }
+}
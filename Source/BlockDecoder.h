@@ -0,0 +1,314 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __BLOCKDECODER_H_7E1A9C42__
+#define __BLOCKDECODER_H_7E1A9C42__
+
+#include <stdint.h>
+#include <array>
+#include <utility>
+#include <vector>
+
+#include "AcquisitionProfiler.h"
+
+#define RHD2132_16CH_OFFSET 8
+
+namespace RhythmNode
+{
+
+	/** Instruction sets available to the block decoder */
+	enum DecoderInstructionSet
+	{
+		DECODER_SCALAR = 0,
+		DECODER_SSE2 = 1,
+		DECODER_AVX2 = 2
+	};
+
+	/** A channel whose value is a linear function of one unsigned USB word */
+	struct LinearChannel
+	{
+		int byteOffset; // offset of the source word within a frame
+		int channel;    // index of the output channel
+		double scale;
+		double offset;
+		double dcOffset; // added after offset, so the sum rounds like the original expression
+	};
+
+	/**
+		Flat description of how one USB frame maps to a row of output samples.
+
+		Output channels are ordered as: amplifier channels for all streams,
+		3 aux channels for each stream in auxOffsets, then the ADC channels.
+	*/
+	struct DecodePlan
+	{
+		int numStreams = 0;
+		int frameSize = 32;
+		int numChannels = 0;
+
+		/** Byte offset of each amplifier channel */
+		std::vector<int> amplifierOffsets;
+
+		/** Byte offset of the AuxCmd2 result for each stream that has aux channels */
+		std::vector<int> auxOffsets;
+		int firstAuxChannel = 0;
+
+		/** ADC channels (empty if ADCs are not acquired) */
+		std::vector<LinearChannel> adcChannels;
+	};
+
+	/**
+		Converts raw Rhythm USB blocks into floating-point samples.
+
+		Each frame (one sample from every enabled data stream) has the layout:
+		- 8-byte magic number header
+		- 4-byte timestamp
+		- 3 aux command results per stream        [auxCmd][stream]
+		- 32 amplifier words per stream           [channel][stream]
+		- 1 filler word per stream
+		- 8 ADC words
+		- TTL in and TTL out words
+
+		If a header is missing, the decoder scans forward for the next one and
+		carries a frame split across two blocks over to the next call, so a
+		misaligned stream realigns without restarting acquisition. Gaps in the
+		32-bit frame timestamps are counted and flagged on the TTL event line
+		just above the digital inputs. Headers and timestamp continuity are
+		checked for a whole run of frames in one pass, so only runs that
+		contain a gap are searched frame by frame.
+
+		The layout is compiled into a DecodePlan once, when acquisition starts
+		or settings change, so the per-sample loops only walk flat tables.
+		Aux, ADC, timestamp and TTL words are converted by a kernel specialized
+		for the number of streams and the aux/ADC flags, so frame strides and
+		ADC/TTL offsets are compile-time constants; layouts outside the
+		specialized range use the generic loop. The streams that carry aux
+		channels (not the RHD2164 MISO B streams) are still read from the plan.
+
+		Amplifier channels are de-interleaved and scaled to microvolts
+		using the widest instruction set supported by the host CPU, with
+		results identical to the scalar conversion.
+
+		This class has no dependencies on the GUI, so it can be used
+		outside of the plugin (e.g. for benchmarking).
+
+	*/
+	class BlockDecoder
+	{
+	public:
+
+		/** Constructor */
+		BlockDecoder();
+
+		/** Destructor */
+		~BlockDecoder() { }
+
+		/** Rebuilds the decode plan.
+			halfChannels[s] is true for RHD2132 chips in 16-channel mode,
+			auxChannels[s] is true if stream s contributes 3 aux channels. */
+		void setLayout(int numStreams,
+					   const int* channelsPerStream,
+					   const bool* halfChannels,
+					   const bool* auxChannels,
+					   bool acquireAdc);
+
+		/** Sets the conversion for one ADC channel (value = scale * word + offset + dcOffset) */
+		void setAdcConversion(int adcChannel, double scale, double offset, double dcOffset = 0.0);
+
+		/** Returns the current decode plan */
+		const DecodePlan& getPlan() const { return plan; }
+
+		/** Returns the number of output channels produced per frame */
+		int getNumChannels() const { return plan.numChannels; }
+
+		/** Returns the number of amplifier channels produced per frame */
+		int getNumAmplifierChannels() const { return (int) plan.amplifierOffsets.size(); }
+
+		/** Returns the number of data streams in the current layout */
+		int getNumStreams() const { return plan.numStreams; }
+
+		/** Returns the number of frames at the start of the buffer that have a valid header */
+		int countValidFrames(const unsigned char* buffer, int nSamples) const;
+
+		/** Decodes the frames in nSamples frames' worth of bytes, skipping over corrupt data.
+			Samples are written as one row of outStride floats per frame;
+			sampleNumbers and eventCodes receive one value per frame.
+			Returns the number of frames decoded (at most nSamples). */
+		int decodeBlock(const unsigned char* buffer,
+						int nSamples,
+						float* out,
+						int outStride,
+						long long* sampleNumbers,
+						unsigned long long* eventCodes);
+
+		/** Writes the amplifier channels of nSamples frames to out, one row of outStride floats per sample */
+		void decodeAmplifierData(const unsigned char* buffer, int nSamples, float* out, int outStride) const;
+
+		/** Sets the number of TTL input lines; frames following a timestamp gap
+			set the event line after the last input */
+		void setNumTtlLines(int numLines);
+
+		/** Clears the held aux values, the partial frame and the drop counters; call when acquisition starts */
+		void resetStreamState();
+
+		/** Times header validation and decoding in decodeBlock() (nullptr to disable) */
+		void setProfiler(AcquisitionProfiler* profiler_) { profiler = profiler_; }
+
+		/** Returns the number of times frame sync was lost since resetStreamState() */
+		int64_t getNumResyncs() const { return numResyncs; }
+
+		/** Returns the number of bytes skipped while resynchronizing */
+		int64_t getNumSkippedBytes() const { return numSkippedBytes; }
+
+		/** Returns the number of gaps in the frame timestamps */
+		int64_t getNumGaps() const { return numGaps; }
+
+		/** Returns the total number of frames missing from the gaps */
+		int64_t getNumDroppedFrames() const { return numDroppedFrames; }
+
+		/** Enables or disables the specialized aux/ADC kernels (the generic loop is used when disabled) */
+		void setSpecializedKernelsEnabled(bool enabled);
+
+		/** Returns true if the current layout is decoded by a specialized kernel */
+		bool isUsingSpecializedKernel() const { return auxiliaryKernel != nullptr; }
+
+		/** Forces a particular instruction set (falls back to the best supported one) */
+		void setInstructionSet(DecoderInstructionSet set);
+
+		/** Returns the instruction set used for decoding */
+		DecoderInstructionSet getInstructionSet() const { return instructionSet; }
+
+		/** Returns the widest instruction set supported by this CPU */
+		static DecoderInstructionSet detectInstructionSet();
+
+		/** Returns a printable name for an instruction set */
+		static const char* getInstructionSetName(DecoderInstructionSet set);
+
+		/** Returns the size of a single frame, in bytes
+			(8 header + 4 timestamp + (6 aux + 64 amplifier + 2 filler) per stream + 16 ADC + 4 TTL) */
+		static constexpr int getFrameSizeInBytes(int numStreams) { return 32 + 72 * numStreams; }
+
+		/** Returns the byte offset of the first aux word within a frame */
+		static constexpr int getAuxOffset(int) { return 12; }
+
+		/** Returns the byte offset of the first amplifier word within a frame */
+		static constexpr int getAmplifierOffset(int numStreams) { return 12 + 6 * numStreams; }
+
+		/** Returns the byte offset of the first ADC word within a frame */
+		static constexpr int getAdcOffset(int numStreams) { return 12 + 72 * numStreams; }
+
+		/** Returns the byte offset of the TTL in word within a frame */
+		static constexpr int getTtlOffset(int numStreams) { return 28 + 72 * numStreams; }
+
+		/** Largest stream count with a specialized kernel */
+		static const int MAX_SPECIALIZED_STREAMS = 16;
+
+	private:
+
+		void decodeScalar(const unsigned char* buffer, int nSamples, float* out, int outStride) const;
+		void decodeSSE2(const unsigned char* buffer, int nSamples, float* out, int outStride) const;
+		void decodeAVX2(const unsigned char* buffer, int nSamples, float* out, int outStride) const;
+
+		/** Decodes nSamples contiguous frames that all have valid headers */
+		void decodeFrames(const unsigned char* buffer,
+						  int nSamples,
+						  float* out,
+						  int outStride,
+						  long long* sampleNumbers,
+						  unsigned long long* eventCodes);
+
+		/** Counts and flags gaps in the frame timestamps of nSamples decoded frames;
+			contiguous is set when the frames are known to be numbered consecutively */
+		void detectGaps(const long long* sampleNumbers,
+						unsigned long long* eventCodes,
+						int nSamples,
+						bool contiguous);
+
+		/** Returns the first 2-byte aligned header in [start, end), including one cut off
+			by end, or end if there is none */
+		const unsigned char* findHeader(const unsigned char* start, const unsigned char* end) const;
+
+		/** Converts aux, ADC, timestamp and TTL words for nSamples frames */
+		void decodeAuxiliaryData(const unsigned char* buffer,
+								 int nSamples,
+								 float* out,
+								 int outStride,
+								 long long* sampleNumbers,
+								 unsigned long long* eventCodes);
+
+		typedef void (BlockDecoder::*AuxiliaryKernel)(const unsigned char*, int, float*, int, long long*, unsigned long long*);
+
+		/** decodeAuxiliaryData() with the stream count and aux/ADC flags fixed at compile time */
+		template <int NumStreams, bool AcquireAux, bool AcquireAdc>
+		void decodeAuxiliaryKernel(const unsigned char* buffer,
+								   int nSamples,
+								   float* out,
+								   int outStride,
+								   long long* sampleNumbers,
+								   unsigned long long* eventCodes);
+
+		/** Returns the kernels for 1..N streams with the given flags */
+		template <bool AcquireAux, bool AcquireAdc, int... N>
+		static std::array<AuxiliaryKernel, sizeof...(N)> makeKernelTable(std::integer_sequence<int, N...>);
+
+		/** Picks the kernel for the current plan (nullptr selects the generic loop) */
+		void selectAuxiliaryKernel();
+
+		DecodePlan plan;
+
+		AuxiliaryKernel auxiliaryKernel;
+		bool specializedKernelsEnabled;
+
+		/** aux inputs are only sampled every 4th frame; the latest 3 results per stream are
+			collected in auxSamples and copied to auxHeld once all 3 have arrived */
+		std::vector<float> auxSamples;
+		std::vector<float> auxHeld;
+
+		/** Start of a frame that was cut off at the end of the last block; begins with a header
+			or, if fewer than 8 bytes were left, with the start of one */
+		std::vector<unsigned char> carry;
+		int carryBytes;
+
+		bool hasTimestamp;
+		uint32_t lastTimestamp;
+
+		/** Timestamp of the first decoded frame, which has aux phase 0 */
+		bool hasTimestampOrigin;
+		uint32_t timestampOrigin;
+
+		unsigned long long ttlMask;
+		unsigned long long gapEventCode;
+
+		int64_t numResyncs;
+		int64_t numSkippedBytes;
+		int64_t numGaps;
+		int64_t numDroppedFrames;
+
+		AcquisitionProfiler* profiler;
+
+		DecoderInstructionSet instructionSet;
+
+	};
+
+}
+#endif  // __BLOCKDECODER_H_7E1A9C42__
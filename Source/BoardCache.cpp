@@ -0,0 +1,121 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "BoardCache.h"
+
+using namespace RhythmNode;
+
+BoardCache::BoardCache(const File& file_) :
+    file(file_)
+{
+}
+
+bool BoardCache::find(const String& serialNumber, BoardCacheEntry& entry) const
+{
+    std::unique_ptr<XmlElement> xml = XmlDocument::parse(file);
+
+    if (xml == nullptr)
+        return false;
+
+    forEachXmlChildElementWithTagName(*xml, board, "BOARD")
+    {
+        if (board->getStringAttribute("serial") != serialNumber)
+            continue;
+
+        entry.bitfileHash = board->getStringAttribute("bitfile_hash");
+        entry.boardVersion = board->getIntAttribute("board_version", -1);
+        entry.chipId.clear();
+        entry.cableDelay.clear();
+
+        forEachXmlChildElementWithTagName(*board, headstage, "HEADSTAGE")
+        {
+            entry.chipId.add(headstage->getIntAttribute("chip_id", -1));
+            entry.cableDelay.add(headstage->getIntAttribute("delay", 0));
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void BoardCache::store(const String& serialNumber, const BoardCacheEntry& entry)
+{
+    std::unique_ptr<XmlElement> xml = XmlDocument::parse(file);
+
+    if (xml == nullptr || !xml->hasTagName("RHYTHM_BOARDS"))
+        xml = std::unique_ptr<XmlElement>(new XmlElement("RHYTHM_BOARDS"));
+
+    XmlElement* board = xml->getChildByAttribute("serial", serialNumber);
+
+    if (board != nullptr)
+        xml->removeChildElement(board, true);
+
+    board = xml->createNewChildElement("BOARD");
+    board->setAttribute("serial", serialNumber);
+    board->setAttribute("bitfile_hash", entry.bitfileHash);
+    board->setAttribute("board_version", entry.boardVersion);
+
+    for (int hs = 0; hs < entry.chipId.size(); hs++)
+    {
+        XmlElement* headstage = board->createNewChildElement("HEADSTAGE");
+        headstage->setAttribute("chip_id", entry.chipId[hs]);
+        headstage->setAttribute("delay", entry.cableDelay[hs]);
+    }
+
+    file.getParentDirectory().createDirectory();
+
+    if (!xml->writeTo(file))
+        LOGE("Could not write the board cache to ", file.getFullPathName());
+}
+
+String BoardCache::hashBitfile(const File& bitfile)
+{
+    MemoryBlock contents;
+
+    if (!bitfile.loadFileAsData(contents) || contents.getSize() == 0)
+        return String();
+
+    // 64-bit FNV-1a
+    const uint8* bytes = static_cast<const uint8*>(contents.getData());
+    uint64 hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < contents.getSize(); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return String::toHexString((int64) hash);
+}
+
+File BoardCache::getDefaultFile()
+{
+#if defined(__APPLE__)
+    File directory = File::getSpecialLocation(File::userApplicationDataDirectory).getChildFile("Application Support/open-ephys");
+#else
+    File directory = File::getSpecialLocation(File::userApplicationDataDirectory).getChildFile("open-ephys");
+#endif
+
+    return directory.getChildFile("rhythm-board-cache.xml");
+}
@@ -0,0 +1,88 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __BOARDCACHE_H_4F9D2A61__
+#define __BOARDCACHE_H_4F9D2A61__
+
+#include <DataThreadHeaders.h>
+
+namespace RhythmNode
+{
+
+	/** What an earlier session loaded onto a board and found connected to it */
+	struct BoardCacheEntry
+	{
+		/** Hash of the bitfile uploaded to the FPGA (see BoardCache::hashBitfile()) */
+		String bitfileHash;
+
+		/** Rhythm version the FPGA reported after the upload */
+		int boardVersion = -1;
+
+		/** Chip ID and cable delay found for each headstage by the last port scan */
+		Array<int> chipId;
+		Array<int> cableDelay;
+	};
+
+	/**
+		Remembers the FPGA configuration and headstage map of each board between sessions.
+
+		The FPGA keeps its configuration until the board is power cycled. If it still
+		reports the Rhythm version recorded here, and the bitfile on disk has the recorded
+		hash, it does not need to be configured again, and the first port scan can check
+		the recorded chips instead of sweeping the cable delays.
+
+		The FPGA only reports its board ID and Rhythm version, not which bitfile it runs,
+		so a different bitfile with the same Rhythm version (e.g. uploaded by another
+		program since) is not detected.
+
+		Entries are kept by serial number in an XML file.
+
+	*/
+	class BoardCache
+	{
+	public:
+
+		/** Constructor; entries are read from and written to file */
+		BoardCache(const File& file = getDefaultFile());
+
+		/** Looks up the entry for a board; returns false if there is none */
+		bool find(const String& serialNumber, BoardCacheEntry& entry) const;
+
+		/** Adds or replaces the entry for a board and writes the file */
+		void store(const String& serialNumber, const BoardCacheEntry& entry);
+
+		/** Returns a hash of the contents of a bitfile, or an empty string if it can't be read */
+		static String hashBitfile(const File& bitfile);
+
+		/** Returns the cache file in the user's application data directory */
+		static File getDefaultFile();
+
+	private:
+
+		File file;
+
+		JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(BoardCache);
+	};
+
+}
+#endif  // __BOARDCACHE_H_4F9D2A61__
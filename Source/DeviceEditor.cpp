@@ -399,6 +399,9 @@ void DeviceEditor::saveVisualizerEditorParameters(XmlElement* xml)
     xml->setAttribute("DSPCutoffFreq", dspInterface->getDspCutoffFreq());
     xml->setAttribute("save_impedance_measurements",saveImpedances);
     xml->setAttribute("auto_measure_impedances",measureWhenRecording);
+    xml->setAttribute("exhaustive_impedance_sweep", board->getExhaustiveImpedanceSweep());
+    xml->setAttribute("impedance_spectroscopy", board->getImpedanceSpectroscopy());
+    xml->setAttribute("quick_impedance_check", board->getQuickImpedanceCheck());
     xml->setAttribute("LEDs", ledButton->getToggleState());
     xml->setAttribute("ClockDivideRatio", clockInterface->getClockDivideRatio());
 
@@ -439,6 +442,9 @@ void DeviceEditor::loadVisualizerEditorParameters(XmlElement* xml)
     dspInterface->setDspCutoffFreq(xml->getDoubleAttribute("DSPCutoffFreq"));
     saveImpedances = xml->getBoolAttribute("save_impedance_measurements");
     measureWhenRecording = xml->getBoolAttribute("auto_measure_impedances");
+    board->setExhaustiveImpedanceSweep(xml->getBoolAttribute("exhaustive_impedance_sweep", false));
+    board->setImpedanceSpectroscopy(xml->getBoolAttribute("impedance_spectroscopy", false));
+    board->setQuickImpedanceCheck(xml->getBoolAttribute("quick_impedance_check", false));
     ledButton->setToggleState(xml->getBoolAttribute("LEDs", true),sendNotification);
     clockInterface->setClockDivideRatio(xml->getIntAttribute("ClockDivideRatio"));
 
@@ -30,6 +30,12 @@
 
 #include "ImpedanceMeter.h"
 #include "Headstage.h"
+#include "BoardCache.h"
+
+#include "rhythm-api/rhd2000frontpaneltransport.h"
+#include "rhythm-api/rhd2000simulator.h"
+
+#include <sstream>
 
 using namespace RhythmNode;
 
@@ -51,6 +57,11 @@ BoardType DeviceThread::boardType = ACQUISITION_BOARD; // initialize static memb
 
 #define INIT_STEP ( evalBoard->isUSB3() ? 256 : 60)
 
+// transfers queued between the USB reader and the decoder; each holds up to getMaxUsbBlocksPerRead() blocks
+#define USB_READER_NUM_BUFFERS 16
+#define USB_READ_LATENCY_TARGET_MS 30
+#define FIFO_OVERFLOW_WARNING_SECONDS 10
+
 DataThread* DeviceThread::createDataThread(SourceNode *sn)
 {
     return new DeviceThread(sn, boardType);
@@ -61,16 +72,16 @@ DeviceThread::DeviceThread(SourceNode* sn, BoardType boardType_) : DataThread(sn
     deviceFound(false),
     isTransmitting(false),
     channelNamingScheme(GLOBAL_INDEX),
-    updateSettingsDuringAcquisition(false)
+    updateSettingsDuringAcquisition(false),
+    decodePlanChanged(false),
+    sampleBlockStride(0),
+    boardVersion(-1)
 {
 
     boardType = boardType_;
 
     impedanceThread = new ImpedanceMeter(this);
 
-    memset(auxBuffer, 0, sizeof(auxBuffer));
-    memset(auxSamples, 0, sizeof(auxSamples));
-
     for (int i = 0; i < 8; i++)
         adcRangeSettings[i] = 0;
 
@@ -79,7 +90,21 @@ DeviceThread::DeviceThread(SourceNode* sn, BoardType boardType_) : DataThread(sn
     for (int i = 0; i < maxNumHeadstages; i++)
         headstages.add(new Headstage(static_cast<Rhd2000EvalBoard::BoardDataSource>(i), maxNumHeadstages));
 
-    evalBoard = new Rhd2000EvalBoard;
+    // Setting RHYTHM_SIMULATE_BOARD to "usb2" or "usb3" replaces the Opal Kelly board
+    // with an in-process simulator, for profiling without hardware
+    const String simulatedBoard = SystemStats::getEnvironmentVariable("RHYTHM_SIMULATE_BOARD", String());
+
+    if (simulatedBoard.isNotEmpty())
+    {
+        LOGD("Using a simulated ", simulatedBoard, " acquisition board");
+        evalBoard = new Rhd2000EvalBoard(new Rhd2000Simulator(simulatedBoard.equalsIgnoreCase("usb3")));
+    }
+    else
+    {
+        evalBoard = new Rhd2000EvalBoard(new Rhd2000FrontPanelTransport);
+    }
+
+    usbReader = new UsbReader(evalBoard);
 
     sourceBuffers.add(new DataBuffer(2, 10000)); // start with 2 channels and automatically resize
 
@@ -104,9 +129,11 @@ DeviceThread::DeviceThread(SourceNode* sn, BoardType boardType_) : DataThread(sn
     dacThresholds = new float[8];
     dacChannelsToUpdate = new bool[8];
 
+    double phaseStart = Time::getMillisecondCounterHiRes();
+
     if (openBoard(libraryFilePath))
     {
-        dataBlock = new Rhd2000DataBlock(1, evalBoard->isUSB3());
+        LOGD("Startup: opening the board took ", int(Time::getMillisecondCounterHiRes() - phaseStart), " ms");
 
         // upload bitfile and restore default settings
         initializeBoard();
@@ -120,7 +147,9 @@ DeviceThread::DeviceThread(SourceNode* sn, BoardType boardType_) : DataThread(sn
         //std::cout << "MAX NUM STREAMS: " << MAX_NUM_DATA_STREAMS << ", MAX NUM HEADSTAGES: " << MAX_NUM_HEADSTAGES << std::endl;
 
         // automatically find connected headstages
+        phaseStart = Time::getMillisecondCounterHiRes();
         scanPorts(); // things would appear to run more smoothly if this were done after the editor has been created
+        LOGD("Startup: port scan took ", int(Time::getMillisecondCounterHiRes() - phaseStart), " ms");
 
         for (int k = 0; k < 8; k++)
         {
@@ -393,6 +422,10 @@ bool DeviceThread::uploadBitfile(String bitfilename)
         }
 
     }
+    else
+    {
+        bitfileHash = BoardCache::hashBitfile(File(bitfilename));
+    }
 
     return deviceFound;
 
@@ -422,11 +455,44 @@ void DeviceThread::initializeBoard()
     else if (boardType == RHD_RECORDING_CONTROLLER)
         bitfilename += "intan_rec_controller.bit";
 
-    if (!uploadBitfile(bitfilename))
+    double phaseStart = Time::getMillisecondCounterHiRes();
+
+    // Configuring the FPGA takes seconds. If it still runs the bitfile uploaded by an
+    // earlier session, skip the upload and start from the headstages that session found.
+    // The FPGA only reports its board ID and Rhythm version, so another bitfile with the
+    // same version loaded by a different program in the meantime goes unnoticed.
+    const String serialNumber(evalBoard->getSerialNumber());
+    BoardCacheEntry cached;
+    int runningVersion = -1;
+
+    bitfileHash = BoardCache::hashBitfile(File(bitfilename));
+
+    if (bitfileHash.isNotEmpty()
+        && boardCache.find(serialNumber, cached)
+        && cached.bitfileHash == bitfileHash
+        && evalBoard->isRhythmConfigured(runningVersion)
+        && runningVersion == cached.boardVersion)
     {
-        return;
+        LOGD("FPGA is already configured with ", bitfilename, " (Rhythm version ", runningVersion, "), skipping upload");
+
+        deviceFound = true;
+        boardVersion = runningVersion;
+        scannedChipId = cached.chipId;
+        scannedDelay = cached.cableDelay;
+    }
+    else
+    {
+        if (!uploadBitfile(bitfilename))
+        {
+            return;
+        }
+
+        evalBoard->isRhythmConfigured(boardVersion);
     }
 
+    LOGD("Startup: FPGA configuration took ", int(Time::getMillisecondCounterHiRes() - phaseStart), " ms");
+    phaseStart = Time::getMillisecondCounterHiRes();
+
     // Initialize the board
     LOGD("Initializing RHD2000 board.");
     evalBoard->initialize();
@@ -445,6 +511,8 @@ void DeviceThread::initializeBoard()
 
     setSampleRate(Rhd2000EvalBoard::SampleRate30000Hz);
 
+    evalBoard->beginConfig();
+
     evalBoard->setCableLengthMeters(Rhd2000EvalBoard::PortA, settings.cableLength.portA);
     evalBoard->setCableLengthMeters(Rhd2000EvalBoard::PortB, settings.cableLength.portB);
     evalBoard->setCableLengthMeters(Rhd2000EvalBoard::PortC, settings.cableLength.portC);
@@ -477,22 +545,18 @@ void DeviceThread::initializeBoard()
     evalBoard->setMaxTimeStep(INIT_STEP);
     evalBoard->setContinuousRunMode(false);
 
-    // Start SPI interface
-    evalBoard->run();
+    evalBoard->commitConfig();
 
-    // Wait for the 60-sample run to complete
-    while (evalBoard->isRunning())
-    {
-        ;
-    }
+    // Start SPI interface and wait for the 60-sample run to complete
+    runInitSequence();
 
     // Read the resulting single data block from the USB interface. We don't
     // need to do anything with this, since it was only used for ADC calibration
-    ScopedPointer<Rhd2000DataBlock> dataBlock = new Rhd2000DataBlock(evalBoard->getNumEnabledDataStreams(), evalBoard->isUSB3());
-
-    evalBoard->readDataBlock(dataBlock, INIT_STEP);
+    Rhd2000BlockView calibrationBlock;
+    evalBoard->readDataBlock(calibrationBlock, INIT_STEP);
     // Now that ADC calibration has been performed, we switch to the command sequence
     // that does not execute ADC calibration.
+    evalBoard->beginConfig();
     evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortA, Rhd2000EvalBoard::AuxCmd3,
         settings.fastSettleEnabled ? 2 : 1);
     evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortB, Rhd2000EvalBoard::AuxCmd3,
@@ -514,6 +578,8 @@ void DeviceThread::initializeBoard()
             settings.fastSettleEnabled ? 2 : 1);
     }
 
+    evalBoard->commitConfig();
+
     adcChannelNames.clear();
     ttlLineNames.clear();
 
@@ -523,6 +589,7 @@ void DeviceThread::initializeBoard()
         ttlLineNames.add("TTL" + String(i + 1));
     }
 
+    LOGD("Startup: board initialization took ", int(Time::getMillisecondCounterHiRes() - phaseStart), " ms");
 }
 
 void DeviceThread::scanPorts()
@@ -574,6 +641,9 @@ void DeviceThread::scanPorts()
     // Enable all data streams, and set sources to cover one or two chips
     // on Ports A-D.
 
+    // The scan setup goes out in one wire-in update
+    evalBoard->beginConfig();
+
     // THIS IS DIFFERENT FOR RECORDING CONTROLLER:
     for (int i = 0; i < 8; i++)
         evalBoard->setDataSource(i, initStreamPorts[i]);
@@ -609,58 +679,151 @@ void DeviceThread::scanPorts()
     evalBoard->setMaxTimeStep(INIT_STEP);
     evalBoard->setContinuousRunMode(false);
 
-    ScopedPointer<Rhd2000DataBlock> dataBlock =
-        new Rhd2000DataBlock(evalBoard->getNumEnabledDataStreams(), evalBoard->isUSB3());
+    evalBoard->commitConfig();
+
+    // Only the ROM registers read back on AuxCmd3 are needed, so frames are not decoded
+    Rhd2000BlockView dataBlock;
+
+    const int numHeadstages = headstages.size();
+    const int numPorts = (boardType == RHD_RECORDING_CONTROLLER) ? 8 : 4;
+
+    // the scan only enables streams for the first 8 headstages
+    const int numProbed = jmin(numHeadstages, evalBoard->getNumEnabledDataStreams());
+
+    auto isChipPresent = [](int id, int register59Value)
+    {
+        return id == CHIP_ID_RHD2132 || id == CHIP_ID_RHD2216 ||
+               (id == CHIP_ID_RHD2164 && register59Value == REGISTER_59_MISO_A);
+    };
 
     Array<int> sumGoodDelays;
-    sumGoodDelays.insertMultiple(0, 0, 8);
+    sumGoodDelays.insertMultiple(0, 0, numHeadstages);
 
     Array<int> indexFirstGoodDelay;
-    indexFirstGoodDelay.insertMultiple(0, -1, 8);
+    indexFirstGoodDelay.insertMultiple(0, -1, numHeadstages);
 
     Array<int> indexSecondGoodDelay;
-    indexSecondGoodDelay.insertMultiple(0, -1, 8);
+    indexSecondGoodDelay.insertMultiple(0, -1, numHeadstages);
+
+    Array<int> optimumDelay;
+    optimumDelay.insertMultiple(0, 0, numHeadstages);
+
+    // Headstages that answer as the MISO B half of an RHD2164 have no chip or delay of their own
+    Array<bool> rhd2164B;
+    rhd2164B.insertMultiple(0, false, numHeadstages);
+
+    auto isRhd2164B = [](int id, int register59Value)
+    {
+        return id == CHIP_ID_RHD2164 && register59Value == REGISTER_59_MISO_B;
+    };
+
+    // A headstage is settled once its optimum delay can no longer change: it has 3 good
+    // delays (the second one is used, as after a full sweep), or it answers as an RHD2164
+    // MISO B half. Headstages without a stream are never probed.
+    Array<bool> settled;
+    settled.insertMultiple(0, false, numHeadstages);
+
+    for (hs = numProbed; hs < numHeadstages; ++hs)
+        settled.set(hs, true);
+
+    // The last scan recorded what each headstage answered: a chip ID, CHIP_ID_RHD2164_B for
+    // an RHD2164 MISO B half, or -1 for no chip. A rescan first checks the chips and MISO B
+    // halves at their delays in a single run, and only sweeps headstages whose answer changed.
+    // Headstages that were empty are always swept, since a headstage plugged in since then
+    // may not answer at the delay it would be checked at.
+    if (scannedChipId.size() == numHeadstages && scannedDelay.size() == numHeadstages)
+    {
+        evalBoard->beginConfig();
+
+        for (int port = 0; port < numPorts; ++port)
+        {
+            int portDelay = 0;
+
+            for (hs = 2 * port; hs < 2 * port + 2 && hs < numHeadstages; ++hs)
+            {
+                if (scannedChipId[hs] > 0 && scannedChipId[hs] != CHIP_ID_RHD2164_B)
+                    portDelay = std::max(portDelay, scannedDelay[hs]);
+            }
+
+            evalBoard->setCableDelay(static_cast<Rhd2000EvalBoard::BoardPort>(port), portDelay);
+        }
+
+        evalBoard->commitConfig();
+
+        runInitSequence();
+
+        // if the block can't be read, every headstage is swept
+        bool blockRead = evalBoard->readDataBlock(dataBlock, INIT_STEP);
+
+        for (hs = 0; hs < numProbed && blockRead; ++hs)
+        {
+            id = getDeviceId(dataBlock, hs, register59Value);
+
+            if (scannedChipId[hs] == CHIP_ID_RHD2164_B)
+            {
+                if (isRhd2164B(id, register59Value))
+                {
+                    rhd2164B.set(hs, true);
+                    settled.set(hs, true);
+                }
+            }
+            else if (scannedChipId[hs] > 0)
+            {
+                if (id == scannedChipId[hs] && isChipPresent(id, register59Value))
+                {
+                    LOGD( "Device ID confirmed: ", id );
 
-    // Run SPI command sequence at all 16 possible FPGA MISO delay settings
-    // to find optimum delay for each SPI interface cable.
+                    tmpChipId.set(hs, id);
+                    optimumDelay.set(hs, scannedDelay[hs]);
+                    settled.set(hs, true);
+                }
+            }
+        }
+    }
+
+    // Run SPI command sequence at each of the 16 possible FPGA MISO delay settings
+    // to find optimum delay for each SPI interface cable, until every headstage
+    // has settled.
 
     LOGD( "Checking for connected amplifier chips..." );
 
-    for (delay = 0; delay < 16; delay++)
+    for (delay = 0; delay < 16 && settled.contains(false); delay++)
     {
-        evalBoard->setCableDelay(Rhd2000EvalBoard::PortA, delay);
-        evalBoard->setCableDelay(Rhd2000EvalBoard::PortB, delay);
-        evalBoard->setCableDelay(Rhd2000EvalBoard::PortC, delay);
-        evalBoard->setCableDelay(Rhd2000EvalBoard::PortD, delay);
+        // ports with only settled headstages keep their delay
+        evalBoard->beginConfig();
 
-        if (boardType == RHD_RECORDING_CONTROLLER)
+        for (int port = 0; port < numPorts; ++port)
         {
-            evalBoard->setCableDelay(Rhd2000EvalBoard::PortE, delay);
-            evalBoard->setCableDelay(Rhd2000EvalBoard::PortF, delay);
-            evalBoard->setCableDelay(Rhd2000EvalBoard::PortG, delay);
-            evalBoard->setCableDelay(Rhd2000EvalBoard::PortH, delay);
+            if (!settled[2 * port] || (2 * port + 1 < numHeadstages && !settled[2 * port + 1]))
+                evalBoard->setCableDelay(static_cast<Rhd2000EvalBoard::BoardPort>(port), delay);
         }
 
-        // Start SPI interface.
-        evalBoard->run();
+        evalBoard->commitConfig();
 
-        // Wait for the 60-sample run to complete.
-        while (evalBoard->isRunning())
+        // Run the command sequence and read the resulting single data block
+        runInitSequence();
+
+        if (!evalBoard->readDataBlock(dataBlock, INIT_STEP))
         {
-            ;
+            LOGE("Port scan: could not read the data block for delay ", delay);
+            continue;
         }
-        // Read the resulting single data block from the USB interface.
-        evalBoard->readDataBlock(dataBlock, INIT_STEP);
 
         // Read the Intan chip ID number from each RHD2000 chip found.
         // Record delay settings that yield good communication with the chip.
-        for (hs = 0; hs < headstages.size(); ++hs)
+        for (hs = 0; hs < numProbed; ++hs)
         {
+            if (settled[hs])
+                continue;
 
             id = getDeviceId(dataBlock, hs, register59Value);
 
-            if (id == CHIP_ID_RHD2132 || id == CHIP_ID_RHD2216 ||
-                (id == CHIP_ID_RHD2164 && register59Value == REGISTER_59_MISO_A))
+            if (isRhd2164B(id, register59Value))
+            {
+                rhd2164B.set(hs, true);
+                settled.set(hs, true);
+            }
+            else if (isChipPresent(id, register59Value))
             {
                 LOGD( "Device ID found: ", id );
 
@@ -676,10 +839,47 @@ void DeviceThread::scanPorts()
                     indexSecondGoodDelay.set(hs, delay);
                     tmpChipId.set(hs, id);
                 }
+                else
+                {
+                    settled.set(hs, true);
+                }
             }
         }
     }
 
+    // Pick the cable delay settings that yield good communication with each
+    // RHD2000 chip.
+    for (hs = 0; hs < numHeadstages; ++hs)
+    {
+        if (sumGoodDelays[hs] == 1 || sumGoodDelays[hs] == 2)
+        {
+            optimumDelay.set(hs,indexFirstGoodDelay[hs]);
+        }
+        else if (sumGoodDelays[hs] > 2)
+        {
+            optimumDelay.set(hs,indexSecondGoodDelay[hs]);
+        }
+    }
+
+    scannedChipId.clearQuick();
+
+    for (hs = 0; hs < numHeadstages; ++hs)
+        scannedChipId.add(rhd2164B[hs] ? CHIP_ID_RHD2164_B : tmpChipId[hs]);
+
+    scannedDelay = optimumDelay;
+
+    // remember the headstages for the next session
+    if (bitfileHash.isNotEmpty())
+    {
+        BoardCacheEntry entry;
+        entry.bitfileHash = bitfileHash;
+        entry.boardVersion = boardVersion;
+        entry.chipId = scannedChipId;
+        entry.cableDelay = scannedDelay;
+
+        boardCache.store(String(evalBoard->getSerialNumber()), entry);
+    }
+
 #if DEBUG_EMULATE_HEADSTAGES > 0
     if (tmpChipId[0] > 0)
     {
@@ -745,22 +945,7 @@ void DeviceThread::scanPorts()
 
     // Set cable delay settings that yield good communication with each
     // RHD2000 chip.
-    Array<int> optimumDelay;
-
-    optimumDelay.insertMultiple(0, 0, headstages.size());
-
-    for (hs = 0; hs < headstages.size(); ++hs)
-    {
-        if (sumGoodDelays[hs] == 1 || sumGoodDelays[hs] == 2)
-        {
-            optimumDelay.set(hs,indexFirstGoodDelay[hs]);
-        }
-        else if (sumGoodDelays[hs] > 2)
-        {
-            optimumDelay.set(hs,indexSecondGoodDelay[hs]);
-        }
-    }
-
+    evalBoard->beginConfig();
     evalBoard->setCableDelay(Rhd2000EvalBoard::PortA,
                              std::max(optimumDelay[0],optimumDelay[1]));
     evalBoard->setCableDelay(Rhd2000EvalBoard::PortB,
@@ -783,6 +968,8 @@ void DeviceThread::scanPorts()
 
     }
 
+    evalBoard->commitConfig();
+
     settings.cableLength.portA =
         evalBoard->estimateCableLengthMeters(std::max(optimumDelay[0],optimumDelay[1]));
     settings.cableLength.portB =
@@ -810,7 +997,15 @@ void DeviceThread::scanPorts()
     //newScan = true;
 }
 
-int DeviceThread::getDeviceId(Rhd2000DataBlock* dataBlock, int stream, int& register59Value)
+void DeviceThread::runInitSequence()
+{
+    evalBoard->run();
+
+    if (!evalBoard->waitForRunCompletion())
+        LOGE("Board did not finish a ", INIT_STEP, "-sample run within ", RUN_COMPLETION_TIMEOUT_MS, " ms of its expected end");
+}
+
+int DeviceThread::getDeviceId(const Rhd2000BlockView& dataBlock, int stream, int& register59Value)
 {
     bool intanChipPresent;
 
@@ -818,14 +1013,14 @@ int DeviceThread::getDeviceId(Rhd2000DataBlock* dataBlock, int stream, int& regi
     // the initial chip name ROM registers 24-26 that hold 'RHD'.
     // This is just used to verify that we are getting good data over the SPI
     // communication channel.
-    intanChipPresent = ((char) dataBlock->auxiliaryData[stream][2][32] == 'I' &&
-                        (char) dataBlock->auxiliaryData[stream][2][33] == 'N' &&
-                        (char) dataBlock->auxiliaryData[stream][2][34] == 'T' &&
-                        (char) dataBlock->auxiliaryData[stream][2][35] == 'A' &&
-                        (char) dataBlock->auxiliaryData[stream][2][36] == 'N' &&
-                        (char) dataBlock->auxiliaryData[stream][2][24] == 'R' &&
-                        (char) dataBlock->auxiliaryData[stream][2][25] == 'H' &&
-                        (char) dataBlock->auxiliaryData[stream][2][26] == 'D');
+    intanChipPresent = ((char) dataBlock.auxiliaryData(32, stream, 2) == 'I' &&
+                        (char) dataBlock.auxiliaryData(33, stream, 2) == 'N' &&
+                        (char) dataBlock.auxiliaryData(34, stream, 2) == 'T' &&
+                        (char) dataBlock.auxiliaryData(35, stream, 2) == 'A' &&
+                        (char) dataBlock.auxiliaryData(36, stream, 2) == 'N' &&
+                        (char) dataBlock.auxiliaryData(24, stream, 2) == 'R' &&
+                        (char) dataBlock.auxiliaryData(25, stream, 2) == 'H' &&
+                        (char) dataBlock.auxiliaryData(26, stream, 2) == 'D');
 
     // If the SPI communication is bad, return -1.  Otherwise, return the Intan
     // chip ID number stored in ROM regstier 63.
@@ -836,8 +1031,8 @@ int DeviceThread::getDeviceId(Rhd2000DataBlock* dataBlock, int stream, int& regi
     }
     else
     {
-        register59Value = dataBlock->auxiliaryData[stream][2][23]; // Register 59
-        return dataBlock->auxiliaryData[stream][2][19]; // chip ID (Register 63)
+        register59Value = dataBlock.auxiliaryData(23, stream, 2); // Register 59
+        return dataBlock.auxiliaryData(19, stream, 2); // chip ID (Register 63)
     }
 }
 
@@ -972,17 +1167,18 @@ void DeviceThread::updateSettings(OwnedArray<ContinuousChannel>* continuousChann
         }
     }
 
-    int numDigitalLines = boardType == INTAN_RHD_USB ? 16 : 8;
+    int numDigitalLines = getNumDigitalLines();
 
     LOGD("Number of digital lines enabled: ", numDigitalLines);
 
+    // one extra line pulses on the first sample after frames were lost
     EventChannel::Settings settings{
             EventChannel::Type::TTL,
             "Rhythm FPGA TTL Input",
-            "Events on digital input lines of a Rhythm FPGA device",
+            "Events on digital input lines of a Rhythm FPGA device; the last line marks gaps in the data",
             "rhythm-fpga-device.events",
             stream,
-            numDigitalLines
+            numDigitalLines + 1
     };
 
     eventChannels->add(new EventChannel(settings));
@@ -1035,6 +1231,30 @@ void DeviceThread::saveImpedances(File& file)
             xml->addChildElement(headstageXml);
         }
 
+        // Spectroscopy results are listed per measured chip channel
+        const int numFrequencies = impedances.frequencies.size();
+
+        if (numFrequencies > 1)
+        {
+            for (int i = 0; i < impedances.streams.size(); i++)
+            {
+                XmlElement* spectrumXml = new XmlElement("SPECTRUM");
+                spectrumXml->setAttribute("stream", impedances.streams[i]);
+                spectrumXml->setAttribute("channel", impedances.channels[i]);
+
+                for (int f = 0; f < numFrequencies; f++)
+                {
+                    XmlElement* pointXml = new XmlElement("POINT");
+                    pointXml->setAttribute("frequency", impedances.frequencies[f]);
+                    pointXml->setAttribute("magnitude", impedances.spectrumMagnitudes[i * numFrequencies + f]);
+                    pointXml->setAttribute("phase", impedances.spectrumPhases[i * numFrequencies + f]);
+                    spectrumXml->addChildElement(pointXml);
+                }
+
+                xml->addChildElement(spectrumXml);
+            }
+        }
+
         xml->writeTo(file);
     }
 
@@ -1050,6 +1270,26 @@ bool DeviceThread::isAcquisitionActive() const
     return isTransmitting;
 }
 
+int DeviceThread::getNumQueuedUsbReads() const
+{
+    return usbReader->getNumQueuedReads();
+}
+
+int64 DeviceThread::getNumUsbRingOverruns() const
+{
+    return usbReader->getNumOverruns();
+}
+
+AcquisitionProfiler& DeviceThread::getAcquisitionProfiler()
+{
+    return profiler;
+}
+
+FifoTelemetrySnapshot DeviceThread::getFifoTelemetry() const
+{
+    return usbReader->getTelemetry().getSnapshot();
+}
+
 void DeviceThread::setNamingScheme(ChannelNamingScheme scheme)
 {
 
@@ -1252,6 +1492,36 @@ void DeviceThread::setFastTTLSettle(bool state, int channel)
     updateSettingsDuringAcquisition = true;
 }
 
+void DeviceThread::setExhaustiveImpedanceSweep(bool state)
+{
+    settings.exhaustiveImpedanceSweep = state;
+}
+
+bool DeviceThread::getExhaustiveImpedanceSweep() const
+{
+    return settings.exhaustiveImpedanceSweep;
+}
+
+void DeviceThread::setImpedanceSpectroscopy(bool state)
+{
+    settings.impedanceSpectroscopy = state;
+}
+
+bool DeviceThread::getImpedanceSpectroscopy() const
+{
+    return settings.impedanceSpectroscopy;
+}
+
+void DeviceThread::setQuickImpedanceCheck(bool state)
+{
+    settings.quickImpedanceCheck = state;
+}
+
+bool DeviceThread::getQuickImpedanceCheck() const
+{
+    return settings.quickImpedanceCheck;
+}
+
 int DeviceThread::setNoiseSlicerLevel(int level)
 {
     settings.noiseSlicerLevel = level;
@@ -1321,6 +1591,8 @@ bool DeviceThread::enableHeadstage(int hsNum, bool enabled, int nStr, int strCha
 
 void DeviceThread::updateBoardStreams()
 {
+    evalBoard->beginConfig();
+
     for (int i = 0; i < MAX_NUM_DATA_STREAMS; i++)
     {
         if (i < enabledStreams.size())
@@ -1334,6 +1606,8 @@ void DeviceThread::updateBoardStreams()
             evalBoard->enableDataStream(i,false);
         }
     }
+
+    evalBoard->commitConfig();
 }
 
 bool DeviceThread::isHeadstageEnabled(int hsNum) const
@@ -1400,100 +1674,80 @@ void DeviceThread::setSampleRate(int sampleRateIndex, bool isTemporary)
         settings.savedSampleRateIndex = sampleRateIndex;
     }
 
-    int numUsbBlocksToRead = 0; // placeholder - make this change the number of blocks that are read in DeviceThread::updateBuffer()
-
     Rhd2000EvalBoard::AmplifierSampleRate sampleRate; // just for local use
 
     switch (sampleRateIndex)
     {
         case 0:
             sampleRate = Rhd2000EvalBoard::SampleRate1000Hz;
-            numUsbBlocksToRead = 1;
             settings.boardSampleRate = 1000.0f;
             break;
         case 1:
             sampleRate = Rhd2000EvalBoard::SampleRate1250Hz;
-            numUsbBlocksToRead = 1;
             settings.boardSampleRate = 1250.0f;
             break;
         case 2:
             sampleRate = Rhd2000EvalBoard::SampleRate1500Hz;
-            numUsbBlocksToRead = 1;
             settings.boardSampleRate = 1500.0f;
             break;
         case 3:
             sampleRate = Rhd2000EvalBoard::SampleRate2000Hz;
-            numUsbBlocksToRead = 1;
             settings.boardSampleRate = 2000.0f;
             break;
         case 4:
             sampleRate = Rhd2000EvalBoard::SampleRate2500Hz;
-            numUsbBlocksToRead = 1;
             settings.boardSampleRate = 2500.0f;
             break;
         case 5:
             sampleRate = Rhd2000EvalBoard::SampleRate3000Hz;
-            numUsbBlocksToRead = 2;
             settings.boardSampleRate = 3000.0f;
             break;
         case 6:
             sampleRate = Rhd2000EvalBoard::SampleRate3333Hz;
-            numUsbBlocksToRead = 2;
             settings.boardSampleRate = 3333.0f;
             break;
         case 7:
             sampleRate = Rhd2000EvalBoard::SampleRate4000Hz;
-            numUsbBlocksToRead = 2;
             settings.boardSampleRate = 4000.0f;
             break;
         case 8:
             sampleRate = Rhd2000EvalBoard::SampleRate5000Hz;
-            numUsbBlocksToRead = 3;
             settings.boardSampleRate = 5000.0f;
             break;
         case 9:
             sampleRate = Rhd2000EvalBoard::SampleRate6250Hz;
-            numUsbBlocksToRead = 3;
             settings.boardSampleRate = 6250.0f;
             break;
         case 10:
             sampleRate = Rhd2000EvalBoard::SampleRate8000Hz;
-            numUsbBlocksToRead = 4;
             settings.boardSampleRate = 8000.0f;
             break;
         case 11:
             sampleRate = Rhd2000EvalBoard::SampleRate10000Hz;
-            numUsbBlocksToRead = 6;
             settings.boardSampleRate = 10000.0f;
             break;
         case 12:
             sampleRate = Rhd2000EvalBoard::SampleRate12500Hz;
-            numUsbBlocksToRead = 7;
             settings.boardSampleRate = 12500.0f;
             break;
         case 13:
             sampleRate = Rhd2000EvalBoard::SampleRate15000Hz;
-            numUsbBlocksToRead = 8;
             settings.boardSampleRate = 15000.0f;
             break;
         case 14:
             sampleRate = Rhd2000EvalBoard::SampleRate20000Hz;
-            numUsbBlocksToRead = 12;
             settings.boardSampleRate = 20000.0f;
             break;
         case 15:
             sampleRate = Rhd2000EvalBoard::SampleRate25000Hz;
-            numUsbBlocksToRead = 14;
             settings.boardSampleRate = 25000.0f;
             break;
         case 16:
             sampleRate = Rhd2000EvalBoard::SampleRate30000Hz;
-            numUsbBlocksToRead = 16;
             settings.boardSampleRate = 30000.0f;
             break;
         default:
             sampleRate = Rhd2000EvalBoard::SampleRate10000Hz;
-            numUsbBlocksToRead = 6;
             settings.boardSampleRate = 10000.0f;
     }
 
@@ -1536,6 +1790,9 @@ void DeviceThread::updateRegisters()
     int commandSequenceLength;
     std::vector<int> commandList;
 
+    // Send the aux command lengths and bank selections together, in one wire-in update
+    evalBoard->beginConfig();
+
     // Create a command list for the AuxCmd1 slot.  This command sequence will continuously
     // update Register 3, which controls the auxiliary digital output pin on each RHD2000 chip.
     // In concert with the v1.4 Rhythm FPGA code, this permits real-time control of the digital
@@ -1630,6 +1887,8 @@ void DeviceThread::updateRegisters()
         evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortH, Rhd2000EvalBoard::AuxCmd3,
             settings.fastSettleEnabled ? 2 : 1);
     }
+
+    evalBoard->commitConfig();
 }
 
 void DeviceThread::setCableLength(int hsNum, float length)
@@ -1674,7 +1933,6 @@ bool DeviceThread::startAcquisition()
         return false;
 
     impedanceThread->waitSafely();
-    dataBlock = new Rhd2000DataBlock(evalBoard->getNumEnabledDataStreams(), evalBoard->isUSB3());
 
     LOGD( "Expecting ", getNumChannels() ," channels." );
 
@@ -1703,9 +1961,43 @@ bool DeviceThread::startAcquisition()
         evalBoard->run();
     }
 
-    blockSize = dataBlock->calculateDataBlockSizeInWords(evalBoard->getNumEnabledDataStreams(), evalBoard->isUSB3());
+    blockSize = Rhd2000DataBlock::calculateDataBlockSizeInWords(evalBoard->getNumEnabledDataStreams(), evalBoard->isUSB3());
     //LOGD("Expecting blocksize of ", blockSize, " for ", evalBoard->getNumEnabledDataStreams(), " streams");
 
+    updateBlockDecoder();
+    blockDecoder.resetStreamState();
+    decodePlanChanged = false;
+
+    LOGD("Block decoder using ", BlockDecoder::getInstructionSetName(blockDecoder.getInstructionSet()),
+         blockDecoder.isUsingSpecializedKernel() ? " with specialized" : " with generic",
+         " aux/ADC kernel for ", blockDecoder.getNumStreams(), " streams");
+
+    int samplesPerBlock = Rhd2000DataBlock::getSamplesPerDataBlock(evalBoard->isUSB3());
+    int maxBlocksPerRead = getMaxUsbBlocksPerRead();
+
+    // staging buffers for the largest USB transfer, so updateBuffer() never allocates
+    sampleBlockStride = getNumChannels();
+    sampleBlock.calloc(maxBlocksPerRead * samplesPerBlock * sampleBlockStride);
+    sampleNumbers.calloc(maxBlocksPerRead * samplesPerBlock);
+    timestamps.calloc(maxBlocksPerRead * samplesPerBlock);
+    eventCodes.calloc(maxBlocksPerRead * samplesPerBlock);
+
+    // the reader drains the board FIFO while this thread decodes;
+    // an empty USB2 FIFO is polled again after half a block period
+    int pollIntervalMs = int(500.0f * samplesPerBlock / settings.boardSampleRate);
+
+    usbReader->prepare(USB_READER_NUM_BUFFERS, blockSize, samplesPerBlock, maxBlocksPerRead, pollIntervalMs);
+
+    profiler.reset();
+    usbReader->setProfiler(&profiler);
+    blockDecoder.setProfiler(&profiler);
+
+    startRawCapture();
+
+    usbReader->startThread();
+
+    LOGD("Reading up to ", maxBlocksPerRead, " USB blocks per transfer");
+
     startThread();
 
     isTransmitting = true;
@@ -1713,6 +2005,33 @@ bool DeviceThread::startAcquisition()
     return true;
 }
 
+void DeviceThread::startRawCapture()
+{
+    // Setting RHYTHM_RAW_CAPTURE to a directory records every USB transfer there, exactly as
+    // read from the board; rhythm-decode-benchmark --capture replays the file.
+    // RHYTHM_RAW_CAPTURE_DIRECT_IO=1 bypasses the page cache where supported.
+    const String captureDirectory = SystemStats::getEnvironmentVariable("RHYTHM_RAW_CAPTURE", String());
+
+    if (captureDirectory.isEmpty())
+        return;
+
+    File captureFile = File(captureDirectory).getChildFile("rhythm-" + Time::getCurrentTime().formatted("%Y%m%d-%H%M%S") + ".rhr");
+    bool directIo = SystemStats::getEnvironmentVariable("RHYTHM_RAW_CAPTURE_DIRECT_IO", "0") == "1";
+
+    if (rawWriter.open(captureFile.getFullPathName().toStdString(),
+                       evalBoard->getNumEnabledDataStreams(),
+                       evalBoard->isUSB3(),
+                       settings.boardSampleRate,
+                       directIo))
+    {
+        LOGD("Recording raw USB data to ", captureFile.getFullPathName(), rawWriter.isDirectIo() ? " (direct I/O)" : "");
+    }
+    else
+    {
+        LOGE("Could not create raw capture file ", captureFile.getFullPathName());
+    }
+}
+
 bool DeviceThread::stopAcquisition()
 {
 
@@ -1733,6 +2052,39 @@ bool DeviceThread::stopAcquisition()
         //LOGD("RHD2000 data thread failed to exit, continuing anyway...");
     }
 
+    usbReader->stopThread(1000);
+
+    if (rawWriter.isOpen())
+    {
+        rawWriter.close();
+
+        LOGD("Raw capture: ", (int64) rawWriter.getNumBytesAppended(), " bytes recorded, ",
+             (int64) rawWriter.getNumBytesDropped(), " bytes dropped");
+    }
+
+    LOGD("USB reader: ", usbReader->getNumOverruns(), " ring overruns, ", usbReader->getNumReadErrors(),
+         " failed reads, max occupancy ", usbReader->getMaxQueuedReads(), "/", usbReader->getCapacity(), ", ",
+         usbReader->getAverageBlocksPerRead(), " blocks per transfer");
+
+    FifoTelemetrySnapshot fifo = usbReader->getTelemetry().getSnapshot();
+
+    LOGD("Board FIFO high-water marks: USB ", fifo.highWater.numWordsInFifo, " / ", Rhd2000EvalBoard::fifoCapacityInWords(),
+         " words, input ", fifo.highWater.inFifo, ", DDR ", fifo.highWater.ddr, ", output ", fifo.highWater.outFifo);
+
+    LOGD("Block decoder: ", blockDecoder.getNumResyncs(), " resyncs (", blockDecoder.getNumSkippedBytes(), " bytes skipped), ",
+         blockDecoder.getNumGaps(), " gaps (", blockDecoder.getNumDroppedFrames(), " frames lost)");
+
+    if (profiler.isEnabled())
+    {
+        File csvFile = File::getSpecialLocation(File::tempDirectory).getChildFile("rhythm-acquisition-latency.csv");
+
+        std::ostringstream csv;
+        profiler.writeCsv(csv);
+
+        if (csvFile.replaceWithText(csv.str()))
+            LOGD("Acquisition latency histograms written to ", csvFile.getFullPathName());
+    }
+
     if (deviceFound)
     {
         evalBoard->setContinuousRunMode(false);
@@ -1764,131 +2116,155 @@ bool DeviceThread::stopAcquisition()
     return true;
 }
 
-bool DeviceThread::updateBuffer()
+void DeviceThread::getAdcConversion(int adcChannel, double& scale, double& offset, double& dcOffset) const
+{
+    // ADC waveform units = volts
+    scale = 0.0;
+    offset = 0.0;
+    dcOffset = 0.0;
+
+    if (boardType == ACQUISITION_BOARD)
+    {
+        if (adcRangeSettings[adcChannel] == 0)
+        {
+            scale = 0.00015258789;
+            offset = -5;        // account for +/-5V input range...
+            dcOffset = -0.4096; // ...and DC offset
+        }
+        else
+        {
+            scale = 0.00030517578; // shouldn't this be half the value, not 2x?
+        }
+    }
+    else if (boardType == INTAN_RHD_USB)
+    {
+        scale = 0.000050354;
+    }
+}
+
+int DeviceThread::getNumDigitalLines() const
 {
-    unsigned char* bufferPtr;
-    double ts;
+    return boardType == INTAN_RHD_USB ? 16 : 8;
+}
+
+int DeviceThread::getMaxUsbBlocksPerRead()
+{
+    int samplesPerBlock = Rhd2000DataBlock::getSamplesPerDataBlock(evalBoard->isUSB3());
+
+    // as many blocks as fit in the latency target, but at least one
+    int numBlocks = int(settings.boardSampleRate * USB_READ_LATENCY_TARGET_MS / 1000.0f / samplesPerBlock);
+
+    // a single transfer can't exceed the USB buffer size
+    int maxBlocks = USB_BUFFER_SIZE / (2 * blockSize);
 
-    if (evalBoard->isUSB3() || evalBoard->numWordsInFifo() >= blockSize)
+    return jlimit(1, jmax(1, maxBlocks), numBlocks);
+}
+
+void DeviceThread::updateBlockDecoder()
+{
+    int numStreams = enabledStreams.size();
+
+    int channelsPerStream[MAX_NUM_DATA_STREAMS_USB3];
+    bool halfChannels[MAX_NUM_DATA_STREAMS_USB3];
+    bool auxChannels[MAX_NUM_DATA_STREAMS_USB3];
+
+    for (int dataStream = 0; dataStream < numStreams; dataStream++)
     {
-        bool return_code;
+        channelsPerStream[dataStream] = numChannelsPerDataStream[dataStream];
+        halfChannels[dataStream] = (chipId[dataStream] == CHIP_ID_RHD2132) && (channelsPerStream[dataStream] == 16);
+        auxChannels[dataStream] = settings.acquireAux && (chipId[dataStream] != CHIP_ID_RHD2164_B);
+    }
 
-        return_code = evalBoard->readRawDataBlock(&bufferPtr);
-        // see Rhd2000DataBlock::fillFromUsbBuffer() for documentation of buffer structure
+    blockDecoder.setLayout(numStreams, channelsPerStream, halfChannels, auxChannels, settings.acquireAdc);
+    blockDecoder.setNumTtlLines(getNumDigitalLines());
 
-        int index = 0;
-        int auxIndex, chanIndex;
-        int numStreams = enabledStreams.size();
-        int nSamps = Rhd2000DataBlock::getSamplesPerDataBlock(evalBoard->isUSB3());
+    for (int adcChan = 0; adcChan < 8; adcChan++)
+    {
+        double scale, offset, dcOffset;
+        getAdcConversion(adcChan, scale, offset, dcOffset);
+        blockDecoder.setAdcConversion(adcChan, scale, offset, dcOffset);
+    }
+}
 
-        //evalBoard->printFIFOmetrics();
-        for (int samp = 0; samp < nSamps; samp++)
+bool DeviceThread::updateBuffer()
+{
+    // see Rhd2000DataBlock::fillFromUsbBuffer() for documentation of buffer structure
+    int numBlocks;
+    const unsigned char* bufferPtr = usbReader->getNextRead(100, numBlocks);
+
+    if (bufferPtr != nullptr)
+    {
+        // apply settings changes between blocks, so a block is never decoded with a partial plan
+        if (decodePlanChanged.exchange(false))
         {
-            int channel = -1;
+            updateBlockDecoder();
+        }
 
-            if (!Rhd2000DataBlock::checkUsbHeader(bufferPtr, index))
-            {
-                LOGE( "Error in Rhd2000EvalBoard::readDataBlock: Incorrect header." );
-                break;
-            }
+        // blocks in a transfer are contiguous, so they decode as one long block
+        int nSamps = numBlocks * Rhd2000DataBlock::getSamplesPerDataBlock(evalBoard->isUSB3());
 
-            index += 8; // magic number header width (bytes)
-            int64 timestamp = Rhd2000DataBlock::convertUsbTimeStamp(bufferPtr, index);
-            index += 4; // timestamp width
-            auxIndex = index; // aux chans start at this offset
-            index += 6 * numStreams; // width of the 3 aux chans
+        if (rawWriter.isOpen() && !rawWriter.append(bufferPtr, 2 * (size_t) blockSize * numBlocks))
+        {
+            LOGE( "Raw capture: disk is falling behind, dropped ", numBlocks, " blocks" );
+        }
 
-            for (int dataStream = 0; dataStream < numStreams; dataStream++)
-            {                
-                
-                int nChans = numChannelsPerDataStream[dataStream];
+        int64 resyncs = blockDecoder.getNumResyncs();
+        int64 droppedFrames = blockDecoder.getNumDroppedFrames();
 
-                chanIndex = index + 2*dataStream;
-                
-                if ((chipId[dataStream] == CHIP_ID_RHD2132) && (nChans == 16)) //RHD2132 16ch. headstage
-                {
-                    chanIndex += 2 * RHD2132_16CH_OFFSET * numStreams;
-                }
-                
-                for (int chan = 0; chan < nChans; chan++)
-                {
-                    channel++;
-                    thisSample[channel] = float(*(uint16*)(bufferPtr + chanIndex) - 32768) * 0.195f;
-                    chanIndex += 2 * numStreams; // single chan width (2 bytes)
-                }
-                
-            }
-            index += 64 * numStreams; // neural data width
-            auxIndex += 2 * numStreams; // skip AuxCmd1 slots (see updateRegisters())
-            // copy the 3 aux channels
-            if (settings.acquireAux)
-            {
-                for (int dataStream = 0; dataStream < numStreams; dataStream++)
-                {
-                    if (chipId[dataStream] != CHIP_ID_RHD2164_B)
-                    {
-                        int auxNum = (samp+3) % 4;
-                        if (auxNum < 3)
-                        {
-                            auxSamples[dataStream][auxNum] = float(*(uint16*)(bufferPtr + auxIndex) - 32768)*0.0000374;
-                        }
-                        for (int chan = 0; chan < 3; chan++)
-                        {
-                            channel++;
-                            if (auxNum == 3)
-                            {
-                                auxBuffer[channel] = auxSamples[dataStream][chan];
-                            }
-                            thisSample[channel] = auxBuffer[channel];
-                        }
-                    }
-                    auxIndex += 2; // single chan width (2 bytes)
-                }
-            }
-            index += 2 * numStreams; // skip over filler word at the end of each data stream
-            // copy the 8 ADC channels
-            if (settings.acquireAdc)
-            {
-                for (int adcChan = 0; adcChan < 8; ++adcChan)
-                {
+        int numFrames = blockDecoder.decodeBlock(bufferPtr,
+                                                 nSamps,
+                                                 sampleBlock,
+                                                 sampleBlockStride,
+                                                 sampleNumbers,
+                                                 eventCodes);
 
-                    channel++;
-                    // ADC waveform units = volts
-
-                    if (boardType == ACQUISITION_BOARD)
-                    {
-                        thisSample[channel] = adcRangeSettings[adcChan] == 0 ?
-                            0.00015258789 * float(*(uint16*)(bufferPtr + index)) - 5 - 0.4096 : // account for +/-5V input range and DC offset
-                            0.00030517578 * float(*(uint16*)(bufferPtr + index)); // shouldn't this be half the value, not 2x?
-                    }
-                    else if (boardType == INTAN_RHD_USB) {
-                        thisSample[channel] = 0.000050354 * float(*(uint16*)(bufferPtr + index));
-                    }
-                    index += 2; // single chan width (2 bytes)
-                }
-            }
-            else
-            {
-                index += 16; // skip ADC chans (8 * 2 bytes)
-            }
+        usbReader->releaseRead();
 
-            uint64 ttlEventWord = *(uint64*)(bufferPtr + index) & 65535;
+        if (blockDecoder.getNumResyncs() > resyncs)
+        {
+            LOGE( "Error in Rhd2000EvalBoard::readDataBlock: Incorrect header. Resynchronized to the next frame." );
+        }
 
-            index += 4;
+        if (blockDecoder.getNumDroppedFrames() > droppedFrames)
+        {
+            LOGE( "Lost ", blockDecoder.getNumDroppedFrames() - droppedFrames, " frames" );
+        }
 
-            sourceBuffers[0]->addToBuffer(thisSample,
-                                          &timestamp,
-                                          &ts,
-                                          &ttlEventWord,
-                                          1);
+        if (usbReader->getTelemetry().checkOverflowWarning(FIFO_OVERFLOW_WARNING_SECONDS))
+        {
+            FifoTelemetrySnapshot fifo = usbReader->getTelemetry().getSnapshot();
+
+            LOGE( "USB FIFO is filling (", fifo.current.numWordsInFifo, " words); overflow expected in ",
+                  fifo.secondsToOverflow, " s" );
+        }
+
+        // push the whole block with a single call
+        if (numFrames > 0)
+        {
+            uint64 startTime = profiler.startTimer();
+
+            sourceBuffers[0]->addToBuffer(sampleBlock,
+                                          sampleNumbers,
+                                          timestamps,
+                                          eventCodes,
+                                          numFrames);
+
+            profiler.stopTimer(AcquisitionProfiler::ADD_TO_BUFFER, startTime);
         }
 
     }
 
+    uint64 settingsStartTime = profiler.startTimer();
 
     if (updateSettingsDuringAcquisition)
     {
+        const ScopedLock lock(usbReader->getBoardLock());
+
         LOGD( "DAC" );
+
+        // Settings without a trigger go out in one wire-in update at commitConfig()
+        evalBoard->beginConfig();
+
         for (int k=0; k<8; k++)
         {
             if (dacChannelsToUpdate[k])
@@ -1917,6 +2293,9 @@ bool DeviceThread::updateBuffer()
         evalBoard->enableBoardLeds(settings.ledsEnabled);
         evalBoard->setClockDivider(settings.clockDivideFactor);
 
+        evalBoard->commitConfig();
+
+        decodePlanChanged = true;
         updateSettingsDuringAcquisition = false;
     }
 
@@ -1931,6 +2310,7 @@ bool DeviceThread::updateBuffer()
 
         }
 
+        const ScopedLock lock(usbReader->getBoardLock());
         evalBoard->setTtlOut(TTL_OUTPUT_STATE);
 
         LOGB("TTL OUTPUT STATE: ",
@@ -1945,6 +2325,8 @@ bool DeviceThread::updateBuffer()
 
     }
 
+    profiler.stopTimer(AcquisitionProfiler::SETTINGS_UPDATE, settingsStartTime);
+
     return true;
 
 }
@@ -2104,6 +2486,7 @@ int DeviceThread::setClockDivider(int divide_ratio)
 void DeviceThread::setAdcRange(int channel, short range)
 {
     adcRangeSettings[channel] = range;
+    decodePlanChanged = true;
 }
 
 short DeviceThread::getAdcRange(int channel) const
@@ -34,15 +34,21 @@
 #include "rhythm-api/rhd2000evalboard.h"
 #include "rhythm-api/rhd2000registers.h"
 #include "rhythm-api/rhd2000datablock.h"
+#include "rhythm-api/rhd2000blockview.h"
+#include "rhythm-api/rhd2000rawwriter.h"
 #include "rhythm-api/okFrontPanelDLL.h"
 
+#include "BlockDecoder.h"
+#include "BoardCache.h"
+#include "ImpedanceCache.h"
+#include "UsbReader.h"
+
 #define CHIP_ID_RHD2132  1
 #define CHIP_ID_RHD2216  2
 #define CHIP_ID_RHD2164  4
 #define CHIP_ID_RHD2164_B  1000
 #define REGISTER_59_MISO_A  53
 #define REGISTER_59_MISO_B  58
-#define RHD2132_16CH_OFFSET 8
 
 #define MAX_NUM_CHANNELS MAX_NUM_DATA_STREAMS_USB3 * 35 + 16
 
@@ -71,6 +77,13 @@ namespace RhythmNode
 		Array<int> channels;
 		Array<float> magnitudes;
 		Array<float> phases;
+
+		/** Spectroscopy results: the test frequencies (in Hz), and the magnitude and phase
+		    of every channel at each of them, [channel][frequency] */
+		Array<float> frequencies;
+		Array<float> spectrumMagnitudes;
+		Array<float> spectrumPhases;
+
 		bool valid = false;
 	};
 
@@ -147,6 +160,9 @@ namespace RhythmNode
 		// for communication with SourceNode processors:
 		bool foundInputSource() override;
 
+		/** Finds the connected headstages and the cable delay of each port. Chips found by the
+			last scan are checked in a single run before any delays are swept; headstages it
+			found empty are swept again */
 		void scanPorts();
 
 		void saveImpedances(File& file);
@@ -182,6 +198,20 @@ namespace RhythmNode
 
 		int setNoiseSlicerLevel(int level);
 		void setFastTTLSettle(bool state, int channel);
+
+		/** Measure every channel at all three series capacitances instead of only where the
+		    1 pF reading calls for another range*/
+		void setExhaustiveImpedanceSweep(bool state);
+		bool getExhaustiveImpedanceSweep() const;
+
+		/** Measure impedances at several frequencies at once, with a multi-tone test waveform*/
+		void setImpedanceSpectroscopy(bool state);
+		bool getImpedanceSpectroscopy() const;
+
+		/** Re-measure only stale channels and a sample of the others, reusing cached values
+		    for channels whose chip shows no drift*/
+		void setQuickImpedanceCheck(bool state);
+		bool getQuickImpedanceCheck() const;
 		void setTTLoutputMode(bool state);
 		void setDAChpf(float cutoff, bool enabled);
 
@@ -193,6 +223,18 @@ namespace RhythmNode
 		bool isAuxEnabled();
 		bool isAcquisitionActive() const;
 
+		/** Returns the number of raw USB transfers waiting to be decoded */
+		int getNumQueuedUsbReads() const;
+
+		/** Returns the number of times the raw USB block ring filled up during the current acquisition */
+		int64 getNumUsbRingOverruns() const;
+
+		/** Returns the latest board FIFO and DDR levels, high-water marks and overflow estimate */
+		FifoTelemetrySnapshot getFifoTelemetry() const;
+
+		/** Returns the per-stage latency histograms of the acquisition loop */
+		AcquisitionProfiler& getAcquisitionProfiler();
+
 		Array<int> getDACchannels() const;
 
 		void setDACchannel(int dacOutput, int channel);
@@ -259,7 +301,6 @@ namespace RhythmNode
 		/** Rhythm API classes*/
 		ScopedPointer<Rhd2000EvalBoard> evalBoard;
 		Rhd2000Registers chipRegisters;
-		ScopedPointer<Rhd2000DataBlock> dataBlock;
 		Array<Rhd2000EvalBoard::BoardDataSource> enabledStreams;
 
 		/** Custom classes*/
@@ -275,13 +316,43 @@ namespace RhythmNode
 		/** True if change in settings is needed during acquisition*/
 		bool updateSettingsDuringAcquisition;
 
-		/** Data buffers*/
-		float thisSample[MAX_NUM_CHANNELS];
+		/** Times each stage of the acquisition loop */
+		AcquisitionProfiler profiler;
+
+		/** Reads raw USB blocks on its own thread during acquisition */
+		ScopedPointer<UsbReader> usbReader;
+
+		/** Returns the number of TTL input lines on this board */
+		int getNumDigitalLines() const;
 
-		float auxBuffer[MAX_NUM_CHANNELS]; // aux inputs are only sampled every 4th sample, so use this to buffer the
-										   // samples so they can be handles just like the regular neural channels later
+		/** Returns the largest number of USB blocks to read in one transfer, given the sample rate */
+		int getMaxUsbBlocksPerRead();
 
-		float auxSamples[MAX_NUM_DATA_STREAMS_USB3][3];
+		/** Converts raw USB blocks into samples */
+		BlockDecoder blockDecoder;
+
+		/** Rebuilds the decode plan from the enabled streams and current settings */
+		void updateBlockDecoder();
+
+		/** Records raw USB transfers during acquisition, if RHYTHM_RAW_CAPTURE is set */
+		Rhd2000RawWriter rawWriter;
+
+		/** Opens a raw capture file for this acquisition, if RHYTHM_RAW_CAPTURE is set */
+		void startRawCapture();
+
+		/** Returns the conversion from ADC words to volts for one ADC channel
+			(value = scale * word + offset + dcOffset) */
+		void getAdcConversion(int adcChannel, double& scale, double& offset, double& dcOffset) const;
+
+		/** True if the decode plan must be rebuilt before the next block */
+		std::atomic<bool> decodePlanChanged;
+
+		/** Data buffers*/
+		HeapBlock<float> sampleBlock; // one row of getNumChannels() values per sample in a USB block
+		HeapBlock<int64> sampleNumbers;
+		HeapBlock<double> timestamps;
+		HeapBlock<uint64> eventCodes;
+		int sampleBlockStride;
 
 		unsigned int blockSize;
 
@@ -335,6 +406,9 @@ namespace RhythmNode
 			bool newScan = true;
 			int numberingScheme = 1;
 			uint16 clockDivideFactor;
+			bool exhaustiveImpedanceSweep = false;
+			bool impedanceSpectroscopy = false;
+			bool quickImpedanceCheck = false;
 
 		} settings;
 
@@ -354,13 +428,31 @@ namespace RhythmNode
 		void updateRegisters();
 
 		/** Returns the device ID for an Intan chip*/
-		int getDeviceId(Rhd2000DataBlock* dataBlock, int stream, int& register59Value);
+		int getDeviceId(const Rhd2000BlockView& dataBlock, int stream, int& register59Value);
+
+		/** Runs the aux command sequences for INIT_STEP samples and waits for the run to end */
+		void runInitSequence();
 
 		int* dacChannels, *dacStream;
 		float* dacThresholds;
 		bool* dacChannelsToUpdate;
 		Array<int> chipId;
 
+		/** Chip ID and cable delay found for each headstage by the last port scan,
+			which a rescan checks before sweeping the delays */
+		Array<int> scannedChipId;
+		Array<int> scannedDelay;
+
+		/** FPGA configuration and headstages of each board, kept between sessions */
+		BoardCache boardCache;
+
+		/** Last impedance measured on each channel, kept between sessions */
+		ImpedanceCache impedanceCache;
+
+		/** Hash of the bitfile on the FPGA and the Rhythm version it reports */
+		String bitfileHash;
+		int boardVersion;
+
 		Array<int> numChannelsPerDataStream;
 
 		ChannelNamingScheme channelNamingScheme;
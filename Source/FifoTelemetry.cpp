@@ -0,0 +1,112 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "FifoTelemetry.h"
+
+using namespace RhythmNode;
+
+FifoTelemetry::FifoTelemetry() :
+    samplePeriodMs(100.0),
+    periodStartMs(-1.0),
+    periodStartWords(0),
+    overflowWarningActive(false)
+{
+    reset(samplePeriodMs);
+}
+
+void FifoTelemetry::reset(double samplePeriodMs_)
+{
+    const SpinLock::ScopedLockType sl(lock);
+
+    snapshot = FifoTelemetrySnapshot();
+    snapshot.current = { 0, 0, 0, 0 };
+    snapshot.highWater = { 0, 0, 0, 0 };
+
+    samplePeriodMs = samplePeriodMs_;
+    periodStartMs = -1.0;
+    periodStartWords = 0;
+    overflowWarningActive = false;
+}
+
+void FifoTelemetry::addReading(const Rhd2000EvalBoard::FifoMetrics& metrics, double timeMs)
+{
+    const SpinLock::ScopedLockType sl(lock);
+
+    snapshot.current = metrics;
+    snapshot.numReadings++;
+
+    snapshot.highWater.numWordsInFifo = jmax(snapshot.highWater.numWordsInFifo, metrics.numWordsInFifo);
+    snapshot.highWater.inFifo = jmax(snapshot.highWater.inFifo, metrics.inFifo);
+    snapshot.highWater.ddr = jmax(snapshot.highWater.ddr, metrics.ddr);
+    snapshot.highWater.outFifo = jmax(snapshot.highWater.outFifo, metrics.outFifo);
+
+    if (periodStartMs < 0)
+    {
+        periodStartMs = timeMs;
+        periodStartWords = metrics.numWordsInFifo;
+        return;
+    }
+
+    double elapsedMs = timeMs - periodStartMs;
+
+    if (elapsedMs < samplePeriodMs)
+        return;
+
+    double rate = (double(metrics.numWordsInFifo) - double(periodStartWords)) * 1000.0 / elapsedMs;
+
+    // smooth over a few periods, so a single late read doesn't look like a trend
+    snapshot.fillRateWordsPerSecond = 0.75 * snapshot.fillRateWordsPerSecond + 0.25 * rate;
+
+    if (snapshot.fillRateWordsPerSecond > 0)
+    {
+        double freeWords = double(Rhd2000EvalBoard::fifoCapacityInWords()) - double(metrics.numWordsInFifo);
+        snapshot.secondsToOverflow = jmax(0.0, freeWords) / snapshot.fillRateWordsPerSecond;
+    }
+    else
+    {
+        snapshot.secondsToOverflow = -1.0;
+    }
+
+    periodStartMs = timeMs;
+    periodStartWords = metrics.numWordsInFifo;
+}
+
+FifoTelemetrySnapshot FifoTelemetry::getSnapshot() const
+{
+    const SpinLock::ScopedLockType sl(lock);
+
+    return snapshot;
+}
+
+bool FifoTelemetry::checkOverflowWarning(double thresholdSeconds)
+{
+    const SpinLock::ScopedLockType sl(lock);
+
+    bool belowThreshold = snapshot.secondsToOverflow >= 0 && snapshot.secondsToOverflow < thresholdSeconds;
+
+    bool warn = belowThreshold && !overflowWarningActive;
+
+    overflowWarningActive = belowThreshold;
+
+    return warn;
+}
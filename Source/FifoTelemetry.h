@@ -0,0 +1,99 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __FIFOTELEMETRY_H_8B2E61D4__
+#define __FIFOTELEMETRY_H_8B2E61D4__
+
+#include <DataThreadHeaders.h>
+
+#include "rhythm-api/rhd2000evalboard.h"
+
+namespace RhythmNode
+{
+
+	/** Board FIFO levels and derived statistics at one point in time */
+	struct FifoTelemetrySnapshot
+	{
+		/** Latest levels, in 16-bit words */
+		Rhd2000EvalBoard::FifoMetrics current;
+
+		/** Highest levels since the last reset */
+		Rhd2000EvalBoard::FifoMetrics highWater;
+
+		/** Smoothed rate at which the USB FIFO is filling (negative while it drains) */
+		double fillRateWordsPerSecond = 0.0;
+
+		/** Estimated time until the USB FIFO overflows at the current fill rate (-1 if it is not filling) */
+		double secondsToOverflow = -1.0;
+
+		/** Number of readings since the last reset */
+		int64 numReadings = 0;
+	};
+
+	/**
+		Collects FIFO and DDR levels from the USB reader.
+
+		Readings come from the FIFO query the reader already makes before
+		every transfer, so telemetry costs no extra USB round-trips. Levels
+		and high-water marks are updated on every reading; the fill rate and
+		time-to-overflow estimate are updated once per sampling period.
+
+		All methods are thread-safe.
+
+	*/
+	class FifoTelemetry
+	{
+	public:
+
+		/** Constructor */
+		FifoTelemetry();
+
+		/** Clears all readings; the fill rate is estimated over periods of samplePeriodMs */
+		void reset(double samplePeriodMs);
+
+		/** Records a reading taken at timeMs (Time::getMillisecondCounterHiRes()) */
+		void addReading(const Rhd2000EvalBoard::FifoMetrics& metrics, double timeMs);
+
+		/** Returns a copy of the current statistics */
+		FifoTelemetrySnapshot getSnapshot() const;
+
+		/** Returns true once each time the estimated time to overflow drops below thresholdSeconds */
+		bool checkOverflowWarning(double thresholdSeconds);
+
+	private:
+
+		SpinLock lock;
+
+		FifoTelemetrySnapshot snapshot;
+
+		double samplePeriodMs;
+		double periodStartMs;
+		unsigned int periodStartWords;
+
+		bool overflowWarningActive;
+
+		JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(FifoTelemetry);
+	};
+
+}
+#endif  // __FIFOTELEMETRY_H_8B2E61D4__
@@ -0,0 +1,114 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ImpedanceCache.h"
+#include "BoardCache.h"
+
+using namespace RhythmNode;
+
+ImpedanceCache::ImpedanceCache(const File& file_) :
+    file(file_)
+{
+}
+
+void ImpedanceCache::load(const String& serialNumber_)
+{
+    serialNumber = serialNumber_;
+    entries.clear();
+
+    std::unique_ptr<XmlElement> xml = XmlDocument::parse(file);
+
+    if (xml == nullptr)
+        return;
+
+    XmlElement* board = xml->getChildByAttribute("serial", serialNumber);
+
+    if (board == nullptr)
+        return;
+
+    forEachXmlChildElementWithTagName(*board, channel, "CHANNEL")
+    {
+        ImpedanceCacheEntry entry;
+        entry.magnitude = (float) channel->getDoubleAttribute("magnitude");
+        entry.phase = (float) channel->getDoubleAttribute("phase");
+        entry.time = channel->getStringAttribute("time").getLargeIntValue();
+
+        entries[Key(channel->getIntAttribute("stream"),
+                     channel->getIntAttribute("chip_id"),
+                     channel->getIntAttribute("channel"))] = entry;
+    }
+}
+
+bool ImpedanceCache::find(int stream, int chipId, int channel, ImpedanceCacheEntry& entry) const
+{
+    auto it = entries.find(Key(stream, chipId, channel));
+
+    if (it == entries.end())
+        return false;
+
+    entry = it->second;
+
+    return true;
+}
+
+void ImpedanceCache::set(int stream, int chipId, int channel, const ImpedanceCacheEntry& entry)
+{
+    entries[Key(stream, chipId, channel)] = entry;
+}
+
+void ImpedanceCache::save()
+{
+    std::unique_ptr<XmlElement> xml = XmlDocument::parse(file);
+
+    if (xml == nullptr || !xml->hasTagName("RHYTHM_IMPEDANCES"))
+        xml = std::unique_ptr<XmlElement>(new XmlElement("RHYTHM_IMPEDANCES"));
+
+    XmlElement* board = xml->getChildByAttribute("serial", serialNumber);
+
+    if (board != nullptr)
+        xml->removeChildElement(board, true);
+
+    board = xml->createNewChildElement("BOARD");
+    board->setAttribute("serial", serialNumber);
+
+    for (const auto& it : entries)
+    {
+        XmlElement* channel = board->createNewChildElement("CHANNEL");
+        channel->setAttribute("stream", std::get<0>(it.first));
+        channel->setAttribute("chip_id", std::get<1>(it.first));
+        channel->setAttribute("channel", std::get<2>(it.first));
+        channel->setAttribute("magnitude", it.second.magnitude);
+        channel->setAttribute("phase", it.second.phase);
+        channel->setAttribute("time", String(it.second.time));
+    }
+
+    file.getParentDirectory().createDirectory();
+
+    if (!xml->writeTo(file))
+        LOGE("Could not write the impedance cache to ", file.getFullPathName());
+}
+
+File ImpedanceCache::getDefaultFile()
+{
+    return BoardCache::getDefaultFile().getSiblingFile("rhythm-impedance-cache.xml");
+}
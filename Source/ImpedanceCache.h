@@ -0,0 +1,92 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __IMPEDANCECACHE_H_7B31E0C4__
+#define __IMPEDANCECACHE_H_7B31E0C4__
+
+#include <DataThreadHeaders.h>
+
+#include <map>
+#include <tuple>
+
+namespace RhythmNode
+{
+
+	/** An impedance measured for one channel, and when it was measured */
+	struct ImpedanceCacheEntry
+	{
+		float magnitude = 0.0f;
+		float phase = 0.0f;
+
+		/** Milliseconds since the epoch (see Time::currentTimeMillis()) */
+		int64 time = 0;
+	};
+
+	/**
+		Remembers the last impedance measured for each channel of a board between sessions.
+
+		Entries are keyed by data stream (the headstage port and MISO line), the ID of the
+		chip found on that stream and the chip channel. The chip ID is the chip type, and
+		RHD2000 chips carry no serial number, so a headstage with a different chip type does
+		not pick up old values but a headstage of the same type plugged into the same port
+		does: after such a swap, run a full (not quick) measurement.
+
+		The entries of all boards are kept by serial number in an XML file, next to the
+		board cache.
+
+	*/
+	class ImpedanceCache
+	{
+	public:
+
+		/** Constructor; entries are read from and written to file */
+		ImpedanceCache(const File& file = getDefaultFile());
+
+		/** Reads the entries of a board from the file, replacing those held */
+		void load(const String& serialNumber);
+
+		/** Looks up the entry for a channel; returns false if there is none */
+		bool find(int stream, int chipId, int channel, ImpedanceCacheEntry& entry) const;
+
+		/** Adds or replaces the entry for a channel */
+		void set(int stream, int chipId, int channel, const ImpedanceCacheEntry& entry);
+
+		/** Writes the entries of the loaded board to the file */
+		void save();
+
+		/** Returns the cache file in the user's application data directory */
+		static File getDefaultFile();
+
+	private:
+
+		File file;
+		String serialNumber;
+
+		typedef std::tuple<int, int, int> Key;   // stream, chip ID, channel
+		std::map<Key, ImpedanceCacheEntry> entries;
+
+		JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ImpedanceCache);
+	};
+
+}
+#endif  // __IMPEDANCECACHE_H_7B31E0C4__
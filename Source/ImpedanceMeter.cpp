@@ -30,36 +30,48 @@ using namespace RhythmNode;
 #define DEGREES_TO_RADIANS  0.0174532925199
 #define RADIANS_TO_DEGREES  57.2957795132
 
-// Allocates memory for a 3-D array of doubles.
-void allocateDoubleArray3D(std::vector<std::vector<std::vector<double> > >& array3D,
-    int xSize, int ySize, int zSize)
-{
-    int i, j;
+// Longest wait for the block ring to deliver a block of a finished run
+#define IMPEDANCE_BLOCK_TIMEOUT_MS 1000
 
-    if (xSize == 0) return;
-    array3D.resize(xSize);
-    for (i = 0; i < xSize; ++i)
-    {
-        array3D[i].resize(ySize);
-        for (j = 0; j < ySize; ++j)
-        {
-            array3D[i][j].resize(zSize);
-        }
-    }
-}
+// The sweep alternates between this AuxCmd3 RAM bank and the next, so that the next
+// channel's configuration can be uploaded while the board runs the current one
+#define ZCHECK_COMMAND_BANK 3
+
+// An adaptive sweep accepts a 1 pF reading within this factor of the best amplitude.  With
+// ranges a decade apart, the exhaustive choice only moves to another range beyond a factor
+// of sqrt(10), so the margin covers departures from the ideal scaling.
+#define ADAPTIVE_ACCEPTANCE_FACTOR 2.0
+
+// We favor voltage readings (in uV) that are closest to this: not too large, and not too small
+#define BEST_AMPLITUDE 250.0
+
+// A quick check measures again the channels whose cached impedance is older than this...
+#define IMPEDANCE_CACHE_MAX_AGE_MS (24 * 60 * 60 * 1000LL)
+
+// ...and one in this many of the others, a different one on every check.  If a sampled
+// magnitude moved from its cached value by more than IMPEDANCE_DRIFT_TOLERANCE (relative),
+// the whole chip is measured again.
+#define IMPEDANCE_QUICK_CHECK_STRIDE 8
+#define IMPEDANCE_DRIFT_TOLERANCE 0.2
+
+// Spectroscopy measures these frequencies (in Hz), rounded to harmonics of the lowest one
+static const float spectroscopyFrequencies[] = { 100.0f, 200.0f, 500.0f, 1000.0f, 2000.0f, 5000.0f };
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMPEDANCE_LOCK_IN_SSE2 1
+#include <emmintrin.h>
+#endif
 
 ImpedanceMeter::ImpedanceMeter(DeviceThread* board_) : 
     ThreadWithProgressWindow(
         "RHD2000 Impedance Measurement",
         true,
         true),
+    referenceStart(0),
+    referenceLength(0),
+    quickCheckOffset(0),
     board(board_)
 {
-    // to perform electrode impedance measurements at very low frequencies.
-    const int maxNumBlocks = 120;
-    int numStreams = 8;
-
-    allocateDoubleArray3D(amplifierPreFilter, numStreams, 32, MAX_SAMPLES_PER_DATA_BLOCK * maxNumBlocks);
 }
 
 ImpedanceMeter::~ImpedanceMeter()
@@ -136,99 +148,566 @@ float ImpedanceMeter::updateImpedanceFrequency(float desiredImpedanceFreq, bool&
 }
 
 
-int ImpedanceMeter::loadAmplifierData(std::queue<Rhd2000DataBlock>& dataQueue,
-    int numBlocks, int numDataStreams)
+float ImpedanceMeter::selectTestTones(bool spectroscopy)
+{
+    bool valid;
+
+    toneHarmonics.clear();
+
+    if (!spectroscopy)
+    {
+        float frequency = updateImpedanceFrequency(1000.0, valid);
+
+        if (valid)
+            toneHarmonics.push_back(1);
+
+        return frequency;
+    }
+
+    // One period of the fundamental has to fit in the command RAM
+    int period = (int) floor(board->settings.boardSampleRate / spectroscopyFrequencies[0] + 0.5);
+    period = jlimit(4, 1024, period);
+
+    const float fundamental = board->settings.boardSampleRate / period;
+
+    for (float frequency : spectroscopyFrequencies)
+    {
+        int harmonic = (int) floor(frequency / fundamental + 0.5);
+
+        if (harmonic < 1 || 4 * harmonic > period)
+            continue;
+
+        if (!toneHarmonics.empty() && harmonic <= toneHarmonics.back())
+            continue;
+
+        updateImpedanceFrequency(harmonic * fundamental, valid);
+
+        if (valid)
+            toneHarmonics.push_back(harmonic);
+    }
+
+    if (toneHarmonics.empty())
+        LOGE("Impedance spectroscopy: no test frequency lies within the amplifier bandwidth");
+
+    return fundamental;
+}
+
+
+int ImpedanceMeter::loadAmplifierData(Rhd2000BlockRing& blockRing,
+    int numBlocks, int numDataStreams, int chipChannel)
 {
 
-    int block, t, channel, stream;
+    int block, t, stream;
     int indexAmp = 0;
+    Rhd2000BlockView dataBlock;
+
+    amplifierSamples.resize((size_t) numBlocks * MAX_SAMPLES_PER_DATA_BLOCK * numDataStreams);
+
+    blockRing.readBlocks(numBlocks);
 
     for (block = 0; block < numBlocks; ++block)
     {
+        // The ring is already transferring the following blocks while this one is scaled
+        if (!blockRing.getNextBlock(dataBlock, IMPEDANCE_BLOCK_TIMEOUT_MS))
+        {
+            LOGE("Impedance measurement: timed out waiting for data block ", block + 1, " of ", numBlocks);
+            blockRing.cancel();
+            return -1;
+        }
 
-        // Load and scale RHD2000 amplifier waveforms
+        // Load and scale the RHD2000 amplifier waveform of the channel under test
         // (sampled at amplifier sampling rate)
-        for (t = 0; t < SAMPLES_PER_DATA_BLOCK(board->evalBoard->isUSB3()); ++t)
+        for (t = 0; t < dataBlock.getNumSamples(); ++t)
         {
-            for (channel = 0; channel < 32; ++channel)
+            // Amplifier words of one frame are stored [channel][stream]
+            const unsigned char* words = dataBlock.amplifierFrame(t) + 2 * chipChannel * dataBlock.getNumDataStreams();
+            double* samples = &amplifierSamples[(size_t) indexAmp * numDataStreams];
+
+            for (stream = 0; stream < numDataStreams; ++stream)
             {
-                for (stream = 0; stream < numDataStreams; ++stream)
-                {
-                    // Amplifier waveform units = microvolts
-                    amplifierPreFilter[stream][channel][indexAmp] = 0.195 *
-                        (dataQueue.front().amplifierData[stream][channel][t] - 32768);
-                }
+                int word = words[2 * stream] | (words[2 * stream + 1] << 8);
+
+                // Amplifier waveform units = microvolts
+                samples[stream] = 0.195 * (word - 32768);
             }
             ++indexAmp;
         }
-        // We are done with this Rhd2000DataBlock object; remove it from dataQueue
-        dataQueue.pop();
+
+        blockRing.releaseBlock();
     }
 
     return 0;
 }
 
 
-void ImpedanceMeter::measureComplexAmplitude(
-    std::vector<std::vector<std::vector<double>>>& measuredMagnitude,
-    std::vector<std::vector<std::vector<double>>>& measuredPhase,
-    int capIndex, 
-    int stream, 
-    int chipChannel, 
-    int numBlocks,
-    double sampleRate, 
-    double frequency, 
+void ImpedanceMeter::createReferenceWaveform(
+    int numSamples,
+    int period,
     int numPeriods)
 {
-    int period = (sampleRate / frequency);
     int startIndex = 0;
     int endIndex = startIndex + numPeriods * period - 1;
 
     // Move the measurement window to the end of the waveform to ignore start-up transient.
-    while (endIndex < SAMPLES_PER_DATA_BLOCK(board->evalBoard->isUSB3()) * numBlocks - period)
+    while (endIndex < numSamples - period)
     {
         startIndex += period;
         endIndex += period;
     }
 
-    double iComponent, qComponent;
+    referenceStart = startIndex;
+    referenceLength = endIndex - startIndex + 1;
+    referenceCos.resize((size_t) referenceLength * toneHarmonics.size());
+    referenceSin.resize((size_t) referenceLength * toneHarmonics.size());
+
+    // The window spans whole periods of the fundamental, so the tones do not leak into
+    // each other's references
+    for (int tone = 0; tone < (int) toneHarmonics.size(); ++tone)
+    {
+        const double k = TWO_PI * toneHarmonics[tone] / period;  // precalculate for speed
+        double* cosine = &referenceCos[(size_t) tone * referenceLength];
+        double* sine = &referenceSin[(size_t) tone * referenceLength];
 
-    // Measure real (iComponent) and imaginary (qComponent) amplitude of frequency component.
-    amplitudeOfFreqComponent(iComponent, qComponent, amplifierPreFilter[stream][chipChannel],
-        startIndex, endIndex, sampleRate, frequency);
-    // Calculate magnitude and phase from real (I) and imaginary (Q) components.
-    measuredMagnitude[stream][chipChannel][capIndex] =
-        sqrt(iComponent * iComponent + qComponent * qComponent);
-    measuredPhase[stream][chipChannel][capIndex] =
-        RADIANS_TO_DEGREES *atan2(qComponent, iComponent);
+        for (int t = startIndex; t <= endIndex; ++t)
+        {
+            cosine[t - startIndex] = cos(k * t + tonePhases[tone]);
+            sine[t - startIndex] = -1.0 * sin(k * t + tonePhases[tone]);
+        }
+    }
+}
+
+
+void ImpedanceMeter::measureComplexAmplitudes(
+    MeasurementTable& measuredMagnitude,
+    MeasurementTable& measuredPhase,
+    int capIndex, 
+    int chipChannel, 
+    int numDataStreams,
+    bool rhd2164B)
+{
+    double iComponent[MAX_NUM_DATA_STREAMS_USB3], qComponent[MAX_NUM_DATA_STREAMS_USB3];
+
+    for (int tone = 0; tone < (int) toneHarmonics.size(); ++tone)
+    {
+        // Measure real (iComponent) and imaginary (qComponent) amplitude of frequency component.
+        amplitudeOfFreqComponent(iComponent, qComponent, numDataStreams, tone);
+
+        for (int stream = 0; stream < numDataStreams; ++stream)
+        {
+            if ((board->chipId[stream] == CHIP_ID_RHD2164_B) != rhd2164B)
+                continue;
+
+            // Calculate magnitude and phase from real (I) and imaginary (Q) components.
+            measuredMagnitude[tone][stream][chipChannel][capIndex] =
+                sqrt(iComponent[stream] * iComponent[stream] + qComponent[stream] * qComponent[stream]);
+            measuredPhase[tone][stream][chipChannel][capIndex] =
+                RADIANS_TO_DEGREES * atan2(qComponent[stream], iComponent[stream]);
+        }
+    }
 }
 
 
 void ImpedanceMeter::amplitudeOfFreqComponent(
-    double& realComponent, 
-    double& imagComponent,
-    const std::vector<double>& data, 
-    int startIndex,
-    int endIndex, 
-    double sampleRate, 
-    double frequency)
+    double* realComponent, 
+    double* imagComponent,
+    int numDataStreams,
+    int tone)
 {
-    int length = endIndex - startIndex + 1;
-    const double k = TWO_PI * frequency / sampleRate;  // precalculate for speed
+    const int length = referenceLength;
+    const double* samples = &amplifierSamples[(size_t) referenceStart * numDataStreams];
+    const double* cosine = &referenceCos[(size_t) tone * referenceLength];
+    const double* sine = &referenceSin[(size_t) tone * referenceLength];
+
+    for (int stream = 0; stream < numDataStreams; ++stream)
+    {
+        realComponent[stream] = 0.0;
+        imagComponent[stream] = 0.0;
+    }
 
-    // Perform correlation with sine and cosine waveforms.
-    double meanI = 0.0;
-    double meanQ = 0.0;
-    for (int t = startIndex; t <= endIndex; ++t)
+    // Perform correlation with sine and cosine waveforms, for all streams at once.
+    for (int t = 0; t < length; ++t)
     {
-        meanI += data.at(t) * cos(k * t);
-        meanQ += data.at(t) * -1.0 * sin(k * t);
+        const double c = cosine[t];
+        const double s = sine[t];
+        int stream = 0;
+
+#ifdef IMPEDANCE_LOCK_IN_SSE2
+        const __m128d cosineVec = _mm_set1_pd(c);
+        const __m128d sineVec = _mm_set1_pd(s);
+
+        for (; stream + 2 <= numDataStreams; stream += 2)
+        {
+            __m128d x = _mm_loadu_pd(samples + stream);
+            _mm_storeu_pd(realComponent + stream, _mm_add_pd(_mm_loadu_pd(realComponent + stream), _mm_mul_pd(x, cosineVec)));
+            _mm_storeu_pd(imagComponent + stream, _mm_add_pd(_mm_loadu_pd(imagComponent + stream), _mm_mul_pd(x, sineVec)));
+        }
+#endif
+
+        for (; stream < numDataStreams; ++stream)
+        {
+            realComponent[stream] += samples[stream] * c;
+            imagComponent[stream] += samples[stream] * s;
+        }
+
+        samples += numDataStreams;
     }
-    meanI /= (double)length;
-    meanQ /= (double)length;
 
-    realComponent = 2.0 * meanI;
-    imagComponent = 2.0 * meanQ;
+    for (int stream = 0; stream < numDataStreams; ++stream)
+    {
+        realComponent[stream] = 2.0 * (realComponent[stream] / (double)length);
+        imagComponent[stream] = 2.0 * (imagComponent[stream] / (double)length);
+    }
+}
+
+
+int ImpedanceMeter::uploadZcheckCommands(const ImpedanceStep& step, int bank)
+{
+    std::vector<int> commandList;
+
+    switch (step.capRange)
+    {
+    case 0:
+        board->chipRegisters.setZcheckScale(Rhd2000Registers::ZcheckCs100fF);
+        break;
+    case 1:
+        board->chipRegisters.setZcheckScale(Rhd2000Registers::ZcheckCs1pF);
+        break;
+    case 2:
+        board->chipRegisters.setZcheckScale(Rhd2000Registers::ZcheckCs10pF);
+        break;
+    }
+
+    board->chipRegisters.setZcheckChannel(step.rhd2164B ? step.channel + 32 : step.channel);
+
+    // Register configuration without ADC calibration
+    int commandSequenceLength = board->chipRegisters.createCommandListRegisterConfig(commandList, false);
+    board->evalBoard->uploadCommandList(commandList, Rhd2000EvalBoard::AuxCmd3, bank);
+
+    return commandSequenceLength;
+}
+
+
+void ImpedanceMeter::selectZcheckBank(int bank)
+{
+    board->evalBoard->beginConfig();
+
+    board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortA, Rhd2000EvalBoard::AuxCmd3, bank);
+    board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortB, Rhd2000EvalBoard::AuxCmd3, bank);
+    board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortC, Rhd2000EvalBoard::AuxCmd3, bank);
+    board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortD, Rhd2000EvalBoard::AuxCmd3, bank);
+
+    if (board->boardType == RHD_RECORDING_CONTROLLER)
+    {
+        board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortE, Rhd2000EvalBoard::AuxCmd3, bank);
+        board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortF, Rhd2000EvalBoard::AuxCmd3, bank);
+        board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortG, Rhd2000EvalBoard::AuxCmd3, bank);
+        board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortH, Rhd2000EvalBoard::AuxCmd3, bank);
+    }
+
+    board->evalBoard->commitConfig();
+}
+
+
+bool ImpedanceMeter::measureStep(
+    Rhd2000BlockRing& blockRing,
+    const ImpedanceStep& step,
+    int numBlocks,
+    int numDataStreams,
+    MeasurementTable& measuredMagnitude,
+    MeasurementTable& measuredPhase)
+{
+    if (loadAmplifierData(blockRing, numBlocks, numDataStreams, step.channel) < 0)
+        return false;
+
+    measureComplexAmplitudes(measuredMagnitude, measuredPhase,
+        step.capRange, step.channel, numDataStreams, step.rhd2164B);
+
+    return true;
+}
+
+
+void ImpedanceMeter::abortSteps(Rhd2000BlockRing& blockRing)
+{
+    blockRing.cancel();
+
+    std::lock_guard<std::mutex> lock(blockRing.getBoardLock());
+
+    // Let a run that is still going finish, then discard its frames so that
+    // they are not read as the data of a later step
+    board->evalBoard->waitForRunCompletion();
+    board->evalBoard->flush();
+}
+
+
+void ImpedanceMeter::addSteps(std::vector<ImpedanceStep>& steps, int capRange, const std::vector<int>& zcheckChannels)
+{
+    for (int zcheckChannel : zcheckChannels)
+        steps.push_back({ capRange, zcheckChannel % 32, zcheckChannel >= 32 });
+}
+
+
+bool ImpedanceMeter::needsRange(
+    const MeasurementTable& measuredMagnitude,
+    int capRange,
+    int chipChannel,
+    bool rhd2164B)
+{
+    for (int stream = 0; stream < (int) measuredMagnitude[0].size(); ++stream)
+    {
+        if ((board->chipId[stream] == CHIP_ID_RHD2164_B) != rhd2164B)
+            continue;
+
+        // Only the channels reported for this stream count
+        int chOffset = getReportedChannelOffset(stream);
+
+        if (chipChannel < chOffset || chipChannel >= chOffset + board->numChannelsPerDataStream[stream])
+            continue;
+
+        for (int tone = 0; tone < (int) measuredMagnitude.size(); ++tone)
+        {
+            double magnitude = measuredMagnitude[tone][stream][chipChannel][1];
+
+            if (capRange == 0 && magnitude > BEST_AMPLITUDE * ADAPTIVE_ACCEPTANCE_FACTOR)
+                return true;
+
+            if (capRange == 2 && magnitude < BEST_AMPLITUDE / ADAPTIVE_ACCEPTANCE_FACTOR)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+
+bool ImpedanceMeter::runSteps(
+    Rhd2000BlockRing& blockRing,
+    const std::vector<ImpedanceStep>& steps,
+    int numBlocks,
+    int numDataStreams,
+    MeasurementTable& measuredMagnitude,
+    MeasurementTable& measuredPhase,
+    float progressStart,
+    float progressEnd)
+{
+    std::mutex& boardLock = blockRing.getBoardLock();
+
+    {
+        std::lock_guard<std::mutex> lock(boardLock);
+
+        int commandSequenceLength = uploadZcheckCommands(steps[0], ZCHECK_COMMAND_BANK);
+
+        board->evalBoard->beginConfig();
+        board->evalBoard->selectAuxCommandLength(Rhd2000EvalBoard::AuxCmd3, 0, commandSequenceLength - 1);
+        selectZcheckBank(ZCHECK_COMMAND_BANK);
+        board->evalBoard->commitConfig();
+    }
+
+    // The sweep is pipelined: while the board runs one step, the blocks of the previous step
+    // are read and measured, and the configuration of the next step is uploaded to the
+    // other command bank.  The board is only idle while the banks are switched.
+    for (int step = 0; step < (int) steps.size(); ++step)
+    {
+        // the board is idle here, and the ring has nothing pending
+        if (threadShouldExit())
+        {
+            abortSteps(blockRing);
+            return false;
+        }
+
+        const int bank = ZCHECK_COMMAND_BANK + step % 2;
+        const int nextBank = ZCHECK_COMMAND_BANK + (step + 1) % 2;
+
+        {
+            std::lock_guard<std::mutex> lock(boardLock);
+            board->evalBoard->run();
+        }
+
+        if (step > 0 &&
+            !measureStep(blockRing, steps[step - 1], numBlocks, numDataStreams, measuredMagnitude, measuredPhase))
+        {
+            abortSteps(blockRing);
+            return false;
+        }
+
+        setProgress(progressStart + (progressEnd - progressStart) * float(step) / float(steps.size()));
+
+        bool completed;
+
+        {
+            std::lock_guard<std::mutex> lock(boardLock);
+
+            if (step + 1 < (int) steps.size())
+                uploadZcheckCommands(steps[step + 1], nextBank);
+
+            completed = board->evalBoard->waitForRunCompletion();
+
+            if (completed && step + 1 < (int) steps.size())
+                selectZcheckBank(nextBank);
+        }
+
+        if (!completed)
+        {
+            LOGE("Impedance measurement: board did not finish the run for channel ",
+                 steps[step].channel + (steps[step].rhd2164B ? 32 : 0), " in bank ", bank, "; aborting");
+            abortSteps(blockRing);
+            return false;
+        }
+    }
+
+    if (!measureStep(blockRing, steps.back(), numBlocks, numDataStreams, measuredMagnitude, measuredPhase))
+    {
+        abortSteps(blockRing);
+        return false;
+    }
+
+    return true;
+}
+
+
+int ImpedanceMeter::getReportedChannelOffset(int stream) const
+{
+    if ((board->chipId[stream] == CHIP_ID_RHD2132) && (board->numChannelsPerDataStream[stream] == 16))
+        return RHD2132_16CH_OFFSET;
+
+    return 0;
+}
+
+
+int ImpedanceMeter::getZcheckChannel(int stream, int chipChannel) const
+{
+    return chipChannel + (board->chipId[stream] == CHIP_ID_RHD2164_B ? 32 : 0);
+}
+
+
+bool ImpedanceMeter::measureChannels(
+    Rhd2000BlockRing& blockRing,
+    const std::vector<int>& zcheckChannels,
+    int numBlocks,
+    int numDataStreams,
+    MeasurementTable& measuredMagnitude,
+    MeasurementTable& measuredPhase,
+    float progressStart,
+    float progressEnd)
+{
+    std::vector<ImpedanceStep> steps;
+
+    if (zcheckChannels.empty())
+        return true;
+
+    // We execute complete electrode impedance measurements with Cseries set to 0.1 pF,
+    // 1 pF, and 10 pF.  Then we select the best measurement for each channel so that we
+    // achieve a wide impedance measurement range.
+    if (board->settings.exhaustiveImpedanceSweep)
+    {
+        for (int capRange = 0; capRange < 3; ++capRange)
+            addSteps(steps, capRange, zcheckChannels);
+
+        return runSteps(blockRing, steps, numBlocks, numDataStreams, measuredMagnitude, measuredPhase,
+            progressStart, progressEnd);
+    }
+
+    // The amplitude scales with Cseries, so a pass at 1 pF predicts the best range of
+    // every channel.  Channels outside the acceptance band are measured again at the
+    // predicted range, grouped by range.
+    const float progressMiddle = (progressStart + progressEnd) / 2;
+
+    addSteps(steps, 1, zcheckChannels);
+
+    if (!runSteps(blockRing, steps, numBlocks, numDataStreams, measuredMagnitude, measuredPhase,
+        progressStart, progressMiddle))
+        return false;
+
+    int numFirstPassSteps = (int) steps.size();
+    steps.clear();
+
+    for (int capRange = 0; capRange < 3; capRange += 2)
+    {
+        for (int zcheckChannel : zcheckChannels)
+        {
+            if (needsRange(measuredMagnitude, capRange, zcheckChannel % 32, zcheckChannel >= 32))
+                steps.push_back({ capRange, zcheckChannel % 32, zcheckChannel >= 32 });
+        }
+    }
+
+    LOGD("Impedance measurement: ", steps.size(), " of ", 2 * numFirstPassSteps,
+         " runs at 0.1 pF and 10 pF needed after the 1 pF pass");
+
+    if (steps.empty())
+        return true;
+
+    return runSteps(blockRing, steps, numBlocks, numDataStreams, measuredMagnitude, measuredPhase,
+        progressMiddle, progressEnd);
+}
+
+
+bool ImpedanceMeter::calculateImpedance(
+    const std::vector<double>& magnitudes,
+    const std::vector<double>& phases,
+    double frequency,
+    double dacVoltageAmplitude,
+    double& impedanceMagnitude,
+    double& impedancePhase)
+{
+    const double parasiticCapacitance = 14.0e-12;  // 14 pF: an estimate of on-chip parasitic capacitance,
+    // including 10 pF of amplifier input capacitance.
+    const double relativeFreq = frequency / board->settings.boardSampleRate;
+
+    double distance, current, Cseries;
+    double minDistance = 9.9e99;  // ridiculously large number
+    int bestAmplitudeIndex = -1;
+
+    for (int capRange = 0; capRange < 3; ++capRange)
+    {
+        // An adaptive sweep leaves ranges that were not needed unmeasured
+        if (magnitudes[capRange] <= 0.0)
+            continue;
+
+        // Find the measured amplitude that is closest to BEST_AMPLITUDE on a logarithmic scale
+        distance = abs(log(magnitudes[capRange] / BEST_AMPLITUDE));
+        if (distance < minDistance)
+        {
+            bestAmplitudeIndex = capRange;
+            minDistance = distance;
+        }
+    }
+
+    switch (bestAmplitudeIndex)
+    {
+    case 0:
+        Cseries = 0.1e-12;
+        break;
+    case 1:
+        Cseries = 1.0e-12;
+        break;
+    case 2:
+        Cseries = 10.0e-12;
+        break;
+    default:
+        impedanceMagnitude = 0.0;
+        impedancePhase = 0.0;
+        return false;
+    }
+
+    // Calculate current amplitude produced by on-chip voltage DAC
+    current = TWO_PI * frequency * dacVoltageAmplitude * Cseries;
+
+    // Calculate impedance magnitude from calculated current and measured voltage.
+    impedanceMagnitude = 1.0e-6 * (magnitudes[bestAmplitudeIndex] / current) *
+        (18.0 * relativeFreq * relativeFreq + 1.0);
+
+    // Calculate impedance phase, with small correction factor accounting for the
+    // 3-command SPI pipeline delay.
+    impedancePhase = phases[bestAmplitudeIndex] + (360.0 * 3.0 * relativeFreq);
+
+    // Factor out on-chip parasitic capacitance from impedance measurement.
+    factorOutParallelCapacitance(impedanceMagnitude, impedancePhase, frequency,
+        parasiticCapacitance);
+
+    // Perform empirical resistance correction to improve accuarcy at sample rates below 15 kS/s.
+    empiricalResistanceCorrection(impedanceMagnitude, impedancePhase,
+        board->settings.boardSampleRate);
+
+    return true;
 }
 
 
@@ -283,10 +762,12 @@ void ImpedanceMeter::run()
 
 void ImpedanceMeter::runImpedanceMeasurement(Impedances& impedances)
 {
-    int commandSequenceLength, stream, channel, capRange;
-    double cSeries;
+    int commandSequenceLength, stream, channel;
     std::vector<int> commandList;
 
+    // Only a sweep that runs to completion makes the values valid
+    impedances.valid = false;
+
     setProgress(0.0f);
 
     int numdataStreams = board->evalBoard->getNumEnabledDataStreams();
@@ -311,16 +792,29 @@ void ImpedanceMeter::runImpedanceMeasurement(Impedances& impedances)
         }
     }
 
-    bool validImpedanceFreq;
-    float actualImpedanceFreq = updateImpedanceFrequency(1000.0, validImpedanceFreq);
+    float fundamentalFreq = selectTestTones(board->settings.impedanceSpectroscopy);
 
-    if (!validImpedanceFreq)
+    if (toneHarmonics.empty())
     {
         return;
     }
-    
+
+    const int numTones = (int) toneHarmonics.size();
+    const int period = (int) floor(board->settings.boardSampleRate / fundamentalFreq + 0.5);
+    double toneAmplitude;
+
     // Create a command list for the AuxCmd1 slot.
-    commandSequenceLength = board->chipRegisters.createCommandListZcheckDac(commandList, actualImpedanceFreq, 128.0);
+    if (board->settings.impedanceSpectroscopy)
+    {
+        commandSequenceLength = board->chipRegisters.createCommandListZcheckDacMultiTone(commandList,
+            period, toneHarmonics, 128.0, toneAmplitude, tonePhases);
+    }
+    else
+    {
+        commandSequenceLength = board->chipRegisters.createCommandListZcheckDac(commandList, fundamentalFreq, 128.0);
+        toneAmplitude = 128.0;
+        tonePhases.assign(1, 0.0);
+    }
     CHECK_EXIT;
     board->evalBoard->uploadCommandList(commandList, Rhd2000EvalBoard::AuxCmd1, 1);
     board->evalBoard->selectAuxCommandLength(Rhd2000EvalBoard::AuxCmd1,
@@ -354,9 +848,8 @@ void ImpedanceMeter::runImpedanceMeasurement(Impedances& impedances)
     }
 
     // Select number of periods to measure impedance over
-    int numPeriods = (0.020 * actualImpedanceFreq); // Test each channel for at least 20 msec...
+    int numPeriods = (0.020 * fundamentalFreq); // Test each channel for at least 20 msec...
     if (numPeriods < 5) numPeriods = 5; // ...but always measure across no fewer than 5 complete periods
-    double period = board->settings.boardSampleRate / actualImpedanceFreq;
     int numBlocks = ceil((numPeriods + 2.0) * period / 60.0);  // + 2 periods to give time to settle initially
     if (numBlocks < 2) numBlocks = 2;   // need first block for command to switch channels to take effect.
 
@@ -366,224 +859,228 @@ void ImpedanceMeter::runImpedanceMeasurement(Impedances& impedances)
     board->settings.dsp.upperBandwidth = board->chipRegisters.setUpperBandwidth(board->settings.dsp.upperBandwidth);
     board->chipRegisters.enableDsp(board->settings.dsp.enabled);
     board->chipRegisters.enableZcheck(true);
-    
-    commandSequenceLength = board->chipRegisters.createCommandListRegisterConfig(commandList, false);
-    CHECK_EXIT;
-    // Upload version with no ADC calibration to AuxCmd3 RAM Bank 1.
-    board->evalBoard->uploadCommandList(commandList, Rhd2000EvalBoard::AuxCmd3, 3);
-    board->evalBoard->selectAuxCommandLength(Rhd2000EvalBoard::AuxCmd3, 0, commandSequenceLength - 1);
-    board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortA, Rhd2000EvalBoard::AuxCmd3, 3);
-    board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortB, Rhd2000EvalBoard::AuxCmd3, 3);
-    board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortC, Rhd2000EvalBoard::AuxCmd3, 3);
-    board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortD, Rhd2000EvalBoard::AuxCmd3, 3);
-
-    if (board->boardType == RHD_RECORDING_CONTROLLER)
-    {
-        board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortE, Rhd2000EvalBoard::AuxCmd3, 3);
-        board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortF, Rhd2000EvalBoard::AuxCmd3, 3);
-        board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortG, Rhd2000EvalBoard::AuxCmd3, 3);
-        board->evalBoard->selectAuxCommandBank(Rhd2000EvalBoard::PortH, Rhd2000EvalBoard::AuxCmd3, 3);
-    }
 
     CHECK_EXIT;
     board->evalBoard->setContinuousRunMode(false);
     board->evalBoard->setMaxTimeStep(SAMPLES_PER_DATA_BLOCK(board->evalBoard->isUSB3()) * numBlocks);
 
-    // Create matrices of doubles of size (numStreams x 32 x 3) to store complex amplitudes
-    // of all amplifier channels (32 on each data stream) at three different Cseries values.
-    std::vector<std::vector<std::vector<double>>>  measuredMagnitude;
-    std::vector<std::vector<std::vector<double>>>  measuredPhase;
+    // One slot per block, so a whole measurement fits in the ring; it is moved in four
+    // chunks so that scaling a chunk overlaps the transfer of the next
+    Rhd2000BlockRing blockRing(board->evalBoard, numBlocks, (numBlocks + 3) / 4);
 
-    measuredMagnitude.resize(board->evalBoard->getNumEnabledDataStreams());
-    measuredPhase.resize(board->evalBoard->getNumEnabledDataStreams());
+    // Create matrices of doubles of size (numTones x numStreams x 32 x 3) to store complex amplitudes
+    // of all amplifier channels (32 on each data stream) at each test tone and three different
+    // Cseries values.
+    MeasurementTable measuredMagnitude(numTones);
+    MeasurementTable measuredPhase(numTones);
 
-    for (int i = 0; i < board->evalBoard->getNumEnabledDataStreams(); ++i)
+    for (int tone = 0; tone < numTones; ++tone)
     {
-        measuredMagnitude[i].resize(32);
-        measuredPhase[i].resize(32);
+        measuredMagnitude[tone].resize(board->evalBoard->getNumEnabledDataStreams());
+        measuredPhase[tone].resize(board->evalBoard->getNumEnabledDataStreams());
 
-        for (int j = 0; j < 32; ++j)
+        for (int i = 0; i < board->evalBoard->getNumEnabledDataStreams(); ++i)
         {
-            measuredMagnitude[i][j].resize(3);
-            measuredPhase[i][j].resize(3);
+            measuredMagnitude[tone][i].resize(32);
+            measuredPhase[tone][i].resize(32);
+
+            for (int j = 0; j < 32; ++j)
+            {
+                measuredMagnitude[tone][i][j].resize(3);
+                measuredPhase[tone][i][j].resize(3);
+            }
         }
     }
 
-    double distance, minDistance, current, Cseries;
     double impedanceMagnitude, impedancePhase;
 
-    const double bestAmplitude = 250.0;  // we favor voltage readings that are closest to 250 uV: not too large,
-    // and not too small.
-    const double dacVoltageAmplitude = 128 * (1.225 / 256);  // this assumes the DAC amplitude was set to 128
-    const double parasiticCapacitance = 14.0e-12;  // 14 pF: an estimate of on-chip parasitic capacitance,
-    // including 10 pF of amplifier input capacitance.
-    double relativeFreq = actualImpedanceFreq / board->settings.boardSampleRate;
+    const double dacVoltageAmplitude = toneAmplitude * (1.225 / 256);  // amplitude of each tone, in volts
+
+    // The test tones and the measurement window are the same for every channel
+    createReferenceWaveform(SAMPLES_PER_DATA_BLOCK(board->evalBoard->isUSB3()) * numBlocks,
+        period, numPeriods);
+
+    // The per-channel magnitude and phase report the tone closest to 1 kHz
+    int reportedTone = 0;
+
+    for (int tone = 1; tone < numTones; ++tone)
+    {
+        if (std::abs(toneHarmonics[tone] * fundamentalFreq - 1000.0) <
+            std::abs(toneHarmonics[reportedTone] * fundamentalFreq - 1000.0))
+            reportedTone = tone;
+    }
+
+    impedances.frequencies.clear();
 
-    int bestAmplitudeIndex;
+    for (int tone = 0; tone < numTones; ++tone)
+        impedances.frequencies.add(toneHarmonics[tone] * fundamentalFreq);
 
-    // We execute three complete electrode impedance measurements: one each with
-    // Cseries set to 0.1 pF, 1 pF, and 10 pF.  Then we select the best measurement
-    // for each channel so that we achieve a wide impedance measurement range.
-    for (capRange = 0; capRange < 3; ++capRange)
+    // Each run measures one Zcheck channel on every stream at once.  If an RHD2164 chip is
+    // plugged in, channels 32-63 are selected in separate runs.
+    std::vector<int> zcheckChannels;
+
+    for (channel = 0; channel < 32; ++channel)
+    {
+        zcheckChannels.push_back(channel);
+
+        if (rhd2164ChipPresent)
+            zcheckChannels.push_back(channel + 32);
+    }
+
+    // Spectra are not cached, so spectroscopy always measures every channel
+    const bool cacheImpedances = !board->settings.impedanceSpectroscopy;
+    const bool quickCheck = board->settings.quickImpedanceCheck && cacheImpedances;
+    const int64 now = Time::currentTimeMillis();
+    ImpedanceCache& cache = board->impedanceCache;
+
+    if (cacheImpedances)
+        cache.load(String(board->evalBoard->getSerialNumber()));
+
+    if (!quickCheck)
+    {
+        if (!measureChannels(blockRing, zcheckChannels, numBlocks, numdataStreams,
+            measuredMagnitude, measuredPhase, 0.0f, 1.0f))
+            return;
+    }
+    else
     {
+        ImpedanceCacheEntry entry;
+        std::vector<bool> selected(64, false);
 
-        switch (capRange)
+        // First measure the channels without a fresh cached value, and a sample of the others
+        for (stream = 0; stream < numdataStreams; ++stream)
         {
-        case 0:
-            board->chipRegisters.setZcheckScale(Rhd2000Registers::ZcheckCs100fF);
-            cSeries = 0.1e-12;
-            break;
-        case 1:
-            board->chipRegisters.setZcheckScale(Rhd2000Registers::ZcheckCs1pF);
-            cSeries = 1.0e-12;
-            break;
-        case 2:
-            board->chipRegisters.setZcheckScale(Rhd2000Registers::ZcheckCs10pF);
-            cSeries = 10.0e-12;
-            break;
+            chOffset = getReportedChannelOffset(stream);
+
+            for (channel = chOffset; channel < chOffset + board->numChannelsPerDataStream[stream]; ++channel)
+            {
+                if (!cache.find(enabledStreams[stream], board->chipId[stream], channel, entry) ||
+                    now - entry.time > IMPEDANCE_CACHE_MAX_AGE_MS ||
+                    channel % IMPEDANCE_QUICK_CHECK_STRIDE == quickCheckOffset)
+                    selected[getZcheckChannel(stream, channel)] = true;
+            }
         }
 
-        // Check all 32 channels across all active data streams.
-        for (channel = 0; channel < 32; ++channel)
+        quickCheckOffset = (quickCheckOffset + 1) % IMPEDANCE_QUICK_CHECK_STRIDE;
+
+        std::vector<int> sample;
+
+        for (int zcheckChannel : zcheckChannels)
         {
+            if (selected[zcheckChannel])
+                sample.push_back(zcheckChannel);
+        }
 
-            CHECK_EXIT;
-   
-            board->chipRegisters.setZcheckChannel(channel);
-            commandSequenceLength =
-                board->chipRegisters.createCommandListRegisterConfig(commandList, false);
-            // Upload version with no ADC calibration to AuxCmd3 RAM Bank 1.
-            board->evalBoard->uploadCommandList(commandList, Rhd2000EvalBoard::AuxCmd3, 3);
+        if (!measureChannels(blockRing, sample, numBlocks, numdataStreams,
+            measuredMagnitude, measuredPhase, 0.0f, 0.5f))
+            return;
 
-            board->evalBoard->run();
-            while (board->evalBoard->isRunning())
-            {
+        // Then measure the rest of every chip that drifted away from its cached values
+        std::vector<int> remeasure;
 
-            }
-            std::queue<Rhd2000DataBlock> dataQueue;
-            board->evalBoard->readDataBlocks(numBlocks, dataQueue);
-            loadAmplifierData(dataQueue, numBlocks, numdataStreams);
+        for (stream = 0; stream < numdataStreams; ++stream)
+        {
+            chOffset = getReportedChannelOffset(stream);
+            bool drifting = false;
 
-            for (stream = 0; stream < numdataStreams; ++stream)
+            for (channel = chOffset; channel < chOffset + board->numChannelsPerDataStream[stream]; ++channel)
             {
+                if (cache.find(enabledStreams[stream], board->chipId[stream], channel, entry) &&
+                    calculateImpedance(measuredMagnitude[0][stream][channel], measuredPhase[0][stream][channel],
+                        impedances.frequencies[0], dacVoltageAmplitude, impedanceMagnitude, impedancePhase) &&
+                    std::abs(impedanceMagnitude - entry.magnitude) > IMPEDANCE_DRIFT_TOLERANCE * entry.magnitude)
+                    drifting = true;
+            }
 
-                setProgress(float(capRange) / 3.0f 
-                            + (float(channel) / 32.0f / 3.0f) 
-                            + (float(stream) / float(numdataStreams) / 32.0f / 3.0f));
+            if (!drifting)
+                continue;
 
-                if (board->chipId[stream] != CHIP_ID_RHD2164_B)
-                {
-                    measureComplexAmplitude(measuredMagnitude, measuredPhase,
-                        capRange, stream, channel, numBlocks, board->settings.boardSampleRate,
-                        actualImpedanceFreq, numPeriods);
-                }
-            }
+            LOGD("Impedance quick check: stream ", enabledStreams[stream], " drifted, measuring all of its channels");
 
-            // If an RHD2164 chip is plugged in, we have to set the Zcheck select register to channels 32-63
-            // and repeat the previous steps.
-            if (rhd2164ChipPresent)
+            for (channel = chOffset; channel < chOffset + board->numChannelsPerDataStream[stream]; ++channel)
             {
-                CHECK_EXIT;
-                board->chipRegisters.setZcheckChannel(channel + 32); // address channels 32-63
-                commandSequenceLength =
-                    board->chipRegisters.createCommandListRegisterConfig(commandList, false);
-                // Upload version with no ADC calibration to AuxCmd3 RAM Bank 1.
-                board->evalBoard->uploadCommandList(commandList, Rhd2000EvalBoard::AuxCmd3, 3);
-
-                board->evalBoard->run();
-                while (board->evalBoard->isRunning())
-                {
-
-                }
-                board->evalBoard->readDataBlocks(numBlocks, dataQueue);
-                loadAmplifierData(dataQueue, numBlocks, numdataStreams);
+                int zcheckChannel = getZcheckChannel(stream, channel);
 
-                for (stream = 0; stream < board->evalBoard->getNumEnabledDataStreams(); ++stream)
+                if (!selected[zcheckChannel])
                 {
-                    if (board->chipId[stream] == CHIP_ID_RHD2164_B)
-                    {
-                        measureComplexAmplitude(measuredMagnitude, measuredPhase,
-                            capRange, stream, channel, numBlocks, board->settings.boardSampleRate,
-                            actualImpedanceFreq, numPeriods);
-                    }
+                    selected[zcheckChannel] = true;
+                    remeasure.push_back(zcheckChannel);
                 }
             }
         }
+
+        LOGD("Impedance quick check: ", sample.size() + remeasure.size(), " of ", zcheckChannels.size(),
+             " channels measured");
+
+        if (!measureChannels(blockRing, remeasure, numBlocks, numdataStreams,
+            measuredMagnitude, measuredPhase, 0.5f, 1.0f))
+            return;
     }
 
     impedances.streams.clear();
     impedances.channels.clear();
     impedances.magnitudes.clear();
     impedances.phases.clear();
+    impedances.spectrumMagnitudes.clear();
+    impedances.spectrumPhases.clear();
 
-    for (stream = 0; stream < board->evalBoard->getNumEnabledDataStreams(); ++stream)
+    for (stream = 0; stream < numdataStreams; ++stream)
     {
-        if ((board->chipId[stream] == CHIP_ID_RHD2132) && (board->numChannelsPerDataStream[stream] == 16))
-            chOffset = RHD2132_16CH_OFFSET;
-        else
-            chOffset = 0;
+        chOffset = getReportedChannelOffset(stream);
 
         for (channel = 0; channel < board->numChannelsPerDataStream[stream]; ++channel)
         {
-            if (1)
-            {
-                minDistance = 9.9e99;  // ridiculously large number
-                for (capRange = 0; capRange < 3; ++capRange)
-                {
-                    // Find the measured amplitude that is closest to bestAmplitude on a logarithmic scale
-                    distance = abs(log(measuredMagnitude[stream][channel+chOffset][capRange] / bestAmplitude));
-                    if (distance < minDistance)
-                    {
-                        bestAmplitudeIndex = capRange;
-                        minDistance = distance;
-                    }
-                }
-                switch (bestAmplitudeIndex)
-                {
-                case 0:
-                    Cseries = 0.1e-12;
-                    break;
-                case 1:
-                    Cseries = 1.0e-12;
-                    break;
-                case 2:
-                    Cseries = 10.0e-12;
-                    break;
-                }
+            const int chipChannel = channel + chOffset;
+            ImpedanceCacheEntry entry;
 
-                // Calculate current amplitude produced by on-chip voltage DAC
-                current = TWO_PI * actualImpedanceFreq * dacVoltageAmplitude * Cseries;
+            impedances.streams.add(enabledStreams[stream]);
+            impedances.channels.add(chipChannel);
 
-                // Calculate impedance magnitude from calculated current and measured voltage.
-                impedanceMagnitude = 1.0e-6 * (measuredMagnitude[stream][channel + chOffset][bestAmplitudeIndex] / current) *
-                    (18.0 * relativeFreq * relativeFreq + 1.0);
-
-                // Calculate impedance phase, with small correction factor accounting for the
-                // 3-command SPI pipeline delay.
-                impedancePhase = measuredPhase[stream][channel + chOffset][bestAmplitudeIndex] + (360.0 * (3.0 / period));
+            // A quick check reuses the cached value of a channel it did not measure
+            if (quickCheck &&
+                !calculateImpedance(measuredMagnitude[0][stream][chipChannel], measuredPhase[0][stream][chipChannel],
+                    impedances.frequencies[0], dacVoltageAmplitude, impedanceMagnitude, impedancePhase) &&
+                cache.find(enabledStreams[stream], board->chipId[stream], chipChannel, entry))
+            {
+                impedances.magnitudes.add(entry.magnitude);
+                impedances.phases.add(entry.phase);
+                impedances.spectrumMagnitudes.add(entry.magnitude);
+                impedances.spectrumPhases.add(entry.phase);
+                continue;
+            }
 
-                // Factor out on-chip parasitic capacitance from impedance measurement.
-                factorOutParallelCapacitance(impedanceMagnitude, impedancePhase, actualImpedanceFreq,
-                    parasiticCapacitance);
+            bool measured = false;
 
-                // Perform empirical resistance correction to improve accuarcy at sample rates below 15 kS/s.
-                empiricalResistanceCorrection(impedanceMagnitude, impedancePhase,
-                    board->settings.boardSampleRate);
+            for (int tone = 0; tone < numTones; ++tone)
+            {
+                bool valid = calculateImpedance(measuredMagnitude[tone][stream][chipChannel],
+                    measuredPhase[tone][stream][chipChannel], impedances.frequencies[tone],
+                    dacVoltageAmplitude, impedanceMagnitude, impedancePhase);
 
-                impedances.streams.add(enabledStreams[stream]);
-                impedances.channels.add(channel + chOffset);
-                impedances.magnitudes.add(impedanceMagnitude);
-                impedances.phases.add(impedancePhase);
+                impedances.spectrumMagnitudes.add(impedanceMagnitude);
+                impedances.spectrumPhases.add(impedancePhase);
 
-                //if (impedanceMagnitude > 1000000)
-                //    cout << "stream " << stream << " channel " << 1 + channel << " magnitude: " << String(impedanceMagnitude / 1e6, 2) << " MOhm , phase : " << impedancePhase << endl;
-                //else
-                //    cout << "stream " << stream << " channel " << 1 + channel << " magnitude: " << String(impedanceMagnitude / 1e3, 2) << " kOhm , phase : " << impedancePhase << endl;
+                if (tone == reportedTone)
+                {
+                    impedances.magnitudes.add(impedanceMagnitude);
+                    impedances.phases.add(impedancePhase);
+                    measured = valid;
+                }
+            }
 
+            if (cacheImpedances && measured)
+            {
+                entry.magnitude = impedances.magnitudes.getLast();
+                entry.phase = impedances.phases.getLast();
+                entry.time = now;
+                cache.set(enabledStreams[stream], board->chipId[stream], chipChannel, entry);
             }
         }
     }
-    
+
+    if (cacheImpedances)
+        cache.save();
+
     impedances.valid = true;
 
 }
@@ -34,6 +34,8 @@
 #include "rhythm-api/rhd2000evalboard.h"
 #include "rhythm-api/rhd2000registers.h"
 #include "rhythm-api/rhd2000datablock.h"
+#include "rhythm-api/rhd2000blockring.h"
+#include "rhythm-api/rhd2000blockview.h"
 #include "rhythm-api/okFrontPanelDLL.h"
 
 #include "DeviceThread.h"
@@ -65,35 +67,125 @@ namespace RhythmNode
 
 	private:
 
+		/** One run of the sweep: a Zcheck channel measured at one series capacitance */
+		struct ImpedanceStep
+		{
+			int capRange;
+			int channel;
+			bool rhd2164B;   // channel + 32, measured on the RHD2164 MISO B streams
+		};
+
+		/** Measured amplitudes (in microvolts) or phases (in degrees),
+		    [tone][stream][chip channel][capacitor range] */
+		typedef std::vector<std::vector<std::vector<std::vector<double>>>> MeasurementTable;
+
 		/** Calculates impedance values for all channels*/
 		void runImpedanceMeasurement(Impedances& impedances);
 		
 		/** Restores settings of device*/
 		void restoreBoardSettings();
 
-		/** Returns the magnitude and phase (in degrees) of a selected frequency component (in Hz)
-	        for a selected amplifier channel on the selected USB data stream.*/
-		void measureComplexAmplitude(
-			std::vector<std::vector<std::vector<double>>>& measuredMagnitude,
-			std::vector<std::vector<std::vector<double>>>& measuredPhase,
-			int capIndex, 
-			int stream, 
-			int chipChannel, 
+		/** Uploads the register configuration that selects the Zcheck channel and series
+		    capacitance of a step to an AuxCmd3 RAM bank. Returns the command sequence length.*/
+		int uploadZcheckCommands(const ImpedanceStep& step, int bank);
+
+		/** Selects an AuxCmd3 RAM bank on all ports*/
+		void selectZcheckBank(int bank);
+
+		/** Reads the blocks of a finished step and stores its magnitudes and phases.
+		    Returns false if the board did not deliver all blocks.*/
+		bool measureStep(
+			Rhd2000BlockRing& blockRing,
+			const ImpedanceStep& step,
+			int numBlocks,
+			int numDataStreams,
+			MeasurementTable& measuredMagnitude,
+			MeasurementTable& measuredPhase);
+
+		/** Cancels the blocks still requested from the ring and flushes the board FIFO,
+		    once the current run has finished*/
+		void abortSteps(Rhd2000BlockRing& blockRing);
+
+		/** Appends a step for each Zcheck channel (0-63, see getZcheckChannel()) at one series capacitance*/
+		void addSteps(std::vector<ImpedanceStep>& steps, int capRange, const std::vector<int>& zcheckChannels);
+
+		/** Returns true if a reported channel measured at 1 pF lies outside the acceptance band
+		    on the side of capRange (0 for too large a reading, 2 for too small a one)*/
+		bool needsRange(
+			const MeasurementTable& measuredMagnitude,
+			int capRange,
+			int chipChannel,
+			bool rhd2164B);
+
+		/** Runs and measures the steps in order, pipelined across the two command banks.
+		    Reports progress from progressStart to progressEnd. Returns false, with the board
+		    FIFO flushed, if the thread was asked to exit, a run did not finish or the board
+		    did not deliver a step's data.*/
+		bool runSteps(
+			Rhd2000BlockRing& blockRing,
+			const std::vector<ImpedanceStep>& steps,
+			int numBlocks,
+			int numDataStreams,
+			MeasurementTable& measuredMagnitude,
+			MeasurementTable& measuredPhase,
+			float progressStart,
+			float progressEnd);
+
+		/** Measures the Zcheck channels, at every series capacitance or, unless the sweep is
+		    exhaustive, at 1 pF and then at the ranges the 1 pF readings call for. Reports
+		    progress from progressStart to progressEnd. Returns false if the thread was asked
+		    to exit or the sweep was aborted (see runSteps()).*/
+		bool measureChannels(
+			Rhd2000BlockRing& blockRing,
+			const std::vector<int>& zcheckChannels,
 			int numBlocks,
-			double sampleRate, 
-			double frequency, 
+			int numDataStreams,
+			MeasurementTable& measuredMagnitude,
+			MeasurementTable& measuredPhase,
+			float progressStart,
+			float progressEnd);
+
+		/** Converts the amplitudes and phases a channel showed at each series capacitance into
+		    its impedance at one test frequency, using the best measured range. Returns false
+		    if the channel was not measured.*/
+		bool calculateImpedance(
+			const std::vector<double>& magnitudes,
+			const std::vector<double>& phases,
+			double frequency,
+			double dacVoltageAmplitude,
+			double& impedanceMagnitude,
+			double& impedancePhase);
+
+		/** First chip channel reported for a data stream (16-channel RHD2132 headstages skip some)*/
+		int getReportedChannelOffset(int stream) const;
+
+		/** Zcheck channel of a chip channel on a data stream: + 32 on the RHD2164 MISO B streams*/
+		int getZcheckChannel(int stream, int chipChannel) const;
+
+		/** Fills the cosine and negated sine reference tables of every test tone, over the last
+		    numPeriods whole periods (of period samples) of a run of numSamples samples. */
+		void createReferenceWaveform(
+			int numSamples,
+			int period,
 			int numPeriods);
 
-		/** Returns the real and imaginary amplitudes of a selected frequency component in the vector
-		    data, between a start index and end index. */
+		/** Stores the magnitude and phase (in degrees) of every test tone for the selected
+		    amplifier channel of every data stream whose chip type matches rhd2164B. */
+		void measureComplexAmplitudes(
+			MeasurementTable& measuredMagnitude,
+			MeasurementTable& measuredPhase,
+			int capIndex, 
+			int chipChannel, 
+			int numDataStreams,
+			bool rhd2164B);
+
+		/** Returns the real and imaginary amplitudes of one test tone for each data stream,
+		    correlating the loaded samples with the tone's reference tables in one pass. */
 		void amplitudeOfFreqComponent(
-			double& realComponent,					  
-			double& imagComponent,					  
-			const std::vector<double>& data, 				 
-			int startIndex,			  
-			int endIndex, 					  
-			double sampleRate,   
-			double frequency);
+			double* realComponent,					  
+			double* imagComponent,					  
+			int numDataStreams,
+			int tone);
 
 		/** Given a measured complex impedance that is the result of an electrode impedance in parallel
 		    with a parasitic capacitance (i.e., due to the amplifier input capacitance and other
@@ -124,15 +216,37 @@ namespace RhythmNode
 			float desiredImpedanceFreq, 
 			bool& impedanceFreqValid);
 
-		/** Reads numBlocks blocks of raw USB data stored in a queue of Rhd2000DataBlock
-            objects, loads this data into this SignalProcessor object, scaling the raw
-			data to generate waveforms with units of volts or microvolts.*/
+		/** Chooses the test tones: the 1 kHz impedance frequency alone, or the spectroscopy
+		    frequencies rounded to harmonics of a fundamental whose period fits in the command RAM.
+		    Fills toneHarmonics, leaving it empty if no tone lies within the amplifier bandwidth,
+		    and returns the fundamental frequency (in Hz).*/
+		float selectTestTones(bool spectroscopy);
+
+		/** Reads numBlocks blocks of raw USB data through the block ring,
+            loads the selected amplifier channel of each data stream, scaling the raw
+			data to generate waveforms with units of microvolts.
+			Returns -1 if the board did not deliver all blocks.*/
 		int loadAmplifierData(
-			std::queue<Rhd2000DataBlock>& dataQueue,
+			Rhd2000BlockRing& blockRing,
 			int numBlocks, 
-			int numDataStreams);
+			int numDataStreams,
+			int chipChannel);
+
+		/** Waveforms of the channel under test, [sample][stream] */
+		std::vector<double> amplifierSamples;
+
+		/** Test tones as harmonics of the fundamental, and their starting phases (in radians) */
+		std::vector<int> toneHarmonics;
+		std::vector<double> tonePhases;
+
+		/** Reference waveforms of the test tones, [tone][sample], starting at sample referenceStart */
+		std::vector<double> referenceCos;
+		std::vector<double> referenceSin;
+		int referenceStart;
+		int referenceLength;
 
-		std::vector<std::vector<std::vector<double>>> amplifierPreFilter;
+		/** Channel sampled by the next quick check, modulo IMPEDANCE_QUICK_CHECK_STRIDE */
+		int quickCheckOffset;
 
 		DeviceThread* board;
 
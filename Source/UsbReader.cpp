@@ -0,0 +1,207 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "UsbReader.h"
+
+using namespace RhythmNode;
+
+#define FIFO_TELEMETRY_PERIOD_MS 100
+
+UsbReader::UsbReader(Rhd2000EvalBoard* board_) :
+    Thread("Rhythm USB reader"),
+    board(board_),
+    numBuffers(0),
+    blockSizeInWords(0),
+    samplesPerBlock(0),
+    maxBlocksPerRead(1),
+    pollIntervalMs(1),
+    bytesPerBuffer(0),
+    writeCount(0),
+    readCount(0),
+    maxQueuedReads(0),
+    numOverruns(0),
+    numReadErrors(0),
+    numBlocksRead(0),
+    profiler(nullptr)
+{
+}
+
+UsbReader::~UsbReader()
+{
+    stopThread(1000);
+}
+
+void UsbReader::prepare(int numBuffers_,
+                        unsigned int blockSizeInWords_,
+                        int samplesPerBlock_,
+                        int maxBlocksPerRead_,
+                        int pollIntervalMs_)
+{
+    jassert(!isThreadRunning());
+
+    numBuffers = numBuffers_;
+    blockSizeInWords = blockSizeInWords_;
+    samplesPerBlock = samplesPerBlock_;
+    maxBlocksPerRead = jmax(1, maxBlocksPerRead_);
+    pollIntervalMs = jmax(1, pollIntervalMs_);
+    bytesPerBuffer = 2 * (size_t) blockSizeInWords * maxBlocksPerRead;
+
+    pool.malloc(numBuffers * bytesPerBuffer);
+    blocksInBuffer.calloc(numBuffers);
+
+    writeCount = 0;
+    readCount = 0;
+    maxQueuedReads = 0;
+    numOverruns = 0;
+    numReadErrors = 0;
+    numBlocksRead = 0;
+
+    readAvailable.reset();
+    spaceAvailable.reset();
+
+    telemetry.reset(FIFO_TELEMETRY_PERIOD_MS);
+}
+
+void UsbReader::run()
+{
+    const bool usb3 = board->isUSB3();
+
+    bool ringFull = false;
+
+    while (!threadShouldExit())
+    {
+        int64 written = writeCount.load(std::memory_order_relaxed);
+
+        if (written - readCount.load(std::memory_order_acquire) >= numBuffers)
+        {
+            // decoder is behind; leave the data in the board FIFO until a slot frees up
+            if (!ringFull)
+                numOverruns++;
+
+            ringFull = true;
+            spaceAvailable.wait(10);
+            continue;
+        }
+
+        ringFull = false;
+
+        int slot = int(written % numBuffers);
+        int numBlocks;
+        bool readFailed = false;
+
+        {
+            const ScopedLock lock(boardLock);
+
+            // one FIFO query per transfer, however many blocks it carries;
+            // it also latches the FPGA FIFO and DDR levels for telemetry
+            Rhd2000EvalBoard::FifoMetrics metrics;
+            board->readFifoMetrics(metrics);
+
+            telemetry.addReading(metrics, Time::getMillisecondCounterHiRes());
+
+            int blocksInFifo = int(metrics.numWordsInFifo / blockSizeInWords);
+
+            if (!usb3 && blocksInFifo == 0)
+                numBlocks = 0;
+            else
+                numBlocks = jlimit(1, maxBlocksPerRead, blocksInFifo);
+
+            if (numBlocks > 0)
+            {
+                uint64_t startTime = profiler != nullptr ? profiler->startTimer() : 0;
+
+                readFailed = !board->readRawDataBlockInto(pool + slot * bytesPerBuffer, numBlocks * samplesPerBlock);
+
+                if (profiler != nullptr && !readFailed)
+                    profiler->stopTimer(AcquisitionProfiler::PIPE_READ, startTime);
+            }
+        }
+
+        if (readFailed)
+        {
+            // back off outside the board lock rather than retrying at once
+            numReadErrors++;
+            wait(pollIntervalMs);
+            continue;
+        }
+
+        if (numBlocks == 0)
+        {
+            // USB2 reads must not exceed the FIFO contents; wait for a block to accumulate
+            wait(pollIntervalMs);
+            continue;
+        }
+
+        blocksInBuffer[slot] = numBlocks;
+        numBlocksRead += numBlocks;
+
+        writeCount.store(written + 1, std::memory_order_release);
+
+        int queued = int(written + 1 - readCount.load(std::memory_order_acquire));
+
+        if (queued > maxQueuedReads.load(std::memory_order_relaxed))
+            maxQueuedReads.store(queued, std::memory_order_relaxed);
+
+        readAvailable.signal();
+    }
+}
+
+const unsigned char* UsbReader::getNextRead(int timeoutMs, int& numBlocks)
+{
+    int64 read = readCount.load(std::memory_order_relaxed);
+
+    numBlocks = 0;
+
+    if (writeCount.load(std::memory_order_acquire) == read)
+    {
+        readAvailable.wait(timeoutMs);
+
+        if (writeCount.load(std::memory_order_acquire) == read)
+            return nullptr;
+    }
+
+    int slot = int(read % numBuffers);
+
+    numBlocks = blocksInBuffer[slot];
+
+    return pool + slot * bytesPerBuffer;
+}
+
+void UsbReader::releaseRead()
+{
+    readCount.store(readCount.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+    spaceAvailable.signal();
+}
+
+int UsbReader::getNumQueuedReads() const
+{
+    return int(writeCount.load(std::memory_order_acquire) - readCount.load(std::memory_order_acquire));
+}
+
+float UsbReader::getAverageBlocksPerRead() const
+{
+    int64 reads = writeCount.load();
+
+    return reads > 0 ? float(numBlocksRead.load()) / float(reads) : 0.0f;
+}
@@ -0,0 +1,151 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2020 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __USBREADER_H_5D3F0B17__
+#define __USBREADER_H_5D3F0B17__
+
+#include <DataThreadHeaders.h>
+
+#include <atomic>
+
+#include "rhythm-api/rhd2000evalboard.h"
+
+#include "FifoTelemetry.h"
+#include "AcquisitionProfiler.h"
+
+namespace RhythmNode
+{
+
+	/**
+		Pulls raw USB blocks from the board on its own thread.
+
+		Each read transfers as many whole blocks as the board FIFO holds,
+		up to maxBlocksPerRead, in a single pipe transaction. Reads land in
+		a pool of preallocated buffers and are handed to the acquisition
+		thread through a single-producer/single-consumer ring, so a USB
+		transfer is always in flight while the previous read is decoded.
+
+		If the ring is full, the reader waits for the consumer and counts
+		an overrun; no blocks are dropped (they stay in the board FIFO).
+		A failed pipe read is counted and retried after the poll interval.
+
+		All other access to the board during acquisition must hold
+		getBoardLock(), since the Opal Kelly API is not thread-safe.
+
+	*/
+	class UsbReader : public Thread
+	{
+	public:
+
+		/** Constructor */
+		UsbReader(Rhd2000EvalBoard* board);
+
+		/** Destructor */
+		~UsbReader();
+
+		/** Allocates the buffer pool and empties the ring; call before startThread().
+			pollIntervalMs is how long to wait before polling a USB2 FIFO that held less than one block,
+			or before retrying a failed read. */
+		void prepare(int numBuffers,
+					 unsigned int blockSizeInWords,
+					 int samplesPerBlock,
+					 int maxBlocksPerRead,
+					 int pollIntervalMs);
+
+		/** Reads blocks until the thread is asked to exit */
+		void run() override;
+
+		/** Returns the oldest unread transfer, waiting up to timeoutMs for one to arrive.
+			numBlocks receives the number of consecutive blocks it holds.
+			Returns nullptr if nothing is available. The data stays valid until releaseRead(). */
+		const unsigned char* getNextRead(int timeoutMs, int& numBlocks);
+
+		/** Returns the transfer obtained from getNextRead() to the pool */
+		void releaseRead();
+
+		/** Returns the number of transfers waiting to be decoded */
+		int getNumQueuedReads() const;
+
+		/** Returns the number of buffers in the pool */
+		int getCapacity() const { return numBuffers; }
+
+		/** Returns the largest number of blocks in a single transfer */
+		int getMaxBlocksPerRead() const { return maxBlocksPerRead; }
+
+		/** Returns the largest number of queued transfers since prepare() */
+		int getMaxQueuedReads() const { return maxQueuedReads.load(); }
+
+		/** Returns the number of times the ring filled up since prepare() */
+		int64 getNumOverruns() const { return numOverruns.load(); }
+
+		/** Returns the number of failed pipe reads since prepare() */
+		int64 getNumReadErrors() const { return numReadErrors.load(); }
+
+		/** Returns the average number of blocks per transfer since prepare() */
+		float getAverageBlocksPerRead() const;
+
+		/** Times each pipe read (nullptr to disable); call before startThread() */
+		void setProfiler(AcquisitionProfiler* profiler_) { profiler = profiler_; }
+
+		/** Board FIFO levels recorded before each transfer */
+		FifoTelemetry& getTelemetry() { return telemetry; }
+
+		/** Lock to hold while talking to the board from any other thread */
+		CriticalSection& getBoardLock() { return boardLock; }
+
+	private:
+
+		Rhd2000EvalBoard* board;
+
+		CriticalSection boardLock;
+
+		HeapBlock<unsigned char> pool;
+		HeapBlock<int> blocksInBuffer;
+		int numBuffers;
+		unsigned int blockSizeInWords;
+		int samplesPerBlock;
+		int maxBlocksPerRead;
+		int pollIntervalMs;
+		size_t bytesPerBuffer;
+
+		/** Monotonic transfer counters; the slot is the counter modulo numBuffers */
+		std::atomic<int64> writeCount;
+		std::atomic<int64> readCount;
+
+		std::atomic<int> maxQueuedReads;
+		std::atomic<int64> numOverruns;
+		std::atomic<int64> numReadErrors;
+		std::atomic<int64> numBlocksRead;
+
+		WaitableEvent readAvailable;
+		WaitableEvent spaceAvailable;
+
+		FifoTelemetry telemetry;
+
+		AcquisitionProfiler* profiler;
+
+		JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(UsbReader);
+	};
+
+}
+#endif  // __USBREADER_H_5D3F0B17__
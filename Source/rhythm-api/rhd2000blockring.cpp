@@ -0,0 +1,153 @@
+//----------------------------------------------------------------------------------
+// rhd2000blockring.cpp
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000BlockRing Class
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+
+#include "rhd2000blockring.h"
+#include "rhd2000datablock.h"
+#include "rhd2000evalboard.h"
+
+Rhd2000BlockRing::Rhd2000BlockRing(Rhd2000EvalBoard* board_, int numSlots_, int blocksPerRead_) :
+    board(board_),
+    numSlots(std::max(1, numSlots_)),
+    writeCount(0),
+    readCount(0),
+    releaseCount(0),
+    blocksToRead(0),
+    reading(false),
+    exiting(false)
+{
+    blocksPerRead = std::max(1, std::min(blocksPerRead_, numSlots));
+    numDataStreams = board->getNumEnabledDataStreams();
+    samplesPerBlock = SAMPLES_PER_DATA_BLOCK(board->isUSB3());
+    blockSizeInWords = Rhd2000DataBlock::calculateDataBlockSizeInWords(numDataStreams, board->isUSB3());
+
+    slots.resize((size_t) numSlots * 2 * blockSizeInWords);
+
+    reader = std::thread(&Rhd2000BlockRing::run, this);
+}
+
+Rhd2000BlockRing::~Rhd2000BlockRing()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        exiting = true;
+    }
+    workAvailable.notify_all();
+    reader.join();
+}
+
+void Rhd2000BlockRing::readBlocks(int numBlocks)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        blocksToRead += numBlocks;
+    }
+    workAvailable.notify_all();
+}
+
+bool Rhd2000BlockRing::getNextBlock(Rhd2000BlockView& block, int timeoutMs)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    if (!blocksAvailable.wait_for(guard, std::chrono::milliseconds(timeoutMs),
+        [this] { return writeCount > readCount || (blocksToRead == 0 && !reading); })
+        || writeCount == readCount)
+        return false;
+
+    int slot = int(readCount % numSlots);
+    block = Rhd2000BlockView(&slots[(size_t) slot * 2 * blockSizeInWords], numDataStreams, samplesPerBlock);
+    ++readCount;
+
+    return true;
+}
+
+void Rhd2000BlockRing::releaseBlock()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        releaseCount = readCount;
+    }
+    workAvailable.notify_all();
+}
+
+void Rhd2000BlockRing::cancel()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    blocksToRead = 0;
+    blocksAvailable.wait(guard, [this] { return !reading; });
+
+    readCount = writeCount;
+    releaseCount = writeCount;
+}
+
+int Rhd2000BlockRing::getNumPendingBlocks() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return int(writeCount - readCount) + blocksToRead;
+}
+
+void Rhd2000BlockRing::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (!exiting)
+    {
+        int freeSlots = numSlots - int(writeCount - releaseCount);
+
+        if (blocksToRead == 0 || freeSlots == 0)
+        {
+            workAvailable.wait(guard);
+            continue;
+        }
+
+        // a chunk fills consecutive slots, so it cannot wrap around the end of the ring
+        int slot = int(writeCount % numSlots);
+        int numBlocks = std::min(std::min(blocksToRead, blocksPerRead), std::min(freeSlots, numSlots - slot));
+        unsigned char* buffer = &slots[(size_t) slot * 2 * blockSizeInWords];
+
+        reading = true;
+        guard.unlock();
+
+        // take whatever whole blocks the FIFO already holds, up to a full chunk
+        bool transferred = false;
+        {
+            std::lock_guard<std::mutex> boardGuard(boardLock);
+
+            numBlocks = std::min(numBlocks, int(board->numWordsInFifo() / blockSizeInWords));
+
+            if (numBlocks > 0)
+                transferred = board->readRawDataBlockInto(buffer, numBlocks * samplesPerBlock);
+        }
+
+        guard.lock();
+        reading = false;
+
+        // a transfer that completes after cancel() is discarded
+        if (transferred && blocksToRead > 0)
+        {
+            writeCount += numBlocks;
+            blocksToRead -= std::min(numBlocks, blocksToRead);
+        }
+
+        blocksAvailable.notify_all();
+
+        // wait for the board to produce the next block
+        if (!transferred && blocksToRead > 0)
+            workAvailable.wait_for(guard, std::chrono::milliseconds(BLOCK_RING_POLL_INTERVAL_MS));
+    }
+}
@@ -0,0 +1,109 @@
+//----------------------------------------------------------------------------------
+// rhd2000blockring.h
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000BlockRing Class Header File
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+
+#ifndef RHD2000BLOCKRING_H
+#define RHD2000BLOCKRING_H
+
+// How often the reader checks the board FIFO while waiting for a chunk to arrive
+#define BLOCK_RING_POLL_INTERVAL_MS 1
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "rhd2000blockview.h"
+
+class Rhd2000EvalBoard;
+
+// Pipelined replacement for Rhd2000EvalBoard::readDataBlocks().
+//
+// The ring preallocates numSlots buffers of one USB data block each.  readBlocks() hands a
+// request to a reader thread, which moves the blocks off the board as they reach the FIFO,
+// up to blocksPerRead blocks per pipe transaction, each chunk landing in consecutive slots.
+// The caller takes the blocks in order with getNextBlock(), which returns a view of the
+// slot rather than a copy, and gives the slot back with releaseBlock().  While the caller
+// works through one chunk the reader is already transferring the next, and nothing is
+// allocated after construction.
+//
+// The ring is sized for the board's stream count and USB mode at construction.  While a
+// request is pending, any other access to the board must hold getBoardLock(), since the
+// reader talks to the board from its own thread.
+
+class Rhd2000BlockRing
+{
+
+public:
+    Rhd2000BlockRing(Rhd2000EvalBoard* board, int numSlots, int blocksPerRead);
+    ~Rhd2000BlockRing();
+
+    // Queues numBlocks blocks to be read as soon as they are in the board FIFO
+    void readBlocks(int numBlocks);
+
+    // Waits up to timeoutMs for the next block and points block at it.  The view stays valid
+    // until releaseBlock().  Returns false if no block arrived or none was requested.
+    bool getNextBlock(Rhd2000BlockView& block, int timeoutMs);
+
+    // Returns the slot obtained from getNextBlock() to the ring
+    void releaseBlock();
+
+    // Drops requested blocks that have not been read yet and all unreleased blocks; blocks
+    // that were not read stay in the board FIFO
+    void cancel();
+
+    // Number of blocks requested but not yet returned by getNextBlock()
+    int getNumPendingBlocks() const;
+
+    int getNumSlots() const { return numSlots; }
+    int getBlocksPerRead() const { return blocksPerRead; }
+
+    std::mutex& getBoardLock() { return boardLock; }
+
+private:
+    Rhd2000EvalBoard* board;
+
+    int numSlots;
+    int blocksPerRead;
+    int numDataStreams;
+    int samplesPerBlock;
+    unsigned int blockSizeInWords;
+
+    std::vector<unsigned char> slots;
+
+    mutable std::mutex lock;
+    std::condition_variable blocksAvailable;  // reader -> consumer
+    std::condition_variable workAvailable;    // consumer -> reader
+
+    std::mutex boardLock;
+
+    // Monotonic block counters; the slot of a block is its counter modulo numSlots
+    uint64_t writeCount;
+    uint64_t readCount;
+    uint64_t releaseCount;
+
+    int blocksToRead;
+    bool reading;       // a pipe transfer is in progress
+    bool exiting;
+
+    std::thread reader;
+
+    void run();
+
+    Rhd2000BlockRing(const Rhd2000BlockRing&);
+    Rhd2000BlockRing& operator=(const Rhd2000BlockRing&);
+};
+
+#endif // RHD2000BLOCKRING_H
@@ -0,0 +1,52 @@
+//----------------------------------------------------------------------------------
+// rhd2000blockview.cpp
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000BlockView Class
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+
+#include "rhd2000blockview.h"
+#include "rhd2000datablock.h"
+
+Rhd2000BlockView::Rhd2000BlockView() :
+    buffer(0),
+    numDataStreams(0),
+    numSamples(0),
+    frameSize(0),
+    adcOffset(0)
+{
+}
+
+Rhd2000BlockView::Rhd2000BlockView(const unsigned char* buffer_, int numDataStreams_, int numSamples_) :
+    buffer(buffer_),
+    numDataStreams(numDataStreams_),
+    numSamples(numSamples_)
+{
+    frameSize = 2 * Rhd2000DataBlock::calculateDataBlockSizeInWords(numDataStreams, false, 1);
+    adcOffset = 12 + 2 * (size_t) 36 * numDataStreams; // aux, amplifier and filler words
+}
+
+bool Rhd2000BlockView::hasValidHeader(int t) const
+{
+    const unsigned char* p = frame(t);
+    uint64_t header = 0;
+
+    for (int i = 7; i >= 0; --i)
+        header = (header << 8) | p[i];
+
+    return header == RHD2000_HEADER_MAGIC_NUMBER;
+}
+
+int Rhd2000BlockView::countValidFrames() const
+{
+    bool contiguous;
+    return Rhd2000DataBlock::checkUsbBlock(buffer, numDataStreams, numSamples, 0, contiguous);
+}
@@ -0,0 +1,130 @@
+//----------------------------------------------------------------------------------
+// rhd2000blockview.h
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000BlockView Class Header File
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+
+#ifndef RHD2000BLOCKVIEW_H
+#define RHD2000BLOCKVIEW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Read-only view of raw USB frames, as read from the Rhythm pipe.
+//
+// Words are converted when they are accessed, so a caller that needs a few aux results
+// or a single channel does not pay for decoding the whole block into an Rhd2000DataBlock.
+// The view does not own the buffer: it is valid only as long as the buffer is, which for
+// buffers filled by Rhd2000EvalBoard means until the next read from the board.
+//
+// The frame layout is documented in Rhd2000DataBlock::fillFromUsbBuffer().
+
+class Rhd2000BlockView
+{
+
+public:
+    // Iterates over one word position in consecutive frames
+    class SampleIterator
+    {
+    public:
+        SampleIterator(const unsigned char* ptr_, size_t frameSize_) : ptr(ptr_), frameSize(frameSize_) {}
+
+        uint16_t operator*() const { return (uint16_t) (ptr[0] | (ptr[1] << 8)); }
+        uint16_t operator[](ptrdiff_t t) const { return *(*this + t); }
+
+        SampleIterator& operator++() { ptr += frameSize; return *this; }
+        SampleIterator operator++(int) { SampleIterator old(*this); ptr += frameSize; return old; }
+        SampleIterator& operator+=(ptrdiff_t n) { ptr += n * (ptrdiff_t) frameSize; return *this; }
+        SampleIterator operator+(ptrdiff_t n) const { SampleIterator it(*this); return it += n; }
+        ptrdiff_t operator-(const SampleIterator& other) const { return (ptr - other.ptr) / (ptrdiff_t) frameSize; }
+
+        bool operator==(const SampleIterator& other) const { return ptr == other.ptr; }
+        bool operator!=(const SampleIterator& other) const { return ptr != other.ptr; }
+
+    private:
+        const unsigned char* ptr;
+        size_t frameSize;
+    };
+
+    // The samples of one word position across the view
+    class SampleRange
+    {
+    public:
+        SampleRange(SampleIterator first_, SampleIterator last_) : first(first_), last(last_) {}
+
+        SampleIterator begin() const { return first; }
+        SampleIterator end() const { return last; }
+        uint16_t operator[](ptrdiff_t t) const { return first[t]; }
+        size_t size() const { return (size_t) (last - first); }
+
+    private:
+        SampleIterator first;
+        SampleIterator last;
+    };
+
+    Rhd2000BlockView();
+    Rhd2000BlockView(const unsigned char* buffer, int numDataStreams, int numSamples);
+
+    const unsigned char* getBuffer() const { return buffer; }
+    int getNumDataStreams() const { return numDataStreams; }
+    int getNumSamples() const { return numSamples; }
+    size_t getFrameSizeInBytes() const { return frameSize; }
+
+    // True if frame t starts with the Rhythm header magic number
+    bool hasValidHeader(int t) const;
+
+    // Number of frames from the start of the view that have a valid header
+    int countValidFrames() const;
+
+    uint32_t timeStamp(int t) const
+    {
+        const unsigned char* p = frame(t) + 8;
+        return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
+    uint16_t auxiliaryData(int t, int stream, int slot) const { return word(frame(t) + auxOffset(stream, slot)); }
+    uint16_t amplifierData(int t, int stream, int channel) const { return word(frame(t) + ampOffset(stream, channel)); }
+    uint16_t boardAdcData(int t, int adc) const { return word(frame(t) + adcOffset + 2 * adc); }
+    uint16_t ttlIn(int t) const { return word(frame(t) + adcOffset + 16); }
+    uint16_t ttlOut(int t) const { return word(frame(t) + adcOffset + 18); }
+
+    SampleRange auxiliarySamples(int stream, int slot) const { return samples(auxOffset(stream, slot)); }
+    SampleRange amplifierSamples(int stream, int channel) const { return samples(ampOffset(stream, channel)); }
+    SampleRange boardAdcSamples(int adc) const { return samples(adcOffset + 2 * adc); }
+
+    // Amplifier words of one frame, [channel][stream] with getNumDataStreams() words per channel
+    const unsigned char* amplifierFrame(int t) const { return frame(t) + ampOffset(0, 0); }
+
+private:
+    const unsigned char* buffer;
+    int numDataStreams;
+    int numSamples;
+    size_t frameSize;
+    size_t adcOffset;
+
+    const unsigned char* frame(int t) const { return buffer + (size_t) t * frameSize; }
+    static uint16_t word(const unsigned char* p) { return (uint16_t) (p[0] | (p[1] << 8)); }
+
+    // Byte offsets within a frame: 8-byte header, 4-byte timestamp, then aux and amplifier
+    // words interleaved across streams
+    size_t auxOffset(int stream, int slot) const { return 12 + 2 * ((size_t) slot * numDataStreams + stream); }
+    size_t ampOffset(int stream, int channel) const { return 12 + 2 * ((size_t) (3 + channel) * numDataStreams + stream); }
+
+    SampleRange samples(size_t offset) const
+    {
+        return SampleRange(SampleIterator(buffer + offset, frameSize),
+                           SampleIterator(buffer + offset + (size_t) numSamples * frameSize, frameSize));
+    }
+
+};
+
+#endif // RHD2000BLOCKVIEW_H
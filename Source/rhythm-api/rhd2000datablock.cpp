@@ -18,64 +18,236 @@
 // See http://www.intantech.com for documentation and product information.
 //----------------------------------------------------------------------------------
 
+#include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <algorithm>
+#include <mutex>
+#include <new>
 #include <vector>
 
 #include "rhd2000datablock.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RHD2000_CHECK_BLOCK_SSE2 1
+#include <emmintrin.h>
+#endif
+
 // This class creates a data structure storing SAMPLES_PER_DATA_BLOCK data frames
 // from a Rhythm FPGA interface controlling up to eight RHD2000 chips.
 
+namespace
+{
+    // Sample buffers of destroyed data blocks, handed out again to new blocks of the
+    // same size.  Blocks are created and destroyed on different threads (the acquisition
+    // thread, the impedance thread), so the free list is locked.
+    class DataBlockStoragePool
+    {
+    public:
+        ~DataBlockStoragePool()
+        {
+            for (size_t i = 0; i < freeBuffers.size(); ++i)
+                freeAligned(freeBuffers[i].words);
+        }
+
+        uint16_t* acquire(size_t numWords)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                for (size_t i = freeBuffers.size(); i-- > 0;) {
+                    if (freeBuffers[i].numWords == numWords) {
+                        uint16_t* words = freeBuffers[i].words;
+                        freeBuffers.erase(freeBuffers.begin() + i);
+                        freeBytes -= 2 * numWords;
+                        return words;
+                    }
+                }
+            }
+            return allocateAligned(numWords);
+        }
+
+        void release(uint16_t* words, size_t numWords)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (freeBytes + 2 * numWords <= DATA_BLOCK_POOL_MAX_BYTES) {
+                    FreeBuffer buffer = { words, numWords };
+                    freeBuffers.push_back(buffer);
+                    freeBytes += 2 * numWords;
+                    return;
+                }
+            }
+            freeAligned(words);
+        }
+
+    private:
+        struct FreeBuffer {
+            uint16_t* words;
+            size_t numWords;
+        };
+
+        std::mutex lock;
+        std::vector<FreeBuffer> freeBuffers;
+        size_t freeBytes = 0;
+
+        // The offset to the start of the raw allocation is kept in the word before the aligned pointer
+        static uint16_t* allocateAligned(size_t numWords)
+        {
+            unsigned char* raw = (unsigned char*) malloc(2 * numWords + DATA_BLOCK_ALIGNMENT);
+            if (raw == 0)
+                throw std::bad_alloc();
+            size_t offset = DATA_BLOCK_ALIGNMENT - ((uintptr_t) raw % DATA_BLOCK_ALIGNMENT);
+            uint16_t* words = (uint16_t*) (raw + offset);
+            words[-1] = (uint16_t) offset;
+            return words;
+        }
+
+        static void freeAligned(uint16_t* words)
+        {
+            free((unsigned char*) words - words[-1]);
+        }
+    };
+
+    DataBlockStoragePool& getStoragePool()
+    {
+        static DataBlockStoragePool pool;
+        return pool;
+    }
+}
+
 // Constructor.  Allocates memory for data block.
-Rhd2000DataBlock::Rhd2000DataBlock(int numDataStreams, bool usb3) : samplesPerBlock(SAMPLES_PER_DATA_BLOCK(usb3)), usb3(usb3)
+Rhd2000DataBlock::Rhd2000DataBlock(int numDataStreams_, bool usb3) :
+    storage(0),
+    numDataStreams(numDataStreams_),
+    samplesPerBlock(SAMPLES_PER_DATA_BLOCK(usb3)),
+    usb3(usb3)
 {
+    rowStride = (samplesPerBlock + DATA_BLOCK_ROW_WORDS - 1) / DATA_BLOCK_ROW_WORDS * DATA_BLOCK_ROW_WORDS;
+    allocate();
+    memset(storage, 0, 2 * getStorageSizeInWords());
+}
 
-    //std::cout << "New data block with " << numDataStreams << " streams." << std::endl;
-    allocateUIntArray1D(timeStamp, samplesPerBlock);
-    allocateIntArray3D(amplifierData, numDataStreams, 32, samplesPerBlock);
-    allocateIntArray3D(auxiliaryData, numDataStreams, 3, samplesPerBlock);
-    allocateIntArray2D(boardAdcData, 8, samplesPerBlock);
-    allocateIntArray1D(ttlIn, samplesPerBlock);
-    allocateIntArray1D(ttlOut, samplesPerBlock);
+Rhd2000DataBlock::Rhd2000DataBlock(const Rhd2000DataBlock& other) :
+    storage(0),
+    numDataStreams(other.numDataStreams),
+    rowStride(other.rowStride),
+    samplesPerBlock(other.samplesPerBlock),
+    usb3(other.usb3)
+{
+    allocate();
+    memcpy(storage, other.storage, 2 * getStorageSizeInWords());
 }
 
-// Allocates memory for a 1-D array of integers.
-void Rhd2000DataBlock::allocateIntArray1D(std::vector<int> &array1D, int xSize)
+Rhd2000DataBlock::Rhd2000DataBlock(Rhd2000DataBlock&& other) noexcept :
+    storage(other.storage),
+    numDataStreams(other.numDataStreams),
+    rowStride(other.rowStride),
+    samplesPerBlock(other.samplesPerBlock),
+    usb3(other.usb3)
 {
-    array1D.resize(xSize);
+    other.storage = 0;
+    other.bindViews();
+    bindViews();
 }
 
-// Allocates memory for a 1-D array of unsigned integers.
-void Rhd2000DataBlock::allocateUIntArray1D(std::vector<unsigned int> &array1D, int xSize)
+Rhd2000DataBlock::~Rhd2000DataBlock()
 {
-    array1D.resize(xSize);
+    release();
 }
 
-// Allocates memory for a 2-D array of integers.
-void Rhd2000DataBlock::allocateIntArray2D(std::vector<std::vector<int> > & array2D, int xSize, int ySize)
+Rhd2000DataBlock& Rhd2000DataBlock::operator=(const Rhd2000DataBlock& other)
 {
-    int i;
+    if (this == &other)
+        return *this;
+
+    if (storage == 0 || getStorageSizeInWords() != other.getStorageSizeInWords()) {
+        release();
+        numDataStreams = other.numDataStreams;
+        rowStride = other.rowStride;
+        allocate();
+    }
+    numDataStreams = other.numDataStreams;
+    rowStride = other.rowStride;
+    samplesPerBlock = other.samplesPerBlock;
+    usb3 = other.usb3;
+    bindViews();
+
+    memcpy(storage, other.storage, 2 * getStorageSizeInWords());
+    return *this;
+}
 
-    array2D.resize(xSize);
-    for (i = 0; i < xSize; ++i)
-        array2D[i].resize(ySize);
+Rhd2000DataBlock& Rhd2000DataBlock::operator=(Rhd2000DataBlock&& other) noexcept
+{
+    if (this == &other)
+        return *this;
+
+    release();
+    storage = other.storage;
+    numDataStreams = other.numDataStreams;
+    rowStride = other.rowStride;
+    samplesPerBlock = other.samplesPerBlock;
+    usb3 = other.usb3;
+    bindViews();
+
+    other.storage = 0;
+    other.bindViews();
+    return *this;
 }
 
-// Allocates memory for a 3-D array of integers.
-void Rhd2000DataBlock::allocateIntArray3D(std::vector<std::vector<std::vector<int> > > &array3D, int xSize, int ySize, int zSize)
+// Number of words in the sample buffer: amplifier and auxiliary rows for each stream,
+// 8 ADC rows, TTL in and out rows, and 32-bit timestamps (two rows).
+size_t Rhd2000DataBlock::getStorageSizeInWords() const
 {
-    int i, j;
+    return (size_t) rowStride * (numDataStreams * (32 + 3) + 8 + 2 + 2);
+}
 
-    array3D.resize(xSize);
-    for (i = 0; i < xSize; ++i) {
-        array3D[i].resize(ySize);
+void Rhd2000DataBlock::allocate()
+{
+    storage = getStoragePool().acquire(getStorageSizeInWords());
+    bindViews();
+}
 
-        for (j = 0; j < ySize; ++j) {
-            array3D[i][j].resize(zSize);
-        }
+void Rhd2000DataBlock::release()
+{
+    if (storage != 0)
+        getStoragePool().release(storage, getStorageSizeInWords());
+    storage = 0;
+    bindViews();
+}
+
+// Points the public arrays at their regions of the sample buffer.
+void Rhd2000DataBlock::bindViews()
+{
+    if (storage == 0) {
+        timeStamp = SampleSpan<uint32_t>();
+        amplifierData = StreamArray();
+        auxiliaryData = StreamArray();
+        boardAdcData = ChannelArray();
+        ttlIn = SampleSpan<uint16_t>();
+        ttlOut = SampleSpan<uint16_t>();
+        return;
     }
+
+    uint16_t* region = storage;
+
+    amplifierData = StreamArray(region, numDataStreams, 32, samplesPerBlock, rowStride);
+    region += (size_t) numDataStreams * 32 * rowStride;
+
+    auxiliaryData = StreamArray(region, numDataStreams, 3, samplesPerBlock, rowStride);
+    region += (size_t) numDataStreams * 3 * rowStride;
+
+    boardAdcData = ChannelArray(region, 8, samplesPerBlock, rowStride);
+    region += 8 * rowStride;
+
+    ttlIn = SampleSpan<uint16_t>(region, samplesPerBlock);
+    region += rowStride;
+
+    ttlOut = SampleSpan<uint16_t>(region, samplesPerBlock);
+    region += rowStride;
+
+    timeStamp = SampleSpan<uint32_t>((uint32_t*) region, samplesPerBlock);
 }
 
 // Returns the number of samples in a USB data block.
@@ -93,7 +265,7 @@ unsigned int Rhd2000DataBlock::calculateDataBlockSizeInWords(int numDataStreams,
 }
 
 // Check first 64 bits of USB header against the fixed Rhythm "magic number" to verify data sync.
-bool Rhd2000DataBlock::checkUsbHeader(unsigned char usbBuffer[], int index)
+bool Rhd2000DataBlock::checkUsbHeader(const unsigned char usbBuffer[], int index)
 {
     unsigned long long x1, x2, x3, x4, x5, x6, x7, x8;
     unsigned long long header;
@@ -113,7 +285,7 @@ bool Rhd2000DataBlock::checkUsbHeader(unsigned char usbBuffer[], int index)
 }
 
 // Read 32-bit time stamp from USB data frame.
-unsigned int Rhd2000DataBlock::convertUsbTimeStamp(unsigned char usbBuffer[], int index)
+unsigned int Rhd2000DataBlock::convertUsbTimeStamp(const unsigned char usbBuffer[], int index)
 {
     unsigned int x1, x2, x3, x4;
     x1 = usbBuffer[index];
@@ -124,6 +296,71 @@ unsigned int Rhd2000DataBlock::convertUsbTimeStamp(unsigned char usbBuffer[], in
     return (x4 << 24) + (x3 << 16) + (x2 << 8) + (x1 << 0);
 }
 
+// Check the headers of a run of frames and extract their time stamps in a single pass.
+int Rhd2000DataBlock::checkUsbBlock(const unsigned char usbBuffer[], int numDataStreams, int nSamples,
+                                    uint32_t timeStamps[], bool& contiguous)
+{
+    const int frameSize = 2 * calculateDataBlockSizeInWords(numDataStreams, false, 1);
+    uint32_t previous = nSamples > 0 ? convertUsbTimeStamp(usbBuffer, 8) - 1 : 0;
+    uint32_t gaps = 0; // nonzero once a time stamp breaks the sequence
+    int t = 0;
+
+#ifdef RHD2000_CHECK_BLOCK_SSE2
+    // Four frames at a time: transposing the first 16 bytes of each frame puts the low and
+    // high halves of the magic numbers and the time stamps of all four in one register each.
+    const __m128i magicLow = _mm_set1_epi32((int) (uint32_t) RHD2000_HEADER_MAGIC_NUMBER);
+    const __m128i magicHigh = _mm_set1_epi32((int) (uint32_t) (RHD2000_HEADER_MAGIC_NUMBER >> 32));
+    const __m128i one = _mm_set1_epi32(1);
+    __m128i gapBits = _mm_setzero_si128();
+
+    for (; t + 4 <= nSamples; t += 4) {
+        const unsigned char* frame = usbBuffer + (size_t) t * frameSize;
+        __m128i f0 = _mm_loadu_si128((const __m128i*) frame);
+        __m128i f1 = _mm_loadu_si128((const __m128i*) (frame + frameSize));
+        __m128i f2 = _mm_loadu_si128((const __m128i*) (frame + 2 * frameSize));
+        __m128i f3 = _mm_loadu_si128((const __m128i*) (frame + 3 * frameSize));
+
+        __m128i lo01 = _mm_unpacklo_epi32(f0, f1);
+        __m128i lo23 = _mm_unpacklo_epi32(f2, f3);
+        __m128i hi01 = _mm_unpackhi_epi32(f0, f1);
+        __m128i hi23 = _mm_unpackhi_epi32(f2, f3);
+
+        __m128i valid = _mm_and_si128(_mm_cmpeq_epi32(_mm_unpacklo_epi64(lo01, lo23), magicLow),
+                                      _mm_cmpeq_epi32(_mm_unpackhi_epi64(lo01, lo23), magicHigh));
+        if (_mm_movemask_epi8(valid) != 0xffff)
+            break; // the scalar loop below finds the bad frame
+
+        // each time stamp should be one more than the one before it
+        __m128i stamps = _mm_unpacklo_epi64(hi01, hi23);
+        __m128i expected = _mm_add_epi32(_mm_or_si128(_mm_slli_si128(stamps, 4), _mm_cvtsi32_si128((int) previous)), one);
+        gapBits = _mm_or_si128(gapBits, _mm_xor_si128(stamps, expected));
+
+        if (timeStamps != 0)
+            _mm_storeu_si128((__m128i*) (timeStamps + t), stamps);
+
+        previous = (uint32_t) _mm_cvtsi128_si32(_mm_shuffle_epi32(stamps, _MM_SHUFFLE(3, 3, 3, 3)));
+    }
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(gapBits, _mm_setzero_si128())) != 0xffff)
+        gaps = 1;
+#endif
+
+    for (; t < nSamples; ++t) {
+        int index = t * frameSize;
+        if (!checkUsbHeader(usbBuffer, index))
+            break;
+
+        uint32_t stamp = convertUsbTimeStamp(usbBuffer, index + 8);
+        gaps |= stamp ^ (previous + 1);
+        if (timeStamps != 0)
+            timeStamps[t] = stamp;
+        previous = stamp;
+    }
+
+    contiguous = (gaps == 0);
+    return t;
+}
+
 // Convert two USB bytes into 16-bit word.
 int Rhd2000DataBlock::convertUsbWord(unsigned char usbBuffer[], int index)
 {
@@ -142,33 +379,41 @@ void Rhd2000DataBlock::fillFromUsbBuffer(unsigned char usbBuffer[], int blockInd
 {
     int index, t, channel, stream, i;
     int samplesToRead = nSamples <= 0 ? samplesPerBlock : nSamples;
-    int num = 0;
+    bool contiguous;
+
+    samplesToRead = std::min(samplesToRead, (int) samplesPerBlock);
+
+    uint16_t* aux = auxiliaryData.data();
+    uint16_t* amp = amplifierData.data();
+    uint16_t* adc = boardAdcData.data();
+    const size_t streamStrideAux = (size_t) 3 * rowStride;
+    const size_t streamStrideAmp = (size_t) 32 * rowStride;
 
     index = blockIndex * 2 * calculateDataBlockSizeInWords(numDataStreams, usb3);
-    for (t = 0; t < samplesToRead; ++t) {
-        if (!checkUsbHeader(usbBuffer, index)) {
-            std::cerr << "Error in Rhd2000EvalBoard::readDataBlock: Incorrect header." << std::endl;
-            break;
-        }
-        else
-            num++;
-        //else cerr << "Block ok" << std::endl;
+
+    // validate every header and fill in the time stamps up front
+    int numValid = checkUsbBlock(usbBuffer + index, numDataStreams, samplesToRead, timeStamp.data(), contiguous);
+    if (numValid < samplesToRead)
+        std::cerr << "Error in Rhd2000EvalBoard::readDataBlock: Incorrect header." << std::endl;
+
+    for (t = 0; t < numValid; ++t) {
         index += 8; // magic number header width (bytes)
-        timeStamp[t] = convertUsbTimeStamp(usbBuffer, index);
         index += 4; // timestamp width
 
         // Read auxiliary results
         for (channel = 0; channel < 3; ++channel) {
+            uint16_t* dest = aux + (size_t) channel * rowStride + t;
             for (stream = 0; stream < numDataStreams; ++stream) {
-                auxiliaryData[stream][channel][t] = convertUsbWord(usbBuffer, index);
+                dest[stream * streamStrideAux] = (uint16_t) convertUsbWord(usbBuffer, index);
                 index += 2;
             }
         }
 
         // Read amplifier channels
         for (channel = 0; channel < 32; ++channel) {
+            uint16_t* dest = amp + (size_t) channel * rowStride + t;
             for (stream = 0; stream < numDataStreams; ++stream) {
-                amplifierData[stream][channel][t] = convertUsbWord(usbBuffer, index);
+                dest[stream * streamStrideAmp] = (uint16_t) convertUsbWord(usbBuffer, index);
                 index += 2;
             }
         }
@@ -178,18 +423,17 @@ void Rhd2000DataBlock::fillFromUsbBuffer(unsigned char usbBuffer[], int blockInd
 
         // Read from AD5662 ADCs
         for (i = 0; i < 8; ++i) {
-            boardAdcData[i][t] = convertUsbWord(usbBuffer, index);
+            adc[(size_t) i * rowStride + t] = (uint16_t) convertUsbWord(usbBuffer, index);
             index += 2;
         }
 
         // Read TTL input and output values
-        ttlIn[t] = convertUsbWord(usbBuffer, index);
+        ttlIn[t] = (uint16_t) convertUsbWord(usbBuffer, index);
         index += 2;
 
-        ttlOut[t] = convertUsbWord(usbBuffer, index);
+        ttlOut[t] = (uint16_t) convertUsbWord(usbBuffer, index);
         index += 2;
     }
-    //std::cout << "Read " << num << " valid samples with " << numDataStreams << " streams. Usb mode status: " << usb3 << std::endl;
 }
 
 // Print the contents of RHD2000 registers from a selected USB data stream (0-7)
@@ -346,44 +590,40 @@ void Rhd2000DataBlock::print(int stream) const
     std::cout << std::endl;
 }
 
-// Write a 16-bit dataWord to an outputStream in "little endian" format (i.e., least significant
-// byte first).  We must do this explicitly for cross-platform consistency.  For example, Windows
-// is a little-endian OS, while Mac OS X and Linux can be little-endian or big-endian depending on
-// the processor running the operating system.
+// Write contents of data block to a binary output stream (saveOut) in little endian format
+// (i.e., least significant byte first).  We must do this explicitly for cross-platform
+// consistency.  For example, Windows is a little-endian OS, while Mac OS X and Linux can be
+// little-endian or big-endian depending on the processor running the operating system.
 //
 // (See "Endianness" article in Wikipedia for more information.)
-void Rhd2000DataBlock::writeWordLittleEndian(std::ofstream &outputStream, int dataWord) const
-{
-    unsigned short msb, lsb;
-
-    lsb = ((unsigned short) dataWord) & 0x00ff;
-    msb = (((unsigned short) dataWord) & 0xff00) >> 8;
-
-    outputStream << (unsigned char) lsb;
-    outputStream << (unsigned char) msb;
-}
-
-// Write contents of data block to a binary output stream (saveOut) in little endian format.
+//
+// The block is assembled in memory and written with a single call.
 void Rhd2000DataBlock::write(std::ofstream &saveOut, int numDataStreams) const
 {
     int t, channel, stream, i;
+    const size_t wordsPerSample = 1 + 35 * (size_t) numDataStreams + 8 + 2;
+
+    std::vector<unsigned char> bytes(2 * wordsPerSample * samplesPerBlock);
+    unsigned char* out = bytes.data();
 
-    for (t = 0; t < samplesPerBlock; ++t) {
-        writeWordLittleEndian(saveOut, timeStamp[t]);
+    for (t = 0; t < (int) samplesPerBlock; ++t) {
+        out = putWordLittleEndian(out, timeStamp[t]);
         for (channel = 0; channel < 32; ++channel) {
             for (stream = 0; stream < numDataStreams; ++stream) {
-                writeWordLittleEndian(saveOut, amplifierData[stream][channel][t]);
+                out = putWordLittleEndian(out, amplifierData[stream][channel][t]);
             }
         }
         for (channel = 0; channel < 3; ++channel) {
             for (stream = 0; stream < numDataStreams; ++stream) {
-                writeWordLittleEndian(saveOut, auxiliaryData[stream][channel][t]);
+                out = putWordLittleEndian(out, auxiliaryData[stream][channel][t]);
             }
         }
         for (i = 0; i < 8; ++i) {
-            writeWordLittleEndian(saveOut, boardAdcData[i][t]);
+            out = putWordLittleEndian(out, boardAdcData[i][t]);
         }
-        writeWordLittleEndian(saveOut, ttlIn[t]);
-        writeWordLittleEndian(saveOut, ttlOut[t]);
+        out = putWordLittleEndian(out, ttlIn[t]);
+        out = putWordLittleEndian(out, ttlOut[t]);
     }
+
+    saveOut.write((const char*) bytes.data(), bytes.size());
 }
@@ -27,19 +27,114 @@
 #define MAX_SAMPLES_PER_DATA_BLOCK (SAMPLES_PER_DATA_BLOCK_USB3 > SAMPLES_PER_DATA_BLOCK_USB2 ? SAMPLES_PER_DATA_BLOCK_USB3 : SAMPLES_PER_DATA_BLOCK_USB2)
 #define RHD2000_HEADER_MAGIC_NUMBER 0xc691199927021942
 
+// Rows of sample words start on a 64-byte boundary
+#define DATA_BLOCK_ALIGNMENT 64
+#define DATA_BLOCK_ROW_WORDS (DATA_BLOCK_ALIGNMENT / 2)
+
+// Upper bound on the sample storage kept for reuse by later data blocks
+#define DATA_BLOCK_POOL_MAX_BYTES (32 * 1024 * 1024)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <iosfwd>
+
 class Rhd2000EvalBoard;
 
+// All sample words of a block live in one contiguous, 64-byte aligned buffer laid out
+// as [stream][channel][sample], so each channel is a single aligned run of samples.
+// The buffer comes from a process-wide pool and goes back to it when the block is
+// destroyed, so blocks that are created and discarded repeatedly (impedance runs,
+// port scans) do not hit the heap after the first measurement.
+//
+// The public arrays are views into that buffer and keep the indexing of the nested
+// vectors they replace: amplifierData[stream][channel][t], boardAdcData[adc][t], ttlIn[t].
+
 class Rhd2000DataBlock
 {
 public:
+    // Contiguous run of samples
+    template <typename T>
+    class SampleSpan
+    {
+    public:
+        SampleSpan() : ptr(0), length(0) {}
+        SampleSpan(T* ptr_, size_t length_) : ptr(ptr_), length(length_) {}
+
+        T& operator[](size_t t) const { return ptr[t]; }
+        T* data() const { return ptr; }
+        T* begin() const { return ptr; }
+        T* end() const { return ptr + length; }
+        size_t size() const { return length; }
+
+    private:
+        T* ptr;
+        size_t length;
+    };
+
+    // [channel][sample] rows, each rowStride words apart
+    class ChannelArray
+    {
+    public:
+        ChannelArray() : ptr(0), numChannels(0), numSamples(0), rowStride(0) {}
+        ChannelArray(uint16_t* ptr_, int numChannels_, int numSamples_, int rowStride_) :
+            ptr(ptr_), numChannels(numChannels_), numSamples(numSamples_), rowStride(rowStride_) {}
+
+        SampleSpan<uint16_t> operator[](int channel) const
+        {
+            return SampleSpan<uint16_t>(ptr + (size_t) channel * rowStride, numSamples);
+        }
+        uint16_t* data() const { return ptr; }
+        size_t size() const { return numChannels; }
+
+    private:
+        uint16_t* ptr;
+        int numChannels;
+        int numSamples;
+        int rowStride;
+    };
+
+    // [stream][channel][sample]
+    class StreamArray
+    {
+    public:
+        StreamArray() : ptr(0), numStreams(0), numChannels(0), numSamples(0), rowStride(0) {}
+        StreamArray(uint16_t* ptr_, int numStreams_, int numChannels_, int numSamples_, int rowStride_) :
+            ptr(ptr_), numStreams(numStreams_), numChannels(numChannels_), numSamples(numSamples_), rowStride(rowStride_) {}
+
+        ChannelArray operator[](int stream) const
+        {
+            return ChannelArray(ptr + (size_t) stream * numChannels * rowStride, numChannels, numSamples, rowStride);
+        }
+        uint16_t* data() const { return ptr; }
+        size_t size() const { return numStreams; }
+
+    private:
+        uint16_t* ptr;
+        int numStreams;
+        int numChannels;
+        int numSamples;
+        int rowStride;
+    };
+
     Rhd2000DataBlock(int numDataStreams, bool usb3);
+    Rhd2000DataBlock(const Rhd2000DataBlock& other);
+    Rhd2000DataBlock(Rhd2000DataBlock&& other) noexcept;
+    ~Rhd2000DataBlock();
 
-    std::vector<unsigned int> timeStamp;
-    std::vector<std::vector<std::vector<int> > > amplifierData;
-    std::vector<std::vector<std::vector<int> > > auxiliaryData;
-    std::vector<std::vector<int> > boardAdcData;
-    std::vector<int> ttlIn;
-    std::vector<int> ttlOut;
+    Rhd2000DataBlock& operator=(const Rhd2000DataBlock& other);
+    Rhd2000DataBlock& operator=(Rhd2000DataBlock&& other) noexcept;
+
+    SampleSpan<uint32_t> timeStamp;
+    StreamArray amplifierData;
+    StreamArray auxiliaryData;
+    ChannelArray boardAdcData;
+    SampleSpan<uint16_t> ttlIn;
+    SampleSpan<uint16_t> ttlOut;
+
+    int getNumDataStreams() const { return numDataStreams; }
+
+    // Distance in words between consecutive channel rows (samplesPerBlock rounded up to 64 bytes)
+    int getRowStride() const { return rowStride; }
 
     static unsigned int calculateDataBlockSizeInWords(int numDataStreams, bool usb3, int nSamples = -1);
     static unsigned int getSamplesPerDataBlock(bool usb3);
@@ -47,20 +142,35 @@ public:
     void print(int stream) const;
     void write(std::ofstream &saveOut, int numDataStreams) const;
 
-    static bool checkUsbHeader(unsigned char usbBuffer[], int index);
-    static unsigned int convertUsbTimeStamp(unsigned char usbBuffer[], int index);
+    static bool checkUsbHeader(const unsigned char usbBuffer[], int index);
+    static unsigned int convertUsbTimeStamp(const unsigned char usbBuffer[], int index);
+
+    // Checks the header of each of nSamples consecutive frames and copies out their timestamps.
+    // Returns the index of the first frame with a bad header (nSamples if all are good).
+    // timeStamps, if not null, receives the timestamps of the frames before that one, and
+    // contiguous is set if each of those timestamps is one more than the one before it.
+    static int checkUsbBlock(const unsigned char usbBuffer[], int numDataStreams, int nSamples,
+                             uint32_t timeStamps[], bool& contiguous);
     static int convertUsbWord(unsigned char usbBuffer[], int index);
 
 private:
-    void allocateIntArray3D(std::vector<std::vector<std::vector<int> > > &array3D, int xSize, int ySize, int zSize);
-    void allocateIntArray2D(std::vector<std::vector<int> > &array2D, int xSize, int ySize);
-    void allocateIntArray1D(std::vector<int> &array1D, int xSize);
-    void allocateUIntArray1D(std::vector<unsigned int> &array1D, int xSize);
+    void allocate();
+    void release();
+    void bindViews();
+    size_t getStorageSizeInWords() const;
 
-    void writeWordLittleEndian(std::ofstream &outputStream, int dataWord) const;
+    static unsigned char* putWordLittleEndian(unsigned char* out, unsigned int dataWord)
+    {
+        out[0] = (unsigned char) (dataWord & 0x00ff);
+        out[1] = (unsigned char) ((dataWord & 0xff00) >> 8);
+        return out + 2;
+    }
 
+    uint16_t* storage;
+    int numDataStreams;
+    int rowStride;
 
-    const unsigned int samplesPerBlock;
+    unsigned int samplesPerBlock;
     bool usb3;
 };
 
@@ -26,25 +26,30 @@
 #include <vector>
 #include <queue>
 #include <cmath>
+#include <algorithm>
+#include <thread>
 
 #include "rhd2000evalboard.h"
+#include "rhd2000blockview.h"
 #include "rhd2000datablock.h"
-
-#include "okFrontPanelDLL.h"
-
-using namespace OpalKellyLegacy;
+#include "rhd2000transport.h"
 
 // This class provides access to and control of the Opal Kelly XEM6010 USB/FPGA
-// interface board running the Rhythm interface Verilog code.
+// interface board running the Rhythm interface Verilog code.  All USB traffic goes
+// through a Rhd2000Transport, so the same code can also drive a simulated board.
 
 // Constructor.  Set sampling rate variable to 30.0 kS/s/channel (FPGA default).
-Rhd2000EvalBoard::Rhd2000EvalBoard()
+Rhd2000EvalBoard::Rhd2000EvalBoard(Rhd2000Transport *transport)
 {
     int i;
     sampleRate = SampleRate30000Hz; // Rhythm FPGA boots up with 30.0 kS/s/channel sampling rate
     numDataStreams = 0;
-    dev = 0;
+    dev = transport;
     usb3 = false;
+    maxTimeStep = 4294967295;
+    continuousRunMode = true;
+    configDepth = 0;
+    wireInsPending = false;
 
     MAX_NUM_DATA_STREAMS = MAX_NUM_DATA_STREAMS_USB3;
 
@@ -61,81 +66,24 @@ Rhd2000EvalBoard::~Rhd2000EvalBoard()
     if (dev != 0) delete dev;
 }
 
-// Find an Opal Kelly XEM6010-LX45 board attached to a USB port and open it.
+// Find a board attached to a USB port (or a simulated one) and open it.
 // Returns 1 if successful, -1 if FrontPanel cannot be loaded, and -2 if XEM6010 can't be found.
 int Rhd2000EvalBoard::open(const char* libname)
 {
-    char dll_date[32], dll_time[32];
-    std::string serialNumber = "";
-    int i, nDevices;
-
     std::cout << "---- Intan Technologies ---- Rhythm RHD2000 Controller v1.41 ----" << std::endl << std::endl;
-//    if (okFrontPanelDLL_LoadLib(libname) == false) {
-//        std::cerr << "FrontPanel DLL could not be loaded.  " <<
-//                "Make sure this DLL is in the application start directory." << std::endl;
-//        return -1;
-//    }
-
-    okFrontPanelDLL_GetVersion(dll_date, dll_time);
-
-    std::cout << std::endl << "FrontPanel DLL loaded.  Built: " << dll_date << "  " << dll_time << std::endl;
 
-    dev = new okCFrontPanel;
+    int result = dev->open(libname);
 
-    std::cout << std::endl << "Scanning USB for Opal Kelly devices..." << std::endl << std::endl;
-
-    nDevices = dev->GetDeviceCount(); // slow
-
-    std::cout << "Found " << nDevices << " Opal Kelly device" << ((nDevices == 1) ? "" : "s") <<
-            " connected:" << std::endl;
-
-    for (i = 0; i < nDevices; ++i) {
-        std::cout << "  Device #" << i + 1 << ": Opal Kelly " <<
-                opalKellyModelName(dev->GetDeviceListModel(i)).c_str() <<
-                " with serial number " << dev->GetDeviceListSerial(i).c_str() << std::endl;
+    if (result != 1) {
+        usb3 = false;
+        return result;
     }
 
-    std::cout << std::endl;
-
-	for (i = 0; i < nDevices; ++i)
-	{
-        okCFrontPanel::BoardModel model = dev->GetDeviceListModel(i);
-
-        if (model == OK_PRODUCT_XEM6010LX45 || model == OK_PRODUCT_XEM6310LX45) //the two models we use
-		{
-			serialNumber = serialNumber = dev->GetDeviceListSerial(i);
-
-            std::cout << "Trying to open device with serial " << serialNumber.c_str() << std::endl;
-
-            if (dev->OpenBySerial(serialNumber) == okCFrontPanel::NoError) //
-			{
-				std::cout << "Device opened" << std::endl;
-				if (model == OK_PRODUCT_XEM6310LX45)
-					usb3 = true;
-				break; //end loop if one device was opened
-			}
-		}
-	}
-	if (!dev->IsOpen())
-	{
-		delete dev;
-        dev = 0;
-        usb3 = false;
-		std::cerr << "No device could be opened.  Is one connected?" << std::endl;
-		return -2;
-	}
+    usb3 = dev->isUSB3();
 
     MAX_NUM_DATA_STREAMS = usb3 ? MAX_NUM_DATA_STREAMS_USB3 : MAX_NUM_DATA_STREAMS_USB2;
 
-    // Configure the on-board PLL appropriately.
-    dev->LoadDefaultPLLConfiguration();
-
-    // Get some general information about the XEM.
-    std::cout << "FPGA system clock: " << getSystemClockFreq() << " MHz" << std::endl; // Should indicate 100 MHz
-    std::cout << "Opal Kelly device firmware version: " << dev->GetDeviceMajorVersion() << "." <<
-            dev->GetDeviceMinorVersion() << std::endl;
-    std::cout << "Opal Kelly device serial number: " << dev->GetSerialNumber().c_str() << std::endl;
-    std::cout << "Opal Kelly device ID std::string: " << dev->GetDeviceID().c_str() << std::endl << std::endl;
+    std::cout << "FPGA system clock: " << getSystemClockFreq() << " MHz" << std::endl << std::endl; // Should indicate 100 MHz
 
     return 1;
 }
@@ -143,42 +91,7 @@ int Rhd2000EvalBoard::open(const char* libname)
 // Uploads the configuration file (bitfile) to the FPGA.  Returns true if successful.
 bool Rhd2000EvalBoard::uploadFpgaBitfile(std::string filename)
 {
-    okCFrontPanel::ErrorCode errorCode = dev->ConfigureFPGA(filename);
-
-    switch (errorCode) {
-        case okCFrontPanel::NoError:
-            break;
-        case okCFrontPanel::DeviceNotOpen:
-            std::cerr << "FPGA configuration failed: Device not open." << std::endl;
-            return(false);
-        case okCFrontPanel::FileError:
-            std::cerr << "FPGA configuration failed: Cannot find configuration file." << std::endl;
-            return(false);
-        case okCFrontPanel::InvalidBitstream:
-            std::cerr << "FPGA configuration failed: Bitstream is not properly formatted." << std::endl;
-            return(false);
-        case okCFrontPanel::DoneNotHigh:
-            std::cerr << "FPGA configuration failed: FPGA DONE signal did not assert after configuration." << std::endl;
-            return(false);
-        case okCFrontPanel::TransferError:
-            std::cerr << "FPGA configuration failed: USB error occurred during download." << std::endl;
-            return(false);
-        case okCFrontPanel::CommunicationError:
-            std::cerr << "FPGA configuration failed: Communication error with firmware." << std::endl;
-            return(false);
-        case okCFrontPanel::UnsupportedFeature:
-            std::cerr << "FPGA configuration failed: Unsupported feature." << std::endl;
-            return(false);
-        default:
-            std::cerr << "FPGA configuration failed: Unknown error." << std::endl;
-            return(false);
-    }
-
-    // Check for Opal Kelly FrontPanel support in the FPGA configuration.
-    if (dev->IsFrontPanelEnabled() == false) {
-        std::cerr << "Opal Kelly FrontPanel support is not enabled in this FPGA configuration." << std::endl;
-        delete dev;
-        dev = 0;
+    if (!dev->uploadFpgaBitfile(filename)) {
         return(false);
     }
 
@@ -198,15 +111,30 @@ bool Rhd2000EvalBoard::uploadFpgaBitfile(std::string filename)
     return(true);
 }
 
+// Returns true if the FPGA is already configured with Rhythm for this board, for example by
+// an earlier session, and reads the Rhythm version number into boardVersion.
+bool Rhd2000EvalBoard::isRhythmConfigured(int &boardVersion)
+{
+    if (!dev->isFpgaConfigured())
+        return false;
+
+    dev->UpdateWireOuts();
+    boardVersion = dev->GetWireOutValue(WireOutBoardVersion);
+
+    return dev->GetWireOutValue(WireOutBoardId) == (unsigned int) (usb3 ? RHYTHM_BOARD_ID_USB3 : RHYTHM_BOARD_ID_USB2);
+}
+
+// Returns the serial number of the Opal Kelly module.
+std::string Rhd2000EvalBoard::getSerialNumber() const
+{
+    return dev->getSerialNumber();
+}
+
 // Reads system clock frequency from Opal Kelly board (in MHz).  Should be 100 MHz for normal
 // Rhythm operation.
 double Rhd2000EvalBoard::getSystemClockFreq() const
 {
-    // Read back the CY22393 PLL configuation
-    okCPLL22393 pll;
-    dev->GetEepromPLL22393Configuration(pll);
-
-    return pll.GetOutputFrequency(0);
+    return dev->getSystemClockFreq();
 }
 
 // Initialize Rhythm FPGA to default starting values.
@@ -216,6 +144,8 @@ void Rhd2000EvalBoard::initialize()
 
     resetBoard();
     setSampleRate(SampleRate30000Hz);
+
+    beginConfig();
     selectAuxCommandBank(PortA, AuxCmd1, 0);
     selectAuxCommandBank(PortB, AuxCmd1, 0);
     selectAuxCommandBank(PortC, AuxCmd1, 0);
@@ -323,6 +253,7 @@ void Rhd2000EvalBoard::initialize()
     setExternalDigOutChannel(PortD, 0);
 
     enableBoardLeds(true);
+    commitConfig();
 }
 
 // Set the per-channel sampling rate of the RHD2000 chips connected to the FPGA.
@@ -463,7 +394,7 @@ bool Rhd2000EvalBoard::setSampleRate(AmplifierSampleRate newSampleRate)
 
     // Reprogram clock synthesizer
     dev->SetWireInValue(WireInDataFreqPll, (256 * M + D));
-    dev->UpdateWireIns();
+    flushWireIns();
     dev->ActivateTriggerIn(TrigInDcmProg, 0);
 
     // Wait for DataClkLocked = 1 before allowing data acquisition to continue
@@ -593,7 +524,7 @@ void Rhd2000EvalBoard::uploadCommandList(const std::vector<int> &commandList, Au
         dev->SetWireInValue(WireInCmdRamData, commandList[i]);
         dev->SetWireInValue(WireInCmdRamAddr, i);
         dev->SetWireInValue(WireInCmdRamBank, bank);
-        dev->UpdateWireIns();
+        flushWireIns();
         switch (auxCommandSlot) {
             case AuxCmd1:
                 dev->ActivateTriggerIn(TrigInRamWrite, 0);
@@ -649,7 +580,7 @@ void Rhd2000EvalBoard::selectAuxCommandBank(BoardPort port, AuxCmdSlot auxComman
         dev->SetWireInValue(WireInAuxCmdBank3, bank << bitShift, 0x000f << bitShift);
         break;
     }
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Specify a command sequence length (endIndex = 0-1023) and command loop index (0-1023) for a particular
@@ -685,7 +616,39 @@ void Rhd2000EvalBoard::selectAuxCommandLength(AuxCmdSlot auxCommandSlot, int loo
         dev->SetWireInValue(WireInAuxCmdLength3, endIndex);
         break;
     }
+    updateWireIns();
+}
+
+// Open Ephys addition.  Between beginConfig() and commitConfig(), setters that only change
+// wire-in values leave them in the transport instead of sending each one to the board, and
+// commitConfig() sends them all in a single UpdateWireIns() transfer.  Calls that pulse a
+// trigger or a reset bit still send the pending values first, so the board always sees
+// changes in the order they were made.  Batches nest; the outermost commitConfig() sends.
+void Rhd2000EvalBoard::beginConfig()
+{
+    ++configDepth;
+}
+
+void Rhd2000EvalBoard::commitConfig()
+{
+    if (configDepth > 0 && --configDepth == 0 && wireInsPending)
+        flushWireIns();
+}
+
+// Sends changed wire-in values now, or at commitConfig() inside a batch.
+void Rhd2000EvalBoard::updateWireIns()
+{
+    if (configDepth > 0)
+        wireInsPending = true;
+    else
+        dev->UpdateWireIns();
+}
+
+// Sends all wire-in values now, including any held back by beginConfig().
+void Rhd2000EvalBoard::flushWireIns()
+{
     dev->UpdateWireIns();
+    wireInsPending = false;
 }
 
 // Reset FPGA.  This clears all auxiliary command RAM banks, clears the USB FIFO, and resets the
@@ -693,17 +656,17 @@ void Rhd2000EvalBoard::selectAuxCommandLength(AuxCmdSlot auxCommandSlot, int loo
 void Rhd2000EvalBoard::resetBoard()
 {
     dev->SetWireInValue(WireInResetRun, 0x01, 0x01);
-    dev->UpdateWireIns();
+    flushWireIns();
     dev->SetWireInValue(WireInResetRun, 0x00, 0x01);
-    dev->UpdateWireIns();
+    flushWireIns();
     if (usb3)
     {
         dev->SetWireInValue(WireInMultiUse, USB3_BLOCK_SIZE / 4);
-        dev->UpdateWireIns();
+        flushWireIns();
         dev->ActivateTriggerIn(TrigInOpenEphys, 16);
         std::cout << "Blocksize set to " << USB3_BLOCK_SIZE << std::endl;
         dev->SetWireInValue(WireInMultiUse, DDR_BLOCK_SIZE);
-        dev->UpdateWireIns();
+        flushWireIns();
         dev->ActivateTriggerIn(TrigInOpenEphys, 17);
         std::cout << "DDR burst set to " << DDR_BLOCK_SIZE << std::endl;
     }
@@ -713,25 +676,29 @@ void Rhd2000EvalBoard::resetBoard()
 // maxTimeStep is reached (if continuousMode == false).
 void Rhd2000EvalBoard::setContinuousRunMode(bool continuousMode)
 {
+    continuousRunMode = continuousMode;
+
     if (continuousMode) {
         dev->SetWireInValue(WireInResetRun, 0x02, 0x02);
     } else {
         dev->SetWireInValue(WireInResetRun, 0x00, 0x02);
     }
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Set maxTimeStep for cases where continuousMode == false.
-void Rhd2000EvalBoard::setMaxTimeStep(unsigned int maxTimeStep)
+void Rhd2000EvalBoard::setMaxTimeStep(unsigned int maxTimeStep_)
 {
     unsigned int maxTimeStepLsb, maxTimeStepMsb;
 
+    maxTimeStep = maxTimeStep_;
+
     maxTimeStepLsb = maxTimeStep & 0x0000ffff;
     maxTimeStepMsb = maxTimeStep & 0xffff0000;
 
     dev->SetWireInValue(WireInMaxTimeStepLsb, maxTimeStepLsb);
     dev->SetWireInValue(WireInMaxTimeStepMsb, maxTimeStepMsb >> 16);
-    dev->UpdateWireIns();
+    updateWireIns();
 
 
 }
@@ -739,10 +706,14 @@ void Rhd2000EvalBoard::setMaxTimeStep(unsigned int maxTimeStep)
 // Initiate SPI data acquisition.
 void Rhd2000EvalBoard::run()
 {
+    // only costs a transfer if a batch left values unsent
+    if (wireInsPending)
+        flushWireIns();
     dev->UpdateWireOuts();
 //  std::std::cout << "Block size: " << dev->GetWireOutValue(0x26) << std::std::endl;
 //  std::std::cout << "Burst len: " << dev->GetWireOutValue(0x27) << std::std::endl;
     dev->ActivateTriggerIn(TrigInSpiStart, 0);
+    runStartTime = std::chrono::steady_clock::now();
 }
 
 // Is the FPGA currently running?
@@ -760,6 +731,31 @@ bool Rhd2000EvalBoard::isRunning() const
     }
 }
 
+// Open Ephys addition.  Waits for a run started with continuousMode == false to end.  The run
+// takes maxTimeStep samples at the current sample rate, so this sleeps until it should be
+// over and only then polls isRunning(), every RUN_POLL_INTERVAL_MS.  Returns false if the
+// board is still running timeoutMs after the expected end, or if the run is continuous.
+bool Rhd2000EvalBoard::waitForRunCompletion(int timeoutMs)
+{
+    if (continuousRunMode)
+        return !isRunning();
+
+    std::chrono::steady_clock::time_point expectedEnd = runStartTime +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(maxTimeStep / getSampleRate()));
+    std::chrono::steady_clock::time_point deadline = expectedEnd + std::chrono::milliseconds(timeoutMs);
+
+    std::this_thread::sleep_until(expectedEnd);
+
+    while (isRunning()) {
+        if (std::chrono::steady_clock::now() >= deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(RUN_POLL_INTERVAL_MS));
+    }
+
+    return true;
+}
+
 // Returns the number of 16-bit words in the USB FIFO.  The user should never attempt to read
 // more data than the FIFO currently contains, as it is not protected against underflow.
 unsigned int Rhd2000EvalBoard::numWordsInFifo() const
@@ -813,7 +809,7 @@ void Rhd2000EvalBoard::setCableDelay(BoardPort port, int delay)
     }
 
     dev->SetWireInValue(WireInMisoDelay, delay << bitShift, 0x000f << bitShift);
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Set the delay for sampling the MISO line on a particular SPI port (PortA - PortD) based on the length
@@ -881,7 +877,7 @@ double Rhd2000EvalBoard::estimateCableLengthFeet(int delay) const
 void Rhd2000EvalBoard::setDspSettle(bool enabled)
 {
     dev->SetWireInValue(WireInResetRun, (enabled ? 0x04 : 0x00), 0x04);
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Assign a particular data source (e.g., PortA1, PortA2, PortB1,...) to one of the eight
@@ -964,7 +960,7 @@ void Rhd2000EvalBoard::setDataSource(int stream, BoardDataSource dataSource)
     }
 
     dev->SetWireInValue(endPoint, dataSource << bitShift, 0x000f << bitShift);
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Enable or disable one of the eight available USB data streams (0-7).
@@ -978,14 +974,14 @@ void Rhd2000EvalBoard::enableDataStream(int stream, bool enabled)
     if (enabled) {
         if (dataStreamEnabled[stream] == 0) {
             dev->SetWireInValue(WireInDataStreamEn, 0x0001 << stream, 0x0001 << stream);
-            dev->UpdateWireIns();
+            updateWireIns();
             dataStreamEnabled[stream] = 1;
             ++numDataStreams;
         }
     } else {
         if (dataStreamEnabled[stream] == 1) {
             dev->SetWireInValue(WireInDataStreamEn, 0x0000 << stream, 0x0001 << stream);
-            dev->UpdateWireIns();
+            updateWireIns();
             dataStreamEnabled[stream] = 0;
             numDataStreams--;
         }
@@ -1002,7 +998,7 @@ int Rhd2000EvalBoard::getNumEnabledDataStreams() const
 void Rhd2000EvalBoard::clearTtlOut()
 {
     dev->SetWireInValue(WireInTtlOut, 0x0000);
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Set the 16 bits of the digital TTL output lines on the FPGA high or low according to integer array.
@@ -1016,7 +1012,7 @@ void Rhd2000EvalBoard::setTtlOut(int ttlOutArray[])
             ttlOut += 1 << i;
     }
     dev->SetWireInValue(WireInTtlOut, ttlOut);
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Read the 16 bits of the digital TTL input lines on the FPGA into an integer array.
@@ -1043,7 +1039,7 @@ void Rhd2000EvalBoard::setDacManual(int value)
     }
 
     dev->SetWireInValue(WireInDacManual, value);
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Set the eight red LEDs on the XEM6010 board according to integer array.
@@ -1057,7 +1053,7 @@ void Rhd2000EvalBoard::setLedDisplay(int ledArray[])
             ledOut += 1 << i;
     }
     dev->SetWireInValue(WireInLedDisplay, ledOut);
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Enable or disable AD5662 DAC channel (0-7)
@@ -1068,7 +1064,7 @@ void Rhd2000EvalBoard::enableDac(int dacChannel, bool enabled)
         return;
     }
 
-    UINT32 dacEnMask = usb3 ? 0x0400 : 0x0200;
+    unsigned int dacEnMask = usb3 ? 0x0400 : 0x0200;
 
     switch (dacChannel) {
     case 0:
@@ -1096,7 +1092,7 @@ void Rhd2000EvalBoard::enableDac(int dacChannel, bool enabled)
         dev->SetWireInValue(WireInDacSource8, (enabled ? dacEnMask : 0x0000), dacEnMask);
         break;
     }
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Set the gain level of all eight DAC channels to 2^gain (gain = 0-7).
@@ -1108,7 +1104,7 @@ void Rhd2000EvalBoard::setDacGain(int gain)
     }
 
     dev->SetWireInValue(WireInResetRun, gain << 13, 0xe000);
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Suppress the noise on DAC channels 0 and 1 (the audio channels) between
@@ -1121,7 +1117,7 @@ void Rhd2000EvalBoard::setAudioNoiseSuppress(int noiseSuppress)
     }
 
     dev->SetWireInValue(WireInResetRun, noiseSuppress << 6, 0x1fc0);
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Assign a particular data stream (0-7) to a DAC channel (0-7).  Setting stream
@@ -1138,7 +1134,7 @@ void Rhd2000EvalBoard::selectDacDataStream(int dacChannel, int stream)
         return;
     }
 
-    UINT32 dacStreamMask = (usb3 ? 0x03e0 : 0x01e0);
+    unsigned int dacStreamMask = (usb3 ? 0x03e0 : 0x01e0);
 
     switch (dacChannel) {
     case 0:
@@ -1166,7 +1162,7 @@ void Rhd2000EvalBoard::selectDacDataStream(int dacChannel, int stream)
         dev->SetWireInValue(WireInDacSource8, stream << 5, dacStreamMask);
         break;
     }
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Assign a particular amplifier channel (0-31) to a DAC channel (0-7).
@@ -1208,7 +1204,7 @@ void Rhd2000EvalBoard::selectDacDataChannel(int dacChannel, int dataChannel)
         dev->SetWireInValue(WireInDacSource8, dataChannel << 0, 0x001f);
         break;
     }
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Enable external triggering of amplifier hardware 'fast settle' function (blanking).
@@ -1217,7 +1213,7 @@ void Rhd2000EvalBoard::selectDacDataChannel(int dacChannel, int dataChannel)
 void Rhd2000EvalBoard::enableExternalFastSettle(bool enable)
 {
     dev->SetWireInValue(WireInMultiUse, enable ? 1 : 0);
-    dev->UpdateWireIns();
+    flushWireIns();
     dev->ActivateTriggerIn(TrigInExtFastSettle, 0);
 }
 
@@ -1231,7 +1227,7 @@ void Rhd2000EvalBoard::setExternalFastSettleChannel(int channel)
     }
 
     dev->SetWireInValue(WireInMultiUse, channel);
-    dev->UpdateWireIns();
+    flushWireIns();
     dev->ActivateTriggerIn(TrigInExtFastSettle, 1);
 }
 
@@ -1241,7 +1237,7 @@ void Rhd2000EvalBoard::setExternalFastSettleChannel(int channel)
 void Rhd2000EvalBoard::enableExternalDigOut(BoardPort port, bool enable)
 {
     dev->SetWireInValue(WireInMultiUse, enable ? 1 : 0);
-    dev->UpdateWireIns();
+    flushWireIns();
 
     switch (port) {
     case PortA:
@@ -1271,7 +1267,7 @@ void Rhd2000EvalBoard::setExternalDigOutChannel(BoardPort port, int channel)
     }
 
     dev->SetWireInValue(WireInMultiUse, channel);
-    dev->UpdateWireIns();
+    flushWireIns();
 
     switch (port) {
     case PortA:
@@ -1299,7 +1295,7 @@ void Rhd2000EvalBoard::setExternalDigOutChannel(BoardPort port, int channel)
 void Rhd2000EvalBoard::enableDacHighpassFilter(bool enable)
 {
     dev->SetWireInValue(WireInMultiUse, enable ? 1 : 0);
-    dev->UpdateWireIns();
+    flushWireIns();
     dev->ActivateTriggerIn(TrigInDacHpf, 0);
 }
 
@@ -1328,7 +1324,7 @@ void Rhd2000EvalBoard::setDacHighpassFilter(double cutoff)
     }
 
     dev->SetWireInValue(WireInMultiUse, filterCoefficient);
-    dev->UpdateWireIns();
+    flushWireIns();
     dev->ActivateTriggerIn(TrigInDacHpf, 1);
 }
 
@@ -1351,12 +1347,12 @@ void Rhd2000EvalBoard::setDacThreshold(int dacChannel, int threshold, bool trigP
 
     // Set threshold level.
     dev->SetWireInValue(WireInMultiUse, threshold);
-    dev->UpdateWireIns();
+    flushWireIns();
     dev->ActivateTriggerIn(TrigInDacThresh, dacChannel);
 
     // Set threshold polarity.
     dev->SetWireInValue(WireInMultiUse, (trigPolarity ? 1 : 0));
-    dev->UpdateWireIns();
+    flushWireIns();
     dev->ActivateTriggerIn(TrigInDacThresh, dacChannel + 8);
 }
 
@@ -1372,7 +1368,7 @@ void Rhd2000EvalBoard::setTtlMode(int mode)
     }
 
     dev->SetWireInValue(WireInResetRun, mode << 3, 0x0008);
-    dev->UpdateWireIns();
+    updateWireIns();
 }
 
 // Is variable-frequency clock DCM programming done?
@@ -1405,7 +1401,7 @@ void Rhd2000EvalBoard::flush()
     if (usb3)
     {
         dev->SetWireInValue(WireInResetRun, 1 << 16, 1 << 16); //Override pipeout block throttle
-        dev->UpdateWireIns();
+        flushWireIns();
         //std::cout << "Pre-Flush: " << numWordsInFifo() << std::endl;
         while (numWordsInFifo() >= USB_BUFFER_SIZE / 2) {
             dev->ReadFromBlockPipeOut(PipeOutData, USB3_BLOCK_SIZE, USB_BUFFER_SIZE, usbBuffer);
@@ -1417,7 +1413,7 @@ void Rhd2000EvalBoard::flush()
         //  printFIFOmetrics();
         }
         dev->SetWireInValue(WireInResetRun, 0, 1 << 16);
-        dev->UpdateWireIns();
+        flushWireIns();
     }
     else
     {
@@ -1456,7 +1452,7 @@ bool Rhd2000EvalBoard::readDataBlock(Rhd2000DataBlock *dataBlock, int nSamples)
         //std::std::cout << "usb2 read: " << numBytesToRead << std::std::endl;
         res = dev->ReadFromPipeOut(PipeOutData, numBytesToRead, usbBuffer);
     }
-    if (res == ok_Timeout)
+    if (res == Rhd2000Transport::PipeTimeout)
     {
         std::cerr << "CRITICAL: Timeout on pipe read. Check block and buffer sizes." << std::endl;
     }
@@ -1466,6 +1462,21 @@ bool Rhd2000EvalBoard::readDataBlock(Rhd2000DataBlock *dataBlock, int nSamples)
 }
 
 bool Rhd2000EvalBoard::readRawDataBlock(unsigned char** bufferPtr, int nSamples)
+{
+    if (!readRawDataBlockInto(usbBuffer, nSamples))
+    {
+        *bufferPtr = nullptr;
+        return false;
+    }
+
+    *bufferPtr = usbBuffer;
+    return true;
+}
+
+// Reads one raw data block into a caller-owned buffer, which must hold at least
+// 2 * Rhd2000DataBlock::calculateDataBlockSizeInWords() bytes.  Returns false if the pipe
+// read failed or returned fewer bytes, in which case the buffer contents are not valid.
+bool Rhd2000EvalBoard::readRawDataBlockInto(unsigned char* buffer, int nSamples)
 {
     unsigned int numBytesToRead;
     long res;
@@ -1475,39 +1486,43 @@ bool Rhd2000EvalBoard::readRawDataBlock(unsigned char** bufferPtr, int nSamples)
     if (numBytesToRead > USB_BUFFER_SIZE) {
         std::cerr << "Error in Rhd2000EvalBoard::readDataBlock: USB buffer size exceeded.  " <<
             "Increase value of USB_BUFFER_SIZE." << std::endl;
-        *bufferPtr = nullptr;
         return false;
     }
 
     if (usb3)
     {
         //std::std::cout << "usb3 read : " << numBytesToRead << " in " << USB3_BLOCK_SIZE << " blocks" << std::std::endl;
-        res = dev->ReadFromBlockPipeOut(PipeOutData, USB3_BLOCK_SIZE, numBytesToRead, usbBuffer);
+        res = dev->ReadFromBlockPipeOut(PipeOutData, USB3_BLOCK_SIZE, numBytesToRead, buffer);
 
     }
     else
     {
         //std::std::cout << "usb2 read: " << numBytesToRead << std::std::endl;
-        res = dev->ReadFromPipeOut(PipeOutData, numBytesToRead, usbBuffer);
+        res = dev->ReadFromPipeOut(PipeOutData, numBytesToRead, buffer);
     }
-    if (res == ok_Timeout)
+    if (res == Rhd2000Transport::PipeTimeout)
     {
         std::cerr << "CRITICAL: Timeout on pipe read. Check block and buffer sizes." << std::endl;
     }
-    *bufferPtr = usbBuffer;
+    // Open Ephys addition: a failed or short transfer leaves old data in the buffer
+    if (res < 0 || (unsigned long) res < numBytesToRead)
+    {
+        if (res != Rhd2000Transport::PipeTimeout)
+            std::cerr << "Error in Rhd2000EvalBoard::readRawDataBlockInto: pipe read returned " << res <<
+                " of " << numBytesToRead << " bytes." << std::endl;
+        return false;
+    }
     return true;
 }
 
-// Reads a certain number of USB data blocks, if the specified number is available, and appends them
-// to queue.  Returns true if data blocks were available.
-bool Rhd2000EvalBoard::readDataBlocks(int numBlocks, std::queue<Rhd2000DataBlock> &dataQueue)
+// Reads a certain number of USB data blocks into usbBuffer, if the specified number is available.
+// Returns true if data blocks were available.
+bool Rhd2000EvalBoard::readBlocksIntoUsbBuffer(int numBlocks)
 {
     unsigned int numWordsToRead, numBytesToRead;
-    int i;
-    Rhd2000DataBlock *dataBlock;
     long res;
 
-    numWordsToRead = numBlocks * dataBlock->calculateDataBlockSizeInWords(numDataStreams, usb3);
+    numWordsToRead = numBlocks * Rhd2000DataBlock::calculateDataBlockSizeInWords(numDataStreams, usb3);
 
     if (numWordsInFifo() < numWordsToRead)
         return false;
@@ -1528,17 +1543,57 @@ bool Rhd2000EvalBoard::readDataBlocks(int numBlocks, std::queue<Rhd2000DataBlock
     {
         res = dev->ReadFromPipeOut(PipeOutData, numBytesToRead, usbBuffer);
     }
-    if (res == ok_Timeout)
+    if (res == Rhd2000Transport::PipeTimeout)
     {
         std::cerr << "CRITICAL: Timeout on pipe read. Check block and buffer sizes." << std::endl;
     }
 
-    dataBlock = new Rhd2000DataBlock(numDataStreams, usb3);
+    return true;
+}
+
+// Reads a certain number of USB data blocks, if the specified number is available, and appends them
+// to queue.  Returns true if data blocks were available.
+bool Rhd2000EvalBoard::readDataBlocks(int numBlocks, std::queue<Rhd2000DataBlock> &dataQueue)
+{
+    int i;
+
+    if (!readBlocksIntoUsbBuffer(numBlocks))
+        return false;
+
+    // Fill each block in place; its storage comes from the data block pool
     for (i = 0; i < numBlocks; ++i) {
-        dataBlock->fillFromUsbBuffer(usbBuffer, i, numDataStreams);
-        dataQueue.push(*dataBlock);
+        dataQueue.emplace(numDataStreams, usb3);
+        dataQueue.back().fillFromUsbBuffer(usbBuffer, i, numDataStreams);
     }
-    delete dataBlock;
+
+    return true;
+}
+
+// Reads a certain number of USB data blocks, if the specified number is available, and points view
+// at their frames.  Returns true if data blocks were available.
+bool Rhd2000EvalBoard::readDataBlocks(int numBlocks, Rhd2000BlockView &view)
+{
+    if (!readBlocksIntoUsbBuffer(numBlocks))
+        return false;
+
+    view = Rhd2000BlockView(usbBuffer, numDataStreams, numBlocks * SAMPLES_PER_DATA_BLOCK(usb3));
+
+    if (view.countValidFrames() < view.getNumSamples())
+        std::cerr << "Error in Rhd2000EvalBoard::readDataBlocks: Incorrect header." << std::endl;
+
+    return true;
+}
+
+// Reads one data block (or nSamples frames) and points view at its frames.
+bool Rhd2000EvalBoard::readDataBlock(Rhd2000BlockView &view, int nSamples)
+{
+    if (!readRawDataBlockInto(usbBuffer, nSamples))
+        return false;
+
+    view = Rhd2000BlockView(usbBuffer, numDataStreams, nSamples <= 0 ? SAMPLES_PER_DATA_BLOCK(usb3) : nSamples);
+
+    if (view.countValidFrames() < view.getNumSamples())
+        std::cerr << "Error in Rhd2000EvalBoard::readDataBlock: Incorrect header." << std::endl;
 
     return true;
 }
@@ -1558,67 +1613,6 @@ int Rhd2000EvalBoard::queueToFile(std::queue<Rhd2000DataBlock> &dataQueue, std::
     return count;
 }
 
-// Return name of Opal Kelly board based on model code.
-std::string Rhd2000EvalBoard::opalKellyModelName(int model) const
-{
-    switch (model) {
-    case OK_PRODUCT_XEM3001V1:
-        return("XEM3001V1");
-    case OK_PRODUCT_XEM3001V2:
-        return("XEM3001V2");
-    case OK_PRODUCT_XEM3010:
-        return("XEM3010");
-    case OK_PRODUCT_XEM3005:
-        return("XEM3005");
-    case OK_PRODUCT_XEM3001CL:
-        return("XEM3001CL");
-    case OK_PRODUCT_XEM3020:
-        return("XEM3020");
-    case OK_PRODUCT_XEM3050:
-        return("XEM3050");
-    case OK_PRODUCT_XEM9002:
-        return("XEM9002");
-    case OK_PRODUCT_XEM3001RB:
-        return("XEM3001RB");
-    case OK_PRODUCT_XEM5010:
-        return("XEM5010");
-    case OK_PRODUCT_XEM6110LX45:
-        return("XEM6110LX45");
-    case OK_PRODUCT_XEM6001:
-        return("XEM6001");
-    case OK_PRODUCT_XEM6010LX45:
-        return("XEM6010LX45");
-    case OK_PRODUCT_XEM6010LX150:
-        return("XEM6010LX150");
-    case OK_PRODUCT_XEM6110LX150:
-        return("XEM6110LX150");
-    case OK_PRODUCT_XEM6006LX9:
-        return("XEM6006LX9");
-    case OK_PRODUCT_XEM6006LX16:
-        return("XEM6006LX16");
-    case OK_PRODUCT_XEM6006LX25:
-        return("XEM6006LX25");
-    case OK_PRODUCT_XEM5010LX110:
-        return("XEM5010LX110");
-    case OK_PRODUCT_ZEM4310:
-        return("ZEM4310");
-    case OK_PRODUCT_XEM6310LX45:
-        return("XEM6310LX45");
-    case OK_PRODUCT_XEM6310LX150:
-        return("XEM6310LX150");
-    case OK_PRODUCT_XEM6110V2LX45:
-        return("XEM6110V2LX45");
-    case OK_PRODUCT_XEM6110V2LX150:
-        return("XEM6110V2LX150");
-    case OK_PRODUCT_XEM6002LX9:
-        return("XEM6002LX9");
-    case OK_PRODUCT_XEM6320LX130T:
-        return("XEM6320LX130T");
-    default:
-        return("UNKNOWN");
-    }
-}
-
 // Return 4-bit "board mode" input.
 int Rhd2000EvalBoard::getBoardMode() const
 {
@@ -1661,7 +1655,7 @@ void Rhd2000EvalBoard::getCableDelay(std::vector<int> &delays) const
     }
 }
 
-// Uses the Opal Kelly library to reset the FPGA
+// Uses the transport (for a real board, the Opal Kelly library) to reset the FPGA
 void Rhd2000EvalBoard::resetFpga()
 {
     dev->ResetFPGA();
@@ -1678,7 +1672,7 @@ bool Rhd2000EvalBoard::isStreamEnabled(int streamIndex)
 void Rhd2000EvalBoard::enableBoardLeds(bool enable)
 {
     dev->SetWireInValue(WireInMultiUse, enable ? 1 : 0);
-    dev->UpdateWireIns();
+    flushWireIns();
     dev->ActivateTriggerIn(TrigInOpenEphys, 0);
 }
 
@@ -1689,7 +1683,7 @@ void Rhd2000EvalBoard::setClockDivider(int divide_factor)
 {
 
     dev->SetWireInValue(WireInMultiUse, divide_factor);
-    dev->UpdateWireIns();
+    flushWireIns();
     dev->ActivateTriggerIn(TrigInOpenEphys, 1);
 }
 
@@ -1699,7 +1693,19 @@ bool Rhd2000EvalBoard::isUSB3()
 }
 
 void Rhd2000EvalBoard::printFIFOmetrics()
+{
+    FifoMetrics metrics;
+    readFifoMetrics(metrics);
+    std::cout << "In FIFO: " << metrics.inFifo << " DDR: " << metrics.ddr << " Out FIFO: " << metrics.outFifo << std::endl;
+}
+
+// Reads the USB FIFO word count together with the FPGA FIFO and DDR levels.  This costs the same
+// single USB round-trip as numWordsInFifo().
+void Rhd2000EvalBoard::readFifoMetrics(FifoMetrics &metrics) const
 {
     dev->UpdateWireOuts();
-    std::cout << "In FIFO: " << dev->GetWireOutValue(0x28) << " DDR: " << dev->GetWireOutValue(0x2a) << " Out FIFO: " << dev->GetWireOutValue(0x29) << std::endl;
+    metrics.numWordsInFifo = (dev->GetWireOutValue(WireOutNumWordsMsb) << 16) + dev->GetWireOutValue(WireOutNumWordsLsb);
+    metrics.inFifo = dev->GetWireOutValue(WireOutInFifo);
+    metrics.ddr = dev->GetWireOutValue(WireOutDdr);
+    metrics.outFifo = dev->GetWireOutValue(WireOutOutFifo);
 }
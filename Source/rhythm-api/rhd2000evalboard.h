@@ -34,23 +34,31 @@
 #define USB3_BLOCK_SIZE 1024
 #define DDR_BLOCK_SIZE 32
 
+// Once a run should have ended, waitForRunCompletion() checks the board this often, for up
+// to RUN_COMPLETION_TIMEOUT_MS by default
+#define RUN_POLL_INTERVAL_MS 1
+#define RUN_COMPLETION_TIMEOUT_MS 1000
+
+#include <chrono>
 #include <queue>
+#include <string>
 
-namespace OpalKellyLegacy
-{
-    class okCFrontPanel;
-}
+class Rhd2000BlockView;
 class Rhd2000DataBlock;
+class Rhd2000Transport;
 
 class Rhd2000EvalBoard
 {
 
 public:
-    Rhd2000EvalBoard();
+    // Takes ownership of the transport, which connects the board to a real or simulated FPGA
+    explicit Rhd2000EvalBoard(Rhd2000Transport *transport);
     ~Rhd2000EvalBoard();
 
     int open(const char* libname); //patched to allow selecting path to dll
     bool uploadFpgaBitfile(std::string filename);
+    bool isRhythmConfigured(int &boardVersion);
+    std::string getSerialNumber() const;
     void initialize();
 
     enum AmplifierSampleRate {
@@ -99,11 +107,15 @@ public:
     void selectAuxCommandBank(BoardPort port, AuxCmdSlot auxCommandSlot, int bank);
     void selectAuxCommandLength(AuxCmdSlot auxCommandSlot, int loopIndex, int endIndex);
 
+    void beginConfig();
+    void commitConfig();
+
     void resetBoard();
     void setContinuousRunMode(bool continuousMode);
     void setMaxTimeStep(unsigned int maxTimeStep);
     void run();
     bool isRunning() const;
+    bool waitForRunCompletion(int timeoutMs = RUN_COMPLETION_TIMEOUT_MS);
     unsigned int numWordsInFifo() const;
     static unsigned int fifoCapacityInWords();
 
@@ -175,21 +187,28 @@ public:
     void setClockDivider(int divide_factor);
     bool isUSB3();
     void printFIFOmetrics();
-    bool readRawDataBlock(unsigned char** bufferPtr, int nSamples = -1);
 
-    int MAX_NUM_DATA_STREAMS;
+    // FIFO levels latched by a single wire-out update
+    struct FifoMetrics
+    {
+        unsigned int numWordsInFifo; // words waiting to be read over USB
+        unsigned int inFifo;         // FPGA input FIFO level
+        unsigned int ddr;            // DDR level
+        unsigned int outFifo;        // FPGA output FIFO level
+    };
+    void readFifoMetrics(FifoMetrics &metrics) const;
+    bool readRawDataBlock(unsigned char** bufferPtr, int nSamples = -1);
+    bool readRawDataBlockInto(unsigned char* buffer, int nSamples = -1);
 
-private:
-    OpalKellyLegacy::okCFrontPanel *dev;
-    AmplifierSampleRate sampleRate;
-    int numDataStreams; // total number of data streams currently enabled
-    int dataStreamEnabled[MAX_NUM_DATA_STREAMS_USB3]; // 0 (disabled) or 1 (enabled), set for maximum stream number
-    std::vector<int> cableDelay;
+    // Read frames without converting them into an Rhd2000DataBlock.  The view points into
+    // the board's USB buffer and stays valid until the next read.
+    bool readDataBlock(Rhd2000BlockView &view, int nSamples = -1);
+    bool readDataBlocks(int numBlocks, Rhd2000BlockView &view);
 
-    // Buffer for reading bytes from USB interface
-    unsigned char usbBuffer[USB_BUFFER_SIZE];
+    int MAX_NUM_DATA_STREAMS;
 
-    // Opal Kelly module USB interface endpoint addresses
+    // Opal Kelly module USB interface endpoint addresses (public, so that simulated
+    // transports can implement the same map)
     enum OkEndPoint {
         WireInResetRun = 0x00,
         WireInMaxTimeStepLsb = 0x01,
@@ -239,15 +258,40 @@ private:
         WireOutTtlIn = 0x23,
         WireOutDataClkLocked = 0x24,
         WireOutBoardMode = 0x25,
+        WireOutInFifo = 0x28,
+        WireOutOutFifo = 0x29,
+        WireOutDdr = 0x2a,
         WireOutBoardId = 0x3e,
         WireOutBoardVersion = 0x3f,
 
         PipeOutData = 0xa0
     };
 
-    std::string opalKellyModelName(int model) const;
+private:
+    Rhd2000Transport *dev;
+    AmplifierSampleRate sampleRate;
+    int numDataStreams; // total number of data streams currently enabled
+    int dataStreamEnabled[MAX_NUM_DATA_STREAMS_USB3]; // 0 (disabled) or 1 (enabled), set for maximum stream number
+    std::vector<int> cableDelay;
+
+    // Run length set by setMaxTimeStep() and setContinuousRunMode(), and when run() was called
+    unsigned int maxTimeStep;
+    bool continuousRunMode;
+    std::chrono::steady_clock::time_point runStartTime;
+
+    // Buffer for reading bytes from USB interface
+    unsigned char usbBuffer[USB_BUFFER_SIZE];
+
     double getSystemClockFreq() const;
 
+    bool readBlocksIntoUsbBuffer(int numBlocks);
+
+    int configDepth;        // nesting depth of beginConfig()
+    bool wireInsPending;    // wire-in changes held back until commitConfig()
+
+    void updateWireIns();
+    void flushWireIns();
+
     bool isDcmProgDone() const;
     bool isDataClockLocked() const;
 
@@ -0,0 +1,289 @@
+//----------------------------------------------------------------------------------
+// rhd2000frontpaneltransport.cpp
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000FrontPanelTransport Class
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+#ifdef _WIN32
+#define NOMINMAX
+#endif
+#include <iostream>
+
+#include "rhd2000frontpaneltransport.h"
+
+#include "okFrontPanelDLL.h"
+
+using namespace OpalKellyLegacy;
+
+Rhd2000FrontPanelTransport::Rhd2000FrontPanelTransport()
+{
+    dev = 0;
+    usb3 = false;
+}
+
+Rhd2000FrontPanelTransport::~Rhd2000FrontPanelTransport()
+{
+    if (dev != 0) delete dev;
+}
+
+// Find an Opal Kelly XEM6010-LX45 or XEM6310-LX45 board attached to a USB port and open it.
+// Returns 1 if successful, -1 if FrontPanel cannot be loaded, and -2 if no board can be found.
+int Rhd2000FrontPanelTransport::open(const char* libname)
+{
+    char dll_date[32], dll_time[32];
+    std::string serialNumber = "";
+    int i, nDevices;
+
+//    if (okFrontPanelDLL_LoadLib(libname) == false) {
+//        std::cerr << "FrontPanel DLL could not be loaded.  " <<
+//                "Make sure this DLL is in the application start directory." << std::endl;
+//        return -1;
+//    }
+
+    okFrontPanelDLL_GetVersion(dll_date, dll_time);
+
+    std::cout << std::endl << "FrontPanel DLL loaded.  Built: " << dll_date << "  " << dll_time << std::endl;
+
+    if (dev != 0) delete dev;
+    dev = new okCFrontPanel;
+
+    std::cout << std::endl << "Scanning USB for Opal Kelly devices..." << std::endl << std::endl;
+
+    nDevices = dev->GetDeviceCount(); // slow
+
+    std::cout << "Found " << nDevices << " Opal Kelly device" << ((nDevices == 1) ? "" : "s") <<
+            " connected:" << std::endl;
+
+    for (i = 0; i < nDevices; ++i) {
+        std::cout << "  Device #" << i + 1 << ": Opal Kelly " <<
+                opalKellyModelName(dev->GetDeviceListModel(i)).c_str() <<
+                " with serial number " << dev->GetDeviceListSerial(i).c_str() << std::endl;
+    }
+
+    std::cout << std::endl;
+
+    for (i = 0; i < nDevices; ++i)
+    {
+        okCFrontPanel::BoardModel model = dev->GetDeviceListModel(i);
+
+        if (model == OK_PRODUCT_XEM6010LX45 || model == OK_PRODUCT_XEM6310LX45) //the two models we use
+        {
+            serialNumber = dev->GetDeviceListSerial(i);
+
+            std::cout << "Trying to open device with serial " << serialNumber.c_str() << std::endl;
+
+            if (dev->OpenBySerial(serialNumber) == okCFrontPanel::NoError) //
+            {
+                std::cout << "Device opened" << std::endl;
+                if (model == OK_PRODUCT_XEM6310LX45)
+                    usb3 = true;
+                break; //end loop if one device was opened
+            }
+        }
+    }
+    if (!dev->IsOpen())
+    {
+        delete dev;
+        dev = 0;
+        usb3 = false;
+        std::cerr << "No device could be opened.  Is one connected?" << std::endl;
+        return -2;
+    }
+
+    // Configure the on-board PLL appropriately.
+    dev->LoadDefaultPLLConfiguration();
+
+    // Get some general information about the XEM.
+    std::cout << "Opal Kelly device firmware version: " << dev->GetDeviceMajorVersion() << "." <<
+            dev->GetDeviceMinorVersion() << std::endl;
+    std::cout << "Opal Kelly device serial number: " << dev->GetSerialNumber().c_str() << std::endl;
+    std::cout << "Opal Kelly device ID std::string: " << dev->GetDeviceID().c_str() << std::endl << std::endl;
+
+    return 1;
+}
+
+bool Rhd2000FrontPanelTransport::isOpen() const
+{
+    return dev != 0 && dev->IsOpen();
+}
+
+bool Rhd2000FrontPanelTransport::isUSB3() const
+{
+    return usb3;
+}
+
+// Uploads the configuration file (bitfile) to the FPGA.  Returns true if successful.
+bool Rhd2000FrontPanelTransport::uploadFpgaBitfile(const std::string& filename)
+{
+    okCFrontPanel::ErrorCode errorCode = dev->ConfigureFPGA(filename);
+
+    switch (errorCode) {
+        case okCFrontPanel::NoError:
+            break;
+        case okCFrontPanel::DeviceNotOpen:
+            std::cerr << "FPGA configuration failed: Device not open." << std::endl;
+            return(false);
+        case okCFrontPanel::FileError:
+            std::cerr << "FPGA configuration failed: Cannot find configuration file." << std::endl;
+            return(false);
+        case okCFrontPanel::InvalidBitstream:
+            std::cerr << "FPGA configuration failed: Bitstream is not properly formatted." << std::endl;
+            return(false);
+        case okCFrontPanel::DoneNotHigh:
+            std::cerr << "FPGA configuration failed: FPGA DONE signal did not assert after configuration." << std::endl;
+            return(false);
+        case okCFrontPanel::TransferError:
+            std::cerr << "FPGA configuration failed: USB error occurred during download." << std::endl;
+            return(false);
+        case okCFrontPanel::CommunicationError:
+            std::cerr << "FPGA configuration failed: Communication error with firmware." << std::endl;
+            return(false);
+        case okCFrontPanel::UnsupportedFeature:
+            std::cerr << "FPGA configuration failed: Unsupported feature." << std::endl;
+            return(false);
+        default:
+            std::cerr << "FPGA configuration failed: Unknown error." << std::endl;
+            return(false);
+    }
+
+    // Check for Opal Kelly FrontPanel support in the FPGA configuration.
+    if (dev->IsFrontPanelEnabled() == false) {
+        std::cerr << "Opal Kelly FrontPanel support is not enabled in this FPGA configuration." << std::endl;
+        return(false);
+    }
+
+    return(true);
+}
+
+// The FPGA keeps its configuration until the module is power cycled, across closing and
+// reopening the device.
+bool Rhd2000FrontPanelTransport::isFpgaConfigured()
+{
+    return dev != 0 && dev->IsFrontPanelEnabled();
+}
+
+std::string Rhd2000FrontPanelTransport::getSerialNumber() const
+{
+    return dev != 0 ? dev->GetSerialNumber() : std::string();
+}
+
+// Reads system clock frequency from Opal Kelly board (in MHz).  Should be 100 MHz for normal
+// Rhythm operation.
+double Rhd2000FrontPanelTransport::getSystemClockFreq() const
+{
+    // Read back the CY22393 PLL configuation
+    okCPLL22393 pll;
+    dev->GetEepromPLL22393Configuration(pll);
+
+    return pll.GetOutputFrequency(0);
+}
+
+void Rhd2000FrontPanelTransport::SetWireInValue(int endPoint, unsigned int value, unsigned int mask)
+{
+    dev->SetWireInValue(endPoint, value, mask);
+}
+
+void Rhd2000FrontPanelTransport::UpdateWireIns()
+{
+    dev->UpdateWireIns();
+}
+
+void Rhd2000FrontPanelTransport::UpdateWireOuts()
+{
+    dev->UpdateWireOuts();
+}
+
+unsigned int Rhd2000FrontPanelTransport::GetWireOutValue(int endPoint)
+{
+    return (unsigned int) dev->GetWireOutValue(endPoint);
+}
+
+void Rhd2000FrontPanelTransport::ActivateTriggerIn(int endPoint, int bit)
+{
+    dev->ActivateTriggerIn(endPoint, bit);
+}
+
+long Rhd2000FrontPanelTransport::ReadFromPipeOut(int endPoint, long length, unsigned char* data)
+{
+    return dev->ReadFromPipeOut(endPoint, length, data);
+}
+
+long Rhd2000FrontPanelTransport::ReadFromBlockPipeOut(int endPoint, int blockSize, long length, unsigned char* data)
+{
+    return dev->ReadFromBlockPipeOut(endPoint, blockSize, length, data);
+}
+
+// Uses the Opal Kelly library to reset the FPGA
+void Rhd2000FrontPanelTransport::ResetFPGA()
+{
+    dev->ResetFPGA();
+}
+
+// Return name of Opal Kelly board based on model code.
+std::string Rhd2000FrontPanelTransport::opalKellyModelName(int model) const
+{
+    switch (model) {
+    case OK_PRODUCT_XEM3001V1:
+        return("XEM3001V1");
+    case OK_PRODUCT_XEM3001V2:
+        return("XEM3001V2");
+    case OK_PRODUCT_XEM3010:
+        return("XEM3010");
+    case OK_PRODUCT_XEM3005:
+        return("XEM3005");
+    case OK_PRODUCT_XEM3001CL:
+        return("XEM3001CL");
+    case OK_PRODUCT_XEM3020:
+        return("XEM3020");
+    case OK_PRODUCT_XEM3050:
+        return("XEM3050");
+    case OK_PRODUCT_XEM9002:
+        return("XEM9002");
+    case OK_PRODUCT_XEM3001RB:
+        return("XEM3001RB");
+    case OK_PRODUCT_XEM5010:
+        return("XEM5010");
+    case OK_PRODUCT_XEM6110LX45:
+        return("XEM6110LX45");
+    case OK_PRODUCT_XEM6001:
+        return("XEM6001");
+    case OK_PRODUCT_XEM6010LX45:
+        return("XEM6010LX45");
+    case OK_PRODUCT_XEM6010LX150:
+        return("XEM6010LX150");
+    case OK_PRODUCT_XEM6110LX150:
+        return("XEM6110LX150");
+    case OK_PRODUCT_XEM6006LX9:
+        return("XEM6006LX9");
+    case OK_PRODUCT_XEM6006LX16:
+        return("XEM6006LX16");
+    case OK_PRODUCT_XEM6006LX25:
+        return("XEM6006LX25");
+    case OK_PRODUCT_XEM5010LX110:
+        return("XEM5010LX110");
+    case OK_PRODUCT_ZEM4310:
+        return("ZEM4310");
+    case OK_PRODUCT_XEM6310LX45:
+        return("XEM6310LX45");
+    case OK_PRODUCT_XEM6310LX150:
+        return("XEM6310LX150");
+    case OK_PRODUCT_XEM6110V2LX45:
+        return("XEM6110V2LX45");
+    case OK_PRODUCT_XEM6110V2LX150:
+        return("XEM6110V2LX150");
+    case OK_PRODUCT_XEM6002LX9:
+        return("XEM6002LX9");
+    case OK_PRODUCT_XEM6320LX130T:
+        return("XEM6320LX130T");
+    default:
+        return("UNKNOWN");
+    }
+}
@@ -0,0 +1,61 @@
+//----------------------------------------------------------------------------------
+// rhd2000frontpaneltransport.h
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000FrontPanelTransport Class Header File
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+
+#ifndef RHD2000FRONTPANELTRANSPORT_H
+#define RHD2000FRONTPANELTRANSPORT_H
+
+#include "rhd2000transport.h"
+
+namespace OpalKellyLegacy
+{
+    class okCFrontPanel;
+}
+
+// Transport to an Opal Kelly XEM6010 (USB2) or XEM6310 (USB3) module through the
+// FrontPanel library.
+
+class Rhd2000FrontPanelTransport : public Rhd2000Transport
+{
+
+public:
+    Rhd2000FrontPanelTransport();
+    ~Rhd2000FrontPanelTransport();
+
+    int open(const char* libname) override;
+    bool isOpen() const override;
+    bool isUSB3() const override;
+    bool uploadFpgaBitfile(const std::string& filename) override;
+    bool isFpgaConfigured() override;
+    std::string getSerialNumber() const override;
+    double getSystemClockFreq() const override;
+
+    void SetWireInValue(int endPoint, unsigned int value, unsigned int mask = 0xffffffff) override;
+    void UpdateWireIns() override;
+    void UpdateWireOuts() override;
+    unsigned int GetWireOutValue(int endPoint) override;
+    void ActivateTriggerIn(int endPoint, int bit) override;
+    long ReadFromPipeOut(int endPoint, long length, unsigned char* data) override;
+    long ReadFromBlockPipeOut(int endPoint, int blockSize, long length, unsigned char* data) override;
+    void ResetFPGA() override;
+
+private:
+    OpalKellyLegacy::okCFrontPanel *dev;
+    bool usb3;
+
+    std::string opalKellyModelName(int model) const;
+
+};
+
+#endif // RHD2000FRONTPANELTRANSPORT_H
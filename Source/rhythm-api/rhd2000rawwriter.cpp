@@ -0,0 +1,358 @@
+//----------------------------------------------------------------------------------
+// rhd2000rawwriter.cpp
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000RawWriter Class
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "rhd2000rawwriter.h"
+
+#ifdef _WIN32
+#define RAW_OPEN_FLAGS (_O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY)
+#define RAW_OPEN_MODE (_S_IREAD | _S_IWRITE)
+#else
+#define RAW_OPEN_FLAGS (O_WRONLY | O_CREAT | O_TRUNC)
+#define RAW_OPEN_MODE 0644
+#endif
+
+// Byte offsets of the header fields, all little endian
+#define HEADER_VERSION_OFFSET 8
+#define HEADER_STREAMS_OFFSET 12
+#define HEADER_USB3_OFFSET 16
+#define HEADER_SIZE_OFFSET 20
+#define HEADER_SAMPLE_RATE_OFFSET 24
+
+namespace
+{
+    void putUInt32(unsigned char* p, uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i)
+            p[i] = (unsigned char) (value >> (8 * i));
+    }
+
+    uint32_t getUInt32(const unsigned char* p)
+    {
+        return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
+    void putDouble(unsigned char* p, double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        for (int i = 0; i < 8; ++i)
+            p[i] = (unsigned char) (bits >> (8 * i));
+    }
+
+    double getDouble(const unsigned char* p)
+    {
+        uint64_t bits = 0;
+        for (int i = 7; i >= 0; --i)
+            bits = (bits << 8) | p[i];
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    int openFile(const std::string& path, int flags)
+    {
+#ifdef _WIN32
+        return _open(path.c_str(), flags, RAW_OPEN_MODE);
+#else
+        return ::open(path.c_str(), flags, RAW_OPEN_MODE);
+#endif
+    }
+
+    void closeFile(int fileHandle, uint64_t length, bool truncate)
+    {
+#ifdef _WIN32
+        if (truncate)
+            _chsize_s(fileHandle, (__int64) length);
+        _close(fileHandle);
+#else
+        if (truncate && ftruncate(fileHandle, (off_t) length) != 0)
+            std::cerr << "Raw capture: could not trim padding from the end of the file." << std::endl;
+        ::close(fileHandle);
+#endif
+    }
+}
+
+Rhd2000RawWriter::Rhd2000RawWriter() :
+    fileHandle(-1),
+    directIo(false),
+    memory(0),
+    buffers(0),
+    fillCount(0),
+    writeCount(0),
+    fillOffset(0),
+    fileLength(0),
+    bytesAppended(0),
+    bytesDropped(0),
+    writeError(false),
+    closing(false)
+{
+}
+
+Rhd2000RawWriter::~Rhd2000RawWriter()
+{
+    close();
+    free(memory);
+}
+
+bool Rhd2000RawWriter::open(const std::string& path, int numDataStreams, bool usb3, double sampleRate, bool directIo_)
+{
+    close();
+
+    directIo = false;
+
+#ifdef O_DIRECT
+    if (directIo_) {
+        fileHandle = openFile(path, RAW_OPEN_FLAGS | O_DIRECT);
+        if (fileHandle >= 0)
+            directIo = true;
+        else if (errno == EINVAL)
+            std::cerr << "Raw capture: " << path << " does not support direct I/O, using buffered writes." << std::endl;
+    }
+#endif
+
+    if (fileHandle < 0)
+        fileHandle = openFile(path, RAW_OPEN_FLAGS);
+
+    if (fileHandle < 0) {
+        std::cerr << "Raw capture: could not create " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+#if defined(__APPLE__) && defined(F_NOCACHE)
+    if (directIo_)
+        directIo = fcntl(fileHandle, F_NOCACHE, 1) == 0;
+#endif
+
+    if (memory == 0) {
+        memory = (unsigned char*) malloc((size_t) RAW_WRITER_NUM_BUFFERS * RAW_WRITER_BUFFER_SIZE + RAW_WRITER_ALIGNMENT);
+        if (memory == 0) {
+            closeFile(fileHandle, 0, false);
+            fileHandle = -1;
+            return false;
+        }
+        buffers = memory + (RAW_WRITER_ALIGNMENT - (uintptr_t) memory % RAW_WRITER_ALIGNMENT);
+
+        // fault the pages in now rather than during acquisition
+        memset(buffers, 0, (size_t) RAW_WRITER_NUM_BUFFERS * RAW_WRITER_BUFFER_SIZE);
+    }
+
+    fillCount = 0;
+    writeCount = 0;
+    fileLength = 0;
+    bytesAppended = 0;
+    bytesDropped = 0;
+    writeError = false;
+    closing = false;
+
+    // the header fills the start of the first buffer, so frames stay aligned for O_DIRECT
+    unsigned char* header = getBuffer(0);
+    memset(header, 0, RAW_CAPTURE_HEADER_SIZE);
+    memcpy(header, RAW_CAPTURE_MAGIC, 8);
+    putUInt32(header + HEADER_VERSION_OFFSET, RAW_CAPTURE_VERSION);
+    putUInt32(header + HEADER_STREAMS_OFFSET, (uint32_t) numDataStreams);
+    putUInt32(header + HEADER_USB3_OFFSET, usb3 ? 1 : 0);
+    putUInt32(header + HEADER_SIZE_OFFSET, RAW_CAPTURE_HEADER_SIZE);
+    putDouble(header + HEADER_SAMPLE_RATE_OFFSET, sampleRate);
+    fillOffset = RAW_CAPTURE_HEADER_SIZE;
+
+    writer = std::thread(&Rhd2000RawWriter::run, this);
+
+    return true;
+}
+
+// Called from a single thread, together with close()
+bool Rhd2000RawWriter::append(const unsigned char* data, size_t numBytes)
+{
+    uint64_t fill;
+    size_t offset;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        size_t freeBuffers = RAW_WRITER_NUM_BUFFERS - (size_t) (fillCount - writeCount);
+
+        if (fileHandle < 0 || writeError || numBytes > freeBuffers * RAW_WRITER_BUFFER_SIZE - fillOffset) {
+            bytesDropped += numBytes;
+            return false;
+        }
+
+        fill = fillCount;
+        offset = fillOffset;
+    }
+
+    const size_t total = numBytes;
+
+    // the writer thread does not touch the buffer being filled or the free ones after it
+    while (numBytes > 0) {
+        size_t n = std::min(numBytes, (size_t) RAW_WRITER_BUFFER_SIZE - offset);
+        memcpy(getBuffer(fill) + offset, data, n);
+        data += n;
+        numBytes -= n;
+        offset += n;
+
+        if (offset == RAW_WRITER_BUFFER_SIZE) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                bufferLength[fill % RAW_WRITER_NUM_BUFFERS] = RAW_WRITER_BUFFER_SIZE;
+                fillCount = ++fill;
+            }
+            buffersQueued.notify_one();
+            offset = 0;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    fillOffset = offset;
+    bytesAppended += total;
+
+    return true;
+}
+
+void Rhd2000RawWriter::close()
+{
+    if (fileHandle < 0)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (fillOffset > 0) {
+            bufferLength[fillCount % RAW_WRITER_NUM_BUFFERS] = fillOffset;
+            ++fillCount;
+            fillOffset = 0;
+        }
+        closing = true;
+    }
+    buffersQueued.notify_one();
+    writer.join();
+
+    // O_DIRECT writes whole alignment blocks, so the last one carries padding
+    closeFile(fileHandle, fileLength, directIo);
+    fileHandle = -1;
+
+    if (writeError)
+        std::cerr << "Raw capture: write failed, the file is incomplete." << std::endl;
+}
+
+uint64_t Rhd2000RawWriter::getNumBytesAppended() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return bytesAppended;
+}
+
+uint64_t Rhd2000RawWriter::getNumBytesDropped() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return bytesDropped;
+}
+
+bool Rhd2000RawWriter::hasWriteError() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return writeError;
+}
+
+unsigned char* Rhd2000RawWriter::getBuffer(uint64_t count) const
+{
+    return buffers + (size_t) (count % RAW_WRITER_NUM_BUFFERS) * RAW_WRITER_BUFFER_SIZE;
+}
+
+void Rhd2000RawWriter::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (true)
+    {
+        buffersQueued.wait(guard, [this] { return fillCount > writeCount || closing; });
+
+        if (fillCount == writeCount)
+            break; // closing, and everything is written
+
+        unsigned char* buffer = getBuffer(writeCount);
+        size_t length = bufferLength[writeCount % RAW_WRITER_NUM_BUFFERS];
+        size_t writeLength = length;
+
+        if (directIo && length % RAW_WRITER_ALIGNMENT != 0) {
+            writeLength = (length / RAW_WRITER_ALIGNMENT + 1) * RAW_WRITER_ALIGNMENT;
+            memset(buffer + length, 0, writeLength - length);
+        }
+
+        bool failed = writeError;
+        guard.unlock();
+
+        if (!failed)
+            failed = !writeToFile(buffer, writeLength);
+
+        guard.lock();
+        writeError = failed;
+        if (!failed)
+            fileLength += length;
+        ++writeCount;
+    }
+}
+
+bool Rhd2000RawWriter::writeToFile(const unsigned char* data, size_t numBytes)
+{
+    while (numBytes > 0) {
+#ifdef _WIN32
+        int n = _write(fileHandle, data, (unsigned int) numBytes);
+#else
+        ssize_t n = ::write(fileHandle, data, numBytes);
+#endif
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            std::cerr << "Raw capture: write failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        data += n;
+        numBytes -= (size_t) n;
+    }
+    return true;
+}
+
+bool Rhd2000RawWriter::readHeader(std::istream& in, int& numDataStreams, bool& usb3, double& sampleRate)
+{
+    unsigned char header[RAW_CAPTURE_HEADER_SIZE];
+
+    if (!in.read((char*) header, HEADER_SAMPLE_RATE_OFFSET + 8) || memcmp(header, RAW_CAPTURE_MAGIC, 8) != 0)
+        return false;
+
+    uint32_t headerSize = getUInt32(header + HEADER_SIZE_OFFSET);
+
+    if (getUInt32(header + HEADER_VERSION_OFFSET) != RAW_CAPTURE_VERSION || headerSize < HEADER_SAMPLE_RATE_OFFSET + 8)
+        return false;
+
+    numDataStreams = (int) getUInt32(header + HEADER_STREAMS_OFFSET);
+    usb3 = getUInt32(header + HEADER_USB3_OFFSET) != 0;
+    sampleRate = getDouble(header + HEADER_SAMPLE_RATE_OFFSET);
+
+    in.ignore(headerSize - (HEADER_SAMPLE_RATE_OFFSET + 8));
+
+    return (bool) in;
+}
@@ -0,0 +1,113 @@
+//----------------------------------------------------------------------------------
+// rhd2000rawwriter.h
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000RawWriter Class Header File
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+
+#ifndef RHD2000RAWWRITER_H
+#define RHD2000RAWWRITER_H
+
+#define RAW_WRITER_BUFFER_SIZE (4 * 1024 * 1024)
+#define RAW_WRITER_NUM_BUFFERS 8
+#define RAW_WRITER_ALIGNMENT 4096 // satisfies O_DIRECT on common file systems
+
+// A raw capture file starts with a header block of this size, followed by the USB frames
+// exactly as they came out of the pipe
+#define RAW_CAPTURE_HEADER_SIZE RAW_WRITER_ALIGNMENT
+#define RAW_CAPTURE_MAGIC "RHYTHMRW"
+#define RAW_CAPTURE_VERSION 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Streams raw Rhythm USB data to disk.
+//
+// append() copies the pipe buffer into one of RAW_WRITER_NUM_BUFFERS large, page-aligned
+// buffers and returns; a background thread writes full buffers with one system call each.
+// append() never waits for the disk: if every buffer is still queued for writing, the data
+// is dropped and counted.  Whole appends are dropped, so the file stays frame-aligned, and
+// the gap shows up as a timestamp gap when the file is decoded.
+//
+// With directIo, the file is opened with O_DIRECT where the platform supports it, so a long
+// recording does not push everything else out of the page cache.  If the file system
+// refuses O_DIRECT, the writer falls back to buffered writes.
+//
+// The file can be replayed through BlockDecoder after skipping the header; see readHeader().
+
+class Rhd2000RawWriter
+{
+
+public:
+    Rhd2000RawWriter();
+    ~Rhd2000RawWriter();
+
+    // Creates the file and writes the header.  Returns false if the file cannot be created.
+    bool open(const std::string& path, int numDataStreams, bool usb3, double sampleRate, bool directIo = false);
+
+    // Queues numBytes of raw frames.  Returns false if they were dropped.
+    bool append(const unsigned char* data, size_t numBytes);
+
+    // Writes out everything appended so far and closes the file
+    void close();
+
+    bool isOpen() const { return fileHandle >= 0; }
+    bool isDirectIo() const { return directIo; }
+
+    // Bytes of frame data appended and dropped since open()
+    uint64_t getNumBytesAppended() const;
+    uint64_t getNumBytesDropped() const;
+
+    // True if a write to the file failed; everything after the failure is lost
+    bool hasWriteError() const;
+
+    // Reads the header of a raw capture file, leaving the stream at the first frame.
+    // Returns false if the stream does not start with a raw capture header.
+    static bool readHeader(std::istream& in, int& numDataStreams, bool& usb3, double& sampleRate);
+
+private:
+    int fileHandle;
+    bool directIo;
+
+    unsigned char* memory;      // RAW_WRITER_NUM_BUFFERS buffers, RAW_WRITER_ALIGNMENT aligned
+    unsigned char* buffers;
+    size_t bufferLength[RAW_WRITER_NUM_BUFFERS];
+
+    mutable std::mutex lock;
+    std::condition_variable buffersQueued;
+
+    // Monotonic buffer counters; the slot of a buffer is its counter modulo RAW_WRITER_NUM_BUFFERS
+    uint64_t fillCount;         // buffers handed to the writer thread
+    uint64_t writeCount;        // buffers written to the file
+    size_t fillOffset;          // bytes in the buffer being filled
+
+    uint64_t fileLength;        // bytes written without padding
+    uint64_t bytesAppended;
+    uint64_t bytesDropped;
+    bool writeError;
+    bool closing;
+
+    std::thread writer;
+
+    unsigned char* getBuffer(uint64_t count) const;
+    void run();
+    bool writeToFile(const unsigned char* data, size_t numBytes);
+
+    Rhd2000RawWriter(const Rhd2000RawWriter&);
+    Rhd2000RawWriter& operator=(const Rhd2000RawWriter&);
+};
+
+#endif // RHD2000RAWWRITER_H
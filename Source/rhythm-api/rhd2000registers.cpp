@@ -1022,3 +1022,71 @@ int Rhd2000Registers::createCommandListZcheckDac(vector<int> &commandList, doubl
 
     return commandList.size();
 }
+
+// Open Ephys addition.  Create a list of period commands (at most 1024) that drives the on-chip impedance
+// testing voltage DAC with a sum of sine waves, one at each harmonic of sampleRate / period.  Every tone
+// completes a whole number of cycles in the list, so the waveform repeats seamlessly.  The tones start at
+// Schroeder phases, which keep the peak of the sum low, and share one amplitude (in DAC steps), scaled so
+// that the peak of the sum equals amplitude (0-128).  That per-tone amplitude is returned in toneAmplitude
+// and the starting phase of each tone (in radians, tone = toneAmplitude * sin(2 pi h t / period + phase))
+// in tonePhases.
+// Returns the length of the command list.
+int Rhd2000Registers::createCommandListZcheckDacMultiTone(vector<int> &commandList, int period,
+                                                          const vector<int> &harmonics, double amplitude,
+                                                          double &toneAmplitude, vector<double> &tonePhases)
+{
+    int i, k, value;
+    double peak;
+    const double Pi = 2*acos(0.0);
+    const int numTones = (int) harmonics.size();
+
+    commandList.clear();    // if command list already exists, erase it and start a new one
+    tonePhases.clear();
+    toneAmplitude = 0.0;
+
+    if (amplitude < 0.0 || amplitude > 128.0) {
+        cerr << "Error in Rhd2000Registers::createCommandListZcheckDacMultiTone: Amplitude out of range." << endl;
+        return -1;
+    }
+    if (period < 4 || period > MaxCommandLength) {
+        cerr << "Error in Rhd2000Registers::createCommandListZcheckDacMultiTone: Period out of range." << endl;
+        return -1;
+    }
+    if (numTones == 0) {
+        cerr << "Error in Rhd2000Registers::createCommandListZcheckDacMultiTone: No tones given." << endl;
+        return -1;
+    }
+    for (k = 0; k < numTones; ++k) {
+        if (harmonics[k] < 1 || 4 * harmonics[k] > period) {
+            cerr << "Error in Rhd2000Registers::createCommandListZcheckDacMultiTone: " <<
+                    "Harmonic " << harmonics[k] << " out of range." << endl;
+            return -1;
+        }
+        tonePhases.push_back(-Pi * k * (k - 1) / numTones);
+    }
+
+    vector<double> waveform(period, 0.0);
+    peak = 0.0;
+    for (i = 0; i < period; ++i) {
+        for (k = 0; k < numTones; ++k) {
+            waveform[i] += sin(2 * Pi * harmonics[k] * i / period + tonePhases[k]);
+        }
+        if (fabs(waveform[i]) > peak) {
+            peak = fabs(waveform[i]);
+        }
+    }
+
+    toneAmplitude = amplitude / peak;
+
+    for (i = 0; i < period; ++i) {
+        value = (int) floor(toneAmplitude * waveform[i] + 128.0 + 0.5);
+        if (value < 0) {
+            value = 0;
+        } else if (value > 255) {
+            value = 255;
+        }
+        commandList.push_back(createRhd2000Command(Rhd2000CommandRegWrite, 6, value));
+    }
+
+    return commandList.size();
+}
@@ -75,6 +75,8 @@ public:
     int createCommandListTempSensor(std::vector<int> &commandList);
     int createCommandListUpdateDigOut(std::vector<int> &commandList);
     int createCommandListZcheckDac(std::vector<int> &commandList, double frequency, double amplitude);
+    int createCommandListZcheckDacMultiTone(std::vector<int> &commandList, int period, const std::vector<int> &harmonics,
+                                            double amplitude, double &toneAmplitude, std::vector<double> &tonePhases);
 
     enum Rhd2000CommandType {
         Rhd2000CommandConvert,
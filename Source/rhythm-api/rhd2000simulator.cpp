@@ -0,0 +1,657 @@
+//----------------------------------------------------------------------------------
+// rhd2000simulator.cpp
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000Simulator Class
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+#ifdef _WIN32
+#define NOMINMAX
+#endif
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+#include "rhd2000simulator.h"
+#include "rhd2000evalboard.h"
+#include "rhd2000datablock.h"
+
+typedef Rhd2000EvalBoard Board;
+
+Rhd2000Simulator::Rhd2000Simulator(bool usb3_)
+{
+    usb3 = usb3_;
+    opened = false;
+    configured = false;
+
+    for (int line = 0; line < SIMULATOR_NUM_MISO_LINES; ++line) {
+        setChip(line, usb3 ? Rhd2164 : Rhd2132);
+    }
+
+    // 3 ft cables
+    for (int port = 0; port < 4; ++port) {
+        setGoodCableDelays(port, 1, 3);
+    }
+
+    pipeBytesPerSecond = usb3 ? SIMULATOR_USB3_BYTES_PER_SECOND : SIMULATOR_USB2_BYTES_PER_SECOND;
+    pipeBusyUntil = Clock::now();
+
+    // ~200 Hz at 30 kS/s, 78 uV amplitude
+    waveform.resize(1024);
+    for (int i = 0; i < 1024; ++i) {
+        waveform[i] = (int16_t) std::lround(400.0 * std::sin(2.0 * 3.14159265358979 * i / 1024.0));
+    }
+
+    powerOn();
+}
+
+Rhd2000Simulator::~Rhd2000Simulator()
+{
+}
+
+void Rhd2000Simulator::setChip(int misoLine, ChipType chip)
+{
+    const char* name;
+    int numAmplifiers;
+
+    if (misoLine < 0 || misoLine >= SIMULATOR_NUM_MISO_LINES) {
+        std::cerr << "Error in Rhd2000Simulator::setChip: MISO line out of range." << std::endl;
+        return;
+    }
+
+    switch (chip) {
+    case Rhd2216:
+        name = "RHD2216";
+        numAmplifiers = 16;
+        break;
+    case Rhd2164:
+        name = "RHD2164";
+        numAmplifiers = 64;
+        break;
+    default:
+        name = "RHD2132";
+        numAmplifiers = 32;
+        break;
+    }
+
+    std::lock_guard<std::mutex> sl(lock);
+
+    Chip& c = chips[misoLine];
+
+    c.type = chip;
+    memset(c.registers, 0, sizeof(c.registers));
+
+    // ROM registers
+    memcpy(c.registers + 40, "INTAN", 5);
+    memcpy(c.registers + 48, name, 7);
+    c.registers[60] = 0;             // die revision
+    c.registers[61] = 1;             // unipolar amplifiers
+    c.registers[62] = numAmplifiers;
+    c.registers[63] = chip;          // chip ID
+}
+
+void Rhd2000Simulator::setGoodCableDelays(int port, int firstDelay, int lastDelay)
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    for (int line = 2 * port; line < 2 * port + 2 && line < SIMULATOR_NUM_MISO_LINES; ++line) {
+        chips[line].firstGoodDelay = firstDelay;
+        chips[line].lastGoodDelay = lastDelay;
+    }
+}
+
+void Rhd2000Simulator::setPipeBandwidth(double bytesPerSecond)
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    pipeBytesPerSecond = bytesPerSecond;
+}
+
+uint64_t Rhd2000Simulator::getNumDroppedSamples() const
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    return numDroppedSamples;
+}
+
+int Rhd2000Simulator::open(const char* /* libname */)
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    opened = true;
+
+    std::cout << "Opened simulated Opal Kelly " << (usb3 ? "XEM6310LX45" : "XEM6010LX45") << std::endl << std::endl;
+
+    return 1;
+}
+
+bool Rhd2000Simulator::isOpen() const
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    return opened;
+}
+
+bool Rhd2000Simulator::isUSB3() const
+{
+    return usb3;
+}
+
+// The simulated FPGA always runs Rhythm, so the bitfile is not read.
+bool Rhd2000Simulator::uploadFpgaBitfile(const std::string& filename)
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    if (!opened) {
+        std::cerr << "FPGA configuration failed: Device not open." << std::endl;
+        return false;
+    }
+
+    powerOn();
+    configured = true;
+
+    std::cout << "Simulated Rhythm FPGA configured (" << filename << " is not loaded)" << std::endl;
+
+    return true;
+}
+
+bool Rhd2000Simulator::isFpgaConfigured()
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    return opened && configured;
+}
+
+std::string Rhd2000Simulator::getSerialNumber() const
+{
+    return usb3 ? "SIMULATED-USB3" : "SIMULATED-USB2";
+}
+
+double Rhd2000Simulator::getSystemClockFreq() const
+{
+    return 100.0;
+}
+
+void Rhd2000Simulator::SetWireInValue(int endPoint, unsigned int value, unsigned int mask)
+{
+    if (endPoint < 0 || endPoint >= 32)
+        return;
+
+    std::lock_guard<std::mutex> sl(lock);
+
+    pendingWireIns[endPoint] = (pendingWireIns[endPoint] & ~mask) | (value & mask);
+}
+
+void Rhd2000Simulator::UpdateWireIns()
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    Clock::time_point now = Clock::now();
+
+    // samples acquired up to now were taken with the old settings
+    advance(now);
+
+    memcpy(wireIns, pendingWireIns, sizeof(wireIns));
+
+    if (wireIns[Board::WireInResetRun] & 0x01) {
+        resetBoard();
+    }
+
+    // stops a run that has passed a new maxTimeStep
+    advance(now);
+}
+
+void Rhd2000Simulator::UpdateWireOuts()
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    advance(Clock::now());
+    updateWireOutValues();
+}
+
+unsigned int Rhd2000Simulator::GetWireOutValue(int endPoint)
+{
+    if (endPoint < 0x20 || endPoint >= 0x40)
+        return 0;
+
+    std::lock_guard<std::mutex> sl(lock);
+
+    return wireOuts[endPoint - 0x20];
+}
+
+void Rhd2000Simulator::ActivateTriggerIn(int endPoint, int bit)
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    Clock::time_point now = Clock::now();
+
+    advance(now);
+
+    switch (endPoint) {
+    case Board::TrigInDcmProg:
+    {
+        // FPGA internal clock = 100 MHz * (M/D) / 2, and one sample takes 2800 clock cycles
+        unsigned int M = wireIns[Board::WireInDataFreqPll] >> 8;
+        unsigned int D = wireIns[Board::WireInDataFreqPll] & 0xff;
+
+        if (M > 0 && D > 0) {
+            sampleRate = 100.0e6 * M / D / 2.0 / 2800.0;
+
+            // keep the samples already acquired in a running acquisition
+            runStartTime = now - std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(runSamplesAcquired / sampleRate));
+        }
+        break;
+    }
+    case Board::TrigInSpiStart:
+        startRun(now);
+        break;
+    case Board::TrigInRamWrite:
+        if (bit >= 0 && bit < 3) {
+            unsigned int address = wireIns[Board::WireInCmdRamAddr] % SIMULATOR_AUX_COMMAND_RAM_SIZE;
+            unsigned int bank = wireIns[Board::WireInCmdRamBank] % SIMULATOR_NUM_AUX_BANKS;
+
+            commandRam[(bit * SIMULATOR_NUM_AUX_BANKS + bank) * SIMULATOR_AUX_COMMAND_RAM_SIZE + address] =
+                (uint16_t) wireIns[Board::WireInCmdRamData];
+        }
+        break;
+    default:
+        // DAC, fast settle, digital output and Open Ephys triggers don't affect the data stream
+        break;
+    }
+}
+
+long Rhd2000Simulator::ReadFromPipeOut(int /* endPoint */, long length, unsigned char* data)
+{
+    return readPipe(length, data);
+}
+
+long Rhd2000Simulator::ReadFromBlockPipeOut(int /* endPoint */, int /* blockSize */, long length, unsigned char* data)
+{
+    return readPipe(length, data);
+}
+
+void Rhd2000Simulator::ResetFPGA()
+{
+    std::lock_guard<std::mutex> sl(lock);
+
+    powerOn();
+}
+
+// Power-on state of the FPGA.  Called with the lock held.
+void Rhd2000Simulator::powerOn()
+{
+    memset(pendingWireIns, 0, sizeof(pendingWireIns));
+    memset(wireIns, 0, sizeof(wireIns));
+    memset(wireOuts, 0, sizeof(wireOuts));
+
+    numDroppedSamples = 0;
+
+    resetBoard();
+    updateWireOutValues();
+}
+
+// Clears the aux command RAM and the FIFO, stops any run and returns to 30 kS/s.  Called
+// with the lock held.
+void Rhd2000Simulator::resetBoard()
+{
+    commandRam.assign(3 * SIMULATOR_NUM_AUX_BANKS * SIMULATOR_AUX_COMMAND_RAM_SIZE, 0);
+
+    sampleRate = 30000.0;
+    running = false;
+    runSamplesAcquired = 0;
+    nextTimeStamp = 0;
+
+    fifo.clear();
+    numSamplesInFifo = 0;
+    frameByteOffset = 0;
+}
+
+void Rhd2000Simulator::startRun(Clock::time_point now)
+{
+    running = true;
+    runStartTime = now;
+    runSamplesAcquired = 0;
+}
+
+// Moves the samples acquired since the last call into the FIFO, and ends runs that have
+// reached maxTimeStep.  Called with the lock held.
+void Rhd2000Simulator::advance(Clock::time_point now)
+{
+    if (!running)
+        return;
+
+    uint64_t due = (uint64_t) (std::chrono::duration<double>(now - runStartTime).count() * sampleRate);
+
+    if (!isContinuous()) {
+        due = std::min(due, (uint64_t) getMaxTimeStep());
+    }
+
+    if (due > runSamplesAcquired) {
+        uint64_t numNew = due - runSamplesAcquired;
+
+        uint64_t capacity = Board::fifoCapacityInWords() / (getFrameSizeInBytes() / 2);
+        uint64_t numFree = capacity > numSamplesInFifo ? capacity - numSamplesInFifo : 0;
+        uint64_t numAccepted = std::min(numNew, numFree);
+
+        if (numAccepted > 0) {
+            if (!fifo.empty() &&
+                fifo.back().runSample + fifo.back().numSamples == runSamplesAcquired &&
+                (uint32_t) (fifo.back().timeStamp + fifo.back().numSamples) == nextTimeStamp) {
+                fifo.back().numSamples += numAccepted;
+            } else {
+                FifoSegment segment = { nextTimeStamp, runSamplesAcquired, numAccepted };
+                fifo.push_back(segment);
+            }
+
+            numSamplesInFifo += numAccepted;
+        }
+
+        // samples that don't fit are lost, but the timestamp keeps counting
+        numDroppedSamples += numNew - numAccepted;
+        nextTimeStamp += (uint32_t) numNew;
+        runSamplesAcquired = due;
+    }
+
+    if (!isContinuous() && runSamplesAcquired >= getMaxTimeStep()) {
+        running = false;
+    }
+}
+
+void Rhd2000Simulator::updateWireOutValues()
+{
+    uint64_t numWords = std::min(getNumWordsInFifo(), (uint64_t) 0xffffffff);
+
+    wireOuts[Board::WireOutNumWordsLsb - 0x20] = (unsigned int) (numWords & 0xffff);
+    wireOuts[Board::WireOutNumWordsMsb - 0x20] = (unsigned int) (numWords >> 16);
+    wireOuts[Board::WireOutSpiRunning - 0x20] = running ? 1 : 0;
+    wireOuts[Board::WireOutTtlIn - 0x20] = ttlInValue(nextTimeStamp);
+    wireOuts[Board::WireOutDataClkLocked - 0x20] = 0x0003;   // DCM programming done, clock locked
+    wireOuts[Board::WireOutBoardMode - 0x20] = 0;
+    wireOuts[Board::WireOutInFifo - 0x20] = 0;
+    wireOuts[Board::WireOutOutFifo - 0x20] = 0;
+    wireOuts[Board::WireOutDdr - 0x20] = usb3 ? (unsigned int) (numWords / DDR_BLOCK_SIZE) : 0;
+    wireOuts[Board::WireOutBoardId - 0x20] = usb3 ? RHYTHM_BOARD_ID_USB3 : RHYTHM_BOARD_ID_USB2;
+    wireOuts[Board::WireOutBoardVersion - 0x20] = 1;
+}
+
+// Rebuilds the list of enabled streams and their sources from the wire-ins.  Called
+// with the lock held.
+void Rhd2000Simulator::updateStreamSources()
+{
+    int maxStreams = usb3 ? MAX_NUM_DATA_STREAMS_USB3 : MAX_NUM_DATA_STREAMS_USB2;
+
+    streams.clear();
+
+    for (int stream = 0; stream < maxStreams; ++stream) {
+        if ((wireIns[Board::WireInDataStreamEn] & (1 << stream)) == 0)
+            continue;
+
+        // streams 8-15 use the upper halves of the stream selection wire-ins
+        int endPoint = (stream % 8) < 4 ? Board::WireInDataStreamSel1234 : Board::WireInDataStreamSel5678;
+        int bitShift = 4 * (stream % 4) + (stream >= 8 ? 16 : 0);
+        int dataSource = (wireIns[endPoint] >> bitShift) & 0x0f;
+
+        StreamSource source;
+        source.misoLine = dataSource & 0x07;
+        source.port = source.misoLine / 2;
+        source.ddr = dataSource >= 8;
+
+        const Chip& chip = chips[source.misoLine];
+        int delay = (wireIns[Board::WireInMisoDelay] >> (4 * source.port)) & 0x0f;
+
+        source.valid = chip.type != NoChip &&
+                       (!source.ddr || chip.type == Rhd2164) &&
+                       delay >= chip.firstGoodDelay && delay <= chip.lastGoodDelay;
+
+        streams.push_back(source);
+    }
+}
+
+int Rhd2000Simulator::getFrameSizeInBytes() const
+{
+    int maxStreams = usb3 ? MAX_NUM_DATA_STREAMS_USB3 : MAX_NUM_DATA_STREAMS_USB2;
+    int numStreams = 0;
+
+    for (int stream = 0; stream < maxStreams; ++stream) {
+        if (wireIns[Board::WireInDataStreamEn] & (1 << stream))
+            ++numStreams;
+    }
+
+    return 2 * Rhd2000DataBlock::calculateDataBlockSizeInWords(numStreams, usb3, 1);
+}
+
+uint64_t Rhd2000Simulator::getNumWordsInFifo() const
+{
+    return (numSamplesInFifo * getFrameSizeInBytes() - frameByteOffset) / 2;
+}
+
+unsigned int Rhd2000Simulator::getMaxTimeStep() const
+{
+    return (wireIns[Board::WireInMaxTimeStepMsb] << 16) + (wireIns[Board::WireInMaxTimeStepLsb] & 0xffff);
+}
+
+bool Rhd2000Simulator::isContinuous() const
+{
+    return (wireIns[Board::WireInResetRun] & 0x02) != 0;
+}
+
+// Commands run from index 0 to the end index, then repeat from the loop index.
+int Rhd2000Simulator::getAuxCommandIndex(int slot, uint64_t runSample) const
+{
+    uint64_t endIndex = wireIns[Board::WireInAuxCmdLength1 + slot] % SIMULATOR_AUX_COMMAND_RAM_SIZE;
+    uint64_t loopIndex = wireIns[Board::WireInAuxCmdLoop1 + slot] % SIMULATOR_AUX_COMMAND_RAM_SIZE;
+
+    if (runSample <= endIndex)
+        return (int) runSample;
+
+    if (loopIndex > endIndex)
+        return (int) endIndex;
+
+    return (int) (loopIndex + (runSample - endIndex - 1) % (endIndex - loopIndex + 1));
+}
+
+// Returns a chip's response to one auxiliary command.
+uint16_t Rhd2000Simulator::executeCommand(const StreamSource& source, uint16_t command, uint32_t timeStamp)
+{
+    if (!source.valid)
+        return 0xffff;
+
+    Chip& chip = chips[source.misoLine];
+    int address = (command >> 8) & 0x3f;
+
+    if ((command & 0xc000) == 0xc000) {
+        // READ; register 59 tells MISO A and B of an RHD2164 apart
+        if (address == 59)
+            return chip.type == Rhd2164 ? (source.ddr ? 58 : 53) : 0;
+
+        return chip.registers[address];
+    }
+
+    if ((command & 0xc000) == 0x8000) {
+        // WRITE; only RAM registers (0-21) can be written
+        if (address < 22)
+            chip.registers[address] = command & 0xff;
+
+        return 0xff00 | (command & 0xff);
+    }
+
+    if (command == 0x5500 || command == 0x6a00) {
+        // CALIBRATE, CLEAR
+        return 0;
+    }
+
+    // CONVERT
+    if (address < 32)
+        return amplifierValue(source, address, timeStamp);
+
+    if (address == 48)
+        return 44118;   // 3.3 V supply
+
+    return 32768;       // auxiliary inputs and temperature sensor at mid-scale
+}
+
+uint16_t Rhd2000Simulator::amplifierValue(const StreamSource& source, int channel, uint32_t timeStamp) const
+{
+    if (!source.valid)
+        return 0xffff;
+
+    int chipChannel = channel + (source.ddr ? 32 : 0);
+
+    return (uint16_t) (32768 + waveform[(timeStamp * 7 + chipChannel * 64 + source.misoLine * 16) & 1023]);
+}
+
+// 1 Hz square wave on digital input 0
+uint16_t Rhd2000Simulator::ttlInValue(uint32_t timeStamp) const
+{
+    uint32_t halfPeriod = std::max((uint32_t) (sampleRate / 2.0), (uint32_t) 1);
+
+    return (timeStamp / halfPeriod) & 0x0001;
+}
+
+static inline unsigned char* putWord(unsigned char* p, uint16_t word)
+{
+    p[0] = (unsigned char) (word & 0xff);
+    p[1] = (unsigned char) (word >> 8);
+    return p + 2;
+}
+
+// Writes one USB frame in the layout read by Rhd2000DataBlock::fillFromUsbBuffer().  Called
+// with the lock held.
+void Rhd2000Simulator::writeFrame(uint32_t timeStamp, uint64_t runSample, unsigned char* out)
+{
+    unsigned long long magic = RHD2000_HEADER_MAGIC_NUMBER;
+    unsigned char* p = out;
+    int numStreams = (int) streams.size();
+
+    for (int i = 0; i < 8; ++i) {
+        *p++ = (unsigned char) (magic >> (8 * i));
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        *p++ = (unsigned char) (timeStamp >> (8 * i));
+    }
+
+    // each sample carries the results of the previous sample's auxiliary commands
+    for (int slot = 0; slot < 3; ++slot) {
+        int index = runSample > 0 ? getAuxCommandIndex(slot, runSample - 1) : -1;
+
+        for (int stream = 0; stream < numStreams; ++stream) {
+            const StreamSource& source = streams[stream];
+
+            if (index < 0) {
+                p = putWord(p, 0);
+                continue;
+            }
+
+            int bank = (wireIns[Board::WireInAuxCmdBank1 + slot] >> (4 * source.port)) & 0x0f;
+            uint16_t command = commandRam[(slot * SIMULATOR_NUM_AUX_BANKS + bank) * SIMULATOR_AUX_COMMAND_RAM_SIZE + index];
+
+            p = putWord(p, executeCommand(source, command, timeStamp));
+        }
+    }
+
+    for (int channel = 0; channel < 32; ++channel) {
+        for (int stream = 0; stream < numStreams; ++stream) {
+            p = putWord(p, amplifierValue(streams[stream], channel, timeStamp));
+        }
+    }
+
+    // filler word
+    for (int stream = 0; stream < numStreams; ++stream) {
+        p = putWord(p, 0);
+    }
+
+    for (int adc = 0; adc < 8; ++adc) {
+        p = putWord(p, 32768);
+    }
+
+    p = putWord(p, ttlInValue(timeStamp));
+    p = putWord(p, (uint16_t) wireIns[Board::WireInTtlOut]);
+}
+
+// Reads length bytes from the FIFO, waiting for a running acquisition to produce them.  Returns
+// the number of bytes read, or PipeTimeout if the FIFO did not hold enough data in time (the
+// rest of the buffer is then zero-filled).
+long Rhd2000Simulator::readPipe(long length, unsigned char* data)
+{
+    std::unique_lock<std::mutex> sl(lock);
+
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(SIMULATOR_PIPE_TIMEOUT_MS);
+    long numRead = 0;
+    bool timedOut = false;
+
+    while (true) {
+        advance(Clock::now());
+        updateStreamSources();
+
+        int frameBytes = getFrameSizeInBytes();
+        frameBuffer.resize(frameBytes);
+
+        while (numRead < length && !fifo.empty()) {
+            FifoSegment& segment = fifo.front();
+
+            if (frameByteOffset == 0 && length - numRead >= frameBytes) {
+                writeFrame(segment.timeStamp, segment.runSample, data + numRead);
+                numRead += frameBytes;
+            } else {
+                writeFrame(segment.timeStamp, segment.runSample, frameBuffer.data());
+
+                int numBytes = (int) std::min(length - numRead, (long) (frameBytes - frameByteOffset));
+                memcpy(data + numRead, frameBuffer.data() + frameByteOffset, numBytes);
+
+                numRead += numBytes;
+                frameByteOffset += numBytes;
+
+                if (frameByteOffset < frameBytes)
+                    break;
+
+                frameByteOffset = 0;
+            }
+
+            ++segment.timeStamp;
+            ++segment.runSample;
+            --numSamplesInFifo;
+
+            if (--segment.numSamples == 0)
+                fifo.pop_front();
+        }
+
+        if (numRead == length)
+            break;
+
+        if (!running || Clock::now() >= deadline) {
+            memset(data + numRead, 0, length - numRead);
+            timedOut = true;
+            break;
+        }
+
+        sl.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        sl.lock();
+    }
+
+    // the transfer occupies the pipe for as long as the USB link needs to move it
+    if (pipeBytesPerSecond > 0) {
+        Clock::time_point start = std::max(Clock::now(), pipeBusyUntil);
+
+        pipeBusyUntil = start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(length / pipeBytesPerSecond));
+
+        Clock::time_point busyUntil = pipeBusyUntil;
+
+        sl.unlock();
+        std::this_thread::sleep_until(busyUntil);
+    }
+
+    return timedOut ? PipeTimeout : length;
+}
@@ -0,0 +1,178 @@
+//----------------------------------------------------------------------------------
+// rhd2000simulator.h
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000Simulator Class Header File
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+
+#ifndef RHD2000SIMULATOR_H
+#define RHD2000SIMULATOR_H
+
+#define SIMULATOR_NUM_MISO_LINES 8
+#define SIMULATOR_NUM_AUX_BANKS 16
+#define SIMULATOR_AUX_COMMAND_RAM_SIZE 1024
+#define SIMULATOR_PIPE_TIMEOUT_MS 1000
+
+// Sustained pipe throughput of a XEM6010 (USB2) and XEM6310 (USB3), in bytes per second
+#define SIMULATOR_USB2_BYTES_PER_SECOND 38.0e6
+#define SIMULATOR_USB3_BYTES_PER_SECOND 340.0e6
+
+#include <stdint.h>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "rhd2000transport.h"
+
+// In-process emulation of a Rhythm FPGA, for profiling and load-testing without an
+// Opal Kelly module.
+//
+// Implements the Rhythm wire-in, trigger-in and wire-out map used by Rhd2000EvalBoard,
+// the three auxiliary command RAMs (16 banks of 1024 commands each), and a USB FIFO
+// that fills in real time at the programmed sample rate.  Each of the 8 MISO lines can
+// carry a simulated RHD2132, RHD2216 or RHD2164; RHD2164s also answer on the DDR
+// data sources.  The chips execute the auxiliary commands (register reads and writes,
+// ADC conversions) and return their ROM contents, so headstage detection works as with
+// real hardware.  A chip only returns valid data while its port's MISO delay is within
+// a configurable window, so the cable delay scan finds it.
+//
+// The FIFO holds only the timestamps of the samples it contains; frames are synthesized
+// when they are read, so a full 128 MB FIFO costs no memory.  Samples that arrive while
+// the FIFO is full are lost, as on the board, which leaves a gap in the timestamps.
+// Pipe reads are throttled to the USB bandwidth of the simulated module.
+//
+// All methods are thread-safe.
+
+class Rhd2000Simulator : public Rhd2000Transport
+{
+
+public:
+    enum ChipType {
+        NoChip = 0,
+        Rhd2132 = 1,
+        Rhd2216 = 2,
+        Rhd2164 = 4
+    };
+
+    // Simulates a XEM6310 (usb3 == true) or XEM6010.  USB3 boards start with an RHD2164 on
+    // every MISO line (16 data streams); USB2 boards with an RHD2132 on every line (8 streams).
+    explicit Rhd2000Simulator(bool usb3);
+    ~Rhd2000Simulator();
+
+    // Connects a chip to a MISO line (0 = Port A1, 1 = Port A2, ... 7 = Port D2)
+    void setChip(int misoLine, ChipType chip);
+
+    // Chips on this port (0-3) return valid data for MISO delays from firstDelay to lastDelay
+    void setGoodCableDelays(int port, int firstDelay, int lastDelay);
+
+    // Limits the pipe read throughput; 0 removes the limit
+    void setPipeBandwidth(double bytesPerSecond);
+
+    // Number of samples lost because the FIFO was full
+    uint64_t getNumDroppedSamples() const;
+
+    int open(const char* libname) override;
+    bool isOpen() const override;
+    bool isUSB3() const override;
+    bool uploadFpgaBitfile(const std::string& filename) override;
+    bool isFpgaConfigured() override;
+    std::string getSerialNumber() const override;
+    double getSystemClockFreq() const override;
+
+    void SetWireInValue(int endPoint, unsigned int value, unsigned int mask = 0xffffffff) override;
+    void UpdateWireIns() override;
+    void UpdateWireOuts() override;
+    unsigned int GetWireOutValue(int endPoint) override;
+    void ActivateTriggerIn(int endPoint, int bit) override;
+    long ReadFromPipeOut(int endPoint, long length, unsigned char* data) override;
+    long ReadFromBlockPipeOut(int endPoint, int blockSize, long length, unsigned char* data) override;
+    void ResetFPGA() override;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Chip {
+        ChipType type;
+        int firstGoodDelay;
+        int lastGoodDelay;
+        unsigned char registers[64];
+    };
+
+    // Consecutive samples waiting in the FIFO
+    struct FifoSegment {
+        uint32_t timeStamp;
+        uint64_t runSample;   // sample index since the start of the run, for the aux command sequencer
+        uint64_t numSamples;
+    };
+
+    // Where an enabled data stream gets its data from
+    struct StreamSource {
+        int misoLine;
+        int port;
+        bool ddr;
+        bool valid;   // a chip answers on this source at the current MISO delay
+    };
+
+    mutable std::mutex lock;
+
+    bool usb3;
+    bool opened;
+    bool configured;
+
+    unsigned int pendingWireIns[32];
+    unsigned int wireIns[32];
+    unsigned int wireOuts[32];
+
+    std::vector<uint16_t> commandRam; // [slot][bank][index]
+
+    Chip chips[SIMULATOR_NUM_MISO_LINES];
+
+    double sampleRate;
+    bool running;
+    Clock::time_point runStartTime;
+    uint64_t runSamplesAcquired;
+    uint32_t nextTimeStamp;
+
+    std::deque<FifoSegment> fifo;
+    uint64_t numSamplesInFifo;
+    int frameByteOffset;          // bytes of the oldest frame already read
+    uint64_t numDroppedSamples;
+
+    double pipeBytesPerSecond;
+    Clock::time_point pipeBusyUntil;
+
+    std::vector<StreamSource> streams;
+    std::vector<unsigned char> frameBuffer;
+    std::vector<int16_t> waveform;
+
+    void powerOn();
+    void resetBoard();
+    void advance(Clock::time_point now);
+    void startRun(Clock::time_point now);
+    void updateWireOutValues();
+    void updateStreamSources();
+
+    int getFrameSizeInBytes() const;
+    uint64_t getNumWordsInFifo() const;
+    unsigned int getMaxTimeStep() const;
+    bool isContinuous() const;
+    int getAuxCommandIndex(int slot, uint64_t runSample) const;
+    uint16_t executeCommand(const StreamSource& source, uint16_t command, uint32_t timeStamp);
+    uint16_t amplifierValue(const StreamSource& source, int channel, uint32_t timeStamp) const;
+    uint16_t ttlInValue(uint32_t timeStamp) const;
+
+    void writeFrame(uint32_t timeStamp, uint64_t runSample, unsigned char* out);
+    long readPipe(long length, unsigned char* data);
+
+};
+
+#endif // RHD2000SIMULATOR_H
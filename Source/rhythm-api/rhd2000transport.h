@@ -0,0 +1,69 @@
+//----------------------------------------------------------------------------------
+// rhd2000transport.h
+//
+// Open Ephys addition to the Intan Technologies RHD2000 Rhythm Interface API
+// Rhd2000Transport Class Header File
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any applications that
+// use Intan Technologies integrated circuits, and to alter it and redistribute it
+// freely.
+//----------------------------------------------------------------------------------
+
+#ifndef RHD2000TRANSPORT_H
+#define RHD2000TRANSPORT_H
+
+#include <string>
+
+// Connection between Rhd2000EvalBoard and a Rhythm FPGA.
+//
+// The wire, trigger and pipe methods mirror the subset of okCFrontPanel that the
+// Rhythm API uses, with the same names and semantics, so Rhd2000EvalBoard can talk
+// to either a real Opal Kelly module or a simulated one.  Device discovery and FPGA
+// configuration differ between transports, so they are separate methods.
+
+class Rhd2000Transport
+{
+
+public:
+    virtual ~Rhd2000Transport() {}
+
+    // Returned by the pipe reads when a transfer times out (same value as ok_Timeout)
+    static const long PipeTimeout = -2;
+
+    // Find and open a Rhythm-capable device.  Returns 1 if successful, -1 if the driver
+    // library cannot be loaded, and -2 if no device can be found.
+    virtual int open(const char* libname) = 0;
+    virtual bool isOpen() const = 0;
+    virtual bool isUSB3() const = 0;
+
+    // Configures the FPGA.  Returns true if it is ready to accept wire-ins.
+    virtual bool uploadFpgaBitfile(const std::string& filename) = 0;
+
+    // True if the FPGA holds a configuration that talks to the host, e.g. one uploaded
+    // by an earlier session; its wire-outs can then be read without configuring it again
+    virtual bool isFpgaConfigured() = 0;
+
+    // Serial number of the open device
+    virtual std::string getSerialNumber() const = 0;
+
+    // System clock frequency in MHz
+    virtual double getSystemClockFreq() const = 0;
+
+    virtual void SetWireInValue(int endPoint, unsigned int value, unsigned int mask = 0xffffffff) = 0;
+    virtual void UpdateWireIns() = 0;
+    virtual void UpdateWireOuts() = 0;
+    virtual unsigned int GetWireOutValue(int endPoint) = 0;
+    virtual void ActivateTriggerIn(int endPoint, int bit) = 0;
+
+    // Both return the number of bytes read, or a negative error code
+    virtual long ReadFromPipeOut(int endPoint, long length, unsigned char* data) = 0;
+    virtual long ReadFromBlockPipeOut(int endPoint, int blockSize, long length, unsigned char* data) = 0;
+
+    virtual void ResetFPGA() = 0;
+};
+
+#endif // RHD2000TRANSPORT_H